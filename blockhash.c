@@ -0,0 +1,373 @@
+/* virt-bmap block hashes
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Every byte of a file passes through the examiner when it is read,
+ * so the examiner can hash it too (see hashes= in examiner.c), which
+ * gives a manifest of the contents of each file without reading the
+ * disk again.  The manifest has one line per block of each read:
+ *
+ *   1 941000 941400 9f5ad2c2e7a3b1c4 f /dev/sda1 /.vmlinuz-3.11.10-301.fc20.x86_64.hmac
+ *
+ * ie. a block map line with the XXH64 hash of the data in the range
+ * before the object.  Ranges are aligned blocks, except where a read
+ * starts or ends in the middle of one.  Lines come in the order the
+ * blocks were hashed, not sorted.
+ *
+ * The examiner's read path only copies the data onto a queue.  The
+ * hashing and writing are done by a few threads taking reads off the
+ * queue, which is limited to MAX_QUEUED bytes so that the examiner
+ * waits if they fall behind.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <pthread.h>
+
+#include "blockhash.h"
+#include "output.h"
+
+#define MAX_QUEUED (64*1024*1024)
+
+/* A read waiting to be hashed, with the data and object after it. */
+struct job {
+  struct job *next;
+  int disk;
+  uint64_t offset;
+  uint32_t count;
+  const char *object;
+  unsigned char data[];
+};
+
+struct blockhash {
+  unsigned block_shift;
+  unsigned nr_threads;
+  pthread_t *threads;
+
+  /* NB: acquire 'lock' before accessing these. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* a job was queued, or 'finish' set */
+  pthread_cond_t space;         /* a job was hashed */
+  struct job *head, *tail;
+  size_t queued;                /* bytes of data in the queue */
+  int finish;
+  int error;                    /* errno of first error, or 0 */
+
+  pthread_mutex_t output_lock;
+  struct output *o;
+};
+
+/* XXH64, see https://github.com/Cyan4973/xxHash */
+#define PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64 (const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le64toh (v);
+}
+
+static inline uint32_t
+read32 (const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le32toh (v);
+}
+
+static inline uint64_t
+xxh64_round (uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  return rotl64 (acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge (uint64_t acc, uint64_t v)
+{
+  acc ^= xxh64_round (0, v);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t
+blockhash_xxh64 (const void *buf, size_t len, uint64_t seed)
+{
+  const unsigned char *p = buf, *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+
+    do {
+      v1 = xxh64_round (v1, read64 (p));
+      v2 = xxh64_round (v2, read64 (p + 8));
+      v3 = xxh64_round (v3, read64 (p + 16));
+      v4 = xxh64_round (v4, read64 (p + 24));
+      p += 32;
+    } while (end - p >= 32);
+
+    h = rotl64 (v1, 1) + rotl64 (v2, 7) + rotl64 (v3, 12) + rotl64 (v4, 18);
+    h = xxh64_merge (h, v1);
+    h = xxh64_merge (h, v2);
+    h = xxh64_merge (h, v3);
+    h = xxh64_merge (h, v4);
+  }
+  else
+    h = seed + PRIME64_5;
+
+  h += len;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= xxh64_round (0, read64 (p));
+    h = rotl64 (h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (end - p >= 4) {
+    h ^= read32 (p) * PRIME64_1;
+    h = rotl64 (h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * PRIME64_5;
+    h = rotl64 (h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static void
+set_error (struct blockhash *bh, int err)
+{
+  pthread_mutex_lock (&bh->lock);
+  if (bh->error == 0)
+    bh->error = err;
+  pthread_mutex_unlock (&bh->lock);
+}
+
+/* Hash each block of the job and write out the lines. */
+static void
+hash_job (struct blockhash *bh, const struct job *job)
+{
+  const uint64_t block_size = UINT64_C(1) << bh->block_shift;
+  const uint64_t end = job->offset + job->count;
+  size_t objlen = strlen (job->object);
+  size_t max_line = 10 + 1 + 16 + 1 + 16 + 1 + 16 + 1 + objlen + 1;
+  size_t nr_blocks = (job->count >> bh->block_shift) + 2;
+  uint64_t start, next;
+  char *lines, *p;
+
+  lines = p = malloc (nr_blocks * max_line);
+  if (lines == NULL) {
+    set_error (bh, errno);
+    return;
+  }
+
+  for (start = job->offset; start < end; start = next) {
+    next = (start | (block_size - 1)) + 1;
+    if (next > end)
+      next = end;
+    p += sprintf (p, "%d %" PRIx64 " %" PRIx64 " %016" PRIx64 " %s\n",
+                  job->disk, start, next,
+                  blockhash_xxh64 (job->data + (start - job->offset),
+                                   next - start, 0),
+                  job->object);
+  }
+
+  pthread_mutex_lock (&bh->output_lock);
+  output_write (bh->o, lines, p - lines);
+  pthread_mutex_unlock (&bh->output_lock);
+  free (lines);
+}
+
+static void *
+hash_thread (void *bhv)
+{
+  struct blockhash *bh = bhv;
+  struct job *job;
+
+  for (;;) {
+    pthread_mutex_lock (&bh->lock);
+    while (bh->head == NULL && !bh->finish)
+      pthread_cond_wait (&bh->cond, &bh->lock);
+    job = bh->head;
+    if (job) {
+      bh->head = job->next;
+      if (bh->head == NULL)
+        bh->tail = NULL;
+    }
+    pthread_mutex_unlock (&bh->lock);
+
+    if (job == NULL)
+      return NULL;              /* finished, and the queue is empty */
+
+    hash_job (bh, job);
+
+    pthread_mutex_lock (&bh->lock);
+    bh->queued -= job->count;
+    pthread_cond_broadcast (&bh->space);
+    pthread_mutex_unlock (&bh->lock);
+    free (job);
+  }
+}
+
+void
+blockhash_add (struct blockhash *bh, int disk, uint64_t offset,
+               const void *buf, uint32_t count, const char *object)
+{
+  size_t objlen = strlen (object);
+  struct job *job;
+
+  if (count == 0)
+    return;
+
+  job = malloc (sizeof *job + count + objlen + 1);
+  if (job == NULL) {
+    set_error (bh, errno);
+    return;
+  }
+  job->next = NULL;
+  job->disk = disk;
+  job->offset = offset;
+  job->count = count;
+  memcpy (job->data, buf, count);
+  memcpy (job->data + count, object, objlen + 1);
+  job->object = (const char *) job->data + count;
+
+  pthread_mutex_lock (&bh->lock);
+  while (bh->queued > 0 && bh->queued + count > MAX_QUEUED)
+    pthread_cond_wait (&bh->space, &bh->lock);
+  if (bh->tail)
+    bh->tail->next = job;
+  else
+    bh->head = job;
+  bh->tail = job;
+  bh->queued += count;
+  pthread_cond_signal (&bh->cond);
+  pthread_mutex_unlock (&bh->lock);
+}
+
+struct blockhash *
+blockhash_start (const char *filename, unsigned block_shift,
+                 unsigned nr_threads)
+{
+  struct blockhash *bh;
+  unsigned i;
+  int err;
+
+  if (block_shift < 9 || block_shift > 30 || nr_threads == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  bh = calloc (1, sizeof *bh);
+  if (bh == NULL)
+    return NULL;
+  bh->block_shift = block_shift;
+  bh->threads = calloc (nr_threads, sizeof (pthread_t));
+  if (bh->threads == NULL)
+    goto error;
+  bh->o = output_open (filename, OUTPUT_COMPRESS_NONE);
+  if (bh->o == NULL)
+    goto error;
+
+  pthread_mutex_init (&bh->lock, NULL);
+  pthread_cond_init (&bh->cond, NULL);
+  pthread_cond_init (&bh->space, NULL);
+  pthread_mutex_init (&bh->output_lock, NULL);
+
+  for (i = 0; i < nr_threads; ++i) {
+    err = pthread_create (&bh->threads[i], NULL, hash_thread, bh);
+    if (err != 0) {
+      set_error (bh, err);
+      break;
+    }
+    bh->nr_threads++;
+  }
+  if (bh->nr_threads == 0) {
+    blockhash_finish (bh);
+    errno = err;
+    return NULL;
+  }
+
+  return bh;
+
+ error:
+  err = errno;
+  free (bh->threads);
+  free (bh);
+  errno = err;
+  return NULL;
+}
+
+int
+blockhash_finish (struct blockhash *bh)
+{
+  unsigned i;
+  int err;
+
+  pthread_mutex_lock (&bh->lock);
+  bh->finish = 1;
+  pthread_cond_broadcast (&bh->cond);
+  pthread_mutex_unlock (&bh->lock);
+  for (i = 0; i < bh->nr_threads; ++i)
+    pthread_join (bh->threads[i], NULL);
+
+  if (output_close (bh->o) == -1 && bh->error == 0)
+    bh->error = errno;
+
+  err = bh->error;
+  pthread_mutex_destroy (&bh->lock);
+  pthread_cond_destroy (&bh->cond);
+  pthread_cond_destroy (&bh->space);
+  pthread_mutex_destroy (&bh->output_lock);
+  free (bh->threads);
+  free (bh);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
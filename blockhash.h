@@ -0,0 +1,53 @@
+/* virt-bmap block hashes
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BLOCKHASH_H
+#define BLOCKHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Hash the data read for each object, block by block, on separate
+ * threads, and write the hashes to a manifest.  See blockhash.c.
+ */
+
+struct blockhash;
+
+/* Start 'nr_threads' hashing threads writing to 'filename', hashing
+ * blocks of 1 << block_shift bytes.  Returns NULL with errno set on
+ * error.
+ */
+extern struct blockhash *blockhash_start (const char *filename, unsigned block_shift, unsigned nr_threads);
+
+/* Queue the 'count' bytes at 'buf', read from 'offset' of disk index
+ * 'disk' for 'object', to be hashed.  The data and object are copied.
+ * If too much data is queued already, waits for the threads to catch
+ * up.  Errors are remembered and reported by blockhash_finish.
+ */
+extern void blockhash_add (struct blockhash *bh, int disk, uint64_t offset, const void *buf, uint32_t count, const char *object);
+
+/* Wait for everything queued to be hashed, stop the threads and close
+ * the manifest.  Returns -1 with errno set if anything failed since
+ * blockhash_start.
+ */
+extern int blockhash_finish (struct blockhash *bh);
+
+/* The XXH64 hash of [buf, buf+len). */
+extern uint64_t blockhash_xxh64 (const void *buf, size_t len, uint64_t seed);
+
+#endif /* BLOCKHASH_H */
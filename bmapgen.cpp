@@ -0,0 +1,482 @@
+/* virt-bmap synthetic block map generator
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Generates block maps shaped like the ones the examiner writes, at
+ * any scale, for benchmarking the index, the parsers and the logger.
+ * Built by q27152834.mak.
+ *
+ *   bmapgen [-x scale] [options] [-o bmap.txt] [-b bmap.bin]
+ *
+ * Each disk holds partitions, and optionally an LVM physical volume
+ * split into logical volumes whose extents are interleaved.  Every
+ * partition and logical volume holds a filesystem full of directories
+ * and files.  File sizes follow a log-normal distribution.  Files are
+ * written a chunk at a time by several concurrent writers, so they
+ * fragment the way files written in parallel do, and some chunks are
+ * preceded by free space.
+ *
+ * The same seed always gives the same map.  -x multiplies the default
+ * disk size and number of files: -x 1 has about as many objects as bmap.txt,
+ * -x 1000 is a 6 TB disk holding 20 million files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ranges.h"
+
+using namespace std;
+
+#define KiB (UINT64_C(1024))
+#define MiB (1024 * KiB)
+#define GiB (1024 * MiB)
+
+#define BLOCK_SIZE (4 * KiB)            /* filesystem block */
+#define PART_ALIGN MiB                  /* partition alignment */
+#define PE_SIZE (4 * MiB)               /* LVM physical extent */
+
+struct options {
+  int nr_disks = 1;
+  uint64_t disk_size = 0;               /* 0 = 6 GiB * scale */
+  uint64_t nr_files = 0;                /* 0 = 20000 * scale, over all disks */
+  int nr_partitions = 3;
+  int nr_lvs = 0;
+  double file_median = 16 * KiB;
+  double file_sigma = 1.5;
+  double chunk_median = MiB;
+  int writers = 4;
+  double gap = 0.1;
+  unsigned seed = 42;
+};
+
+/* Where the block maps go.  The binary map needs the whole map of a
+ * disk in memory, the text map is written as it is generated.
+ */
+struct sink {
+  FILE *text = NULL;
+  void *map = NULL;
+  int disk = 1;
+  uint64_t lines = 0, extents = 0, files = 0, directories = 0;
+
+  void range (uint64_t start, uint64_t end, const string &object) {
+    if (text)
+      fprintf (text, "%d %" PRIx64 " %" PRIx64 " %s\n",
+               disk, start, end, object.c_str ());
+    if (map)
+      insert_range (map, start, end, object.c_str ());
+    lines++;
+  }
+};
+
+/* A filesystem on a partition or logical volume.  'segments' maps
+ * offsets in the filesystem to offsets on the disk.
+ */
+struct segment {
+  uint64_t offset, disk_offset, len;
+};
+
+struct filesystem {
+  string dev;
+  vector<segment> segments;
+  uint64_t size;
+};
+
+/* A file being written.  Chunks written contiguously are merged into
+ * one extent, which is only output when the next chunk is elsewhere.
+ */
+struct open_file {
+  string object;
+  uint64_t remaining;
+  uint64_t extent_start, extent_end;    /* filesystem offsets */
+};
+
+static const char *const dir_words[] = {
+  "usr", "lib", "lib64", "share", "bin", "sbin", "etc", "var", "cache",
+  "doc", "include", "locale", "man", "icons", "modules", "kernel",
+  "drivers", "net", "fs", "python2.7", "site-packages", "x86_64-linux-gnu",
+  "LC_MESSAGES", "hicolor", "48x48", "apps", "perl5", "firmware",
+};
+
+static const char *const file_words[] = {
+  "libc", "config", "index", "README", "module", "icon", "background",
+  "messages", "locale", "setup", "data", "core", "util", "test", "main",
+  "init", "cache", "vmlinuz", "initramfs", "font", "table", "policy",
+};
+
+static const char *const file_exts[] = {
+  "", ".so", ".so.6", ".py", ".pyc", ".h", ".gz", ".png", ".svg", ".txt",
+  ".conf", ".ko", ".mo", ".xml", ".html", ".pl", ".rpm", ".img",
+};
+
+template <typename T, size_t N>
+static const T &
+pick (mt19937_64 &rng, const T (&a)[N])
+{
+  return a[rng () % N];
+}
+
+static uint64_t
+round_up (uint64_t n, uint64_t align)
+{
+  return (n + align - 1) / align * align;
+}
+
+class generator {
+  const options &opts;
+  sink &out;
+  mt19937_64 &rng;
+  lognormal_distribution<double> file_size, chunk_size;
+
+  filesystem *fs;
+  uint64_t cursor;                      /* next free filesystem offset */
+  vector<string> dirs;
+  vector<open_file> writers;
+  uint64_t next_id;
+
+  /* Output [offset, offset+len) of the filesystem, split where it
+   * crosses a logical volume segment.
+   */
+  void output_extent (uint64_t offset, uint64_t len, const string &object) {
+    auto seg = upper_bound (fs->segments.begin (), fs->segments.end (), offset,
+                            [](uint64_t o, const segment &s) { return o < s.offset; });
+    for (--seg; len > 0; ++seg) {
+      uint64_t skip = offset - seg->offset;
+      uint64_t n = min (len, seg->len - skip);
+
+      out.range (seg->disk_offset + skip, seg->disk_offset + skip + n, object);
+      out.extents++;
+      offset += n;
+      len -= n;
+    }
+  }
+
+  /* Allocate 'len' bytes at the cursor, after a gap of free space
+   * now and then.  Returns false if the filesystem is full.
+   */
+  bool allocate (uint64_t len, uint64_t &offset) {
+    if (opts.gap > 0 && generate_canonical<double, 32> (rng) < opts.gap)
+      cursor += round_up ((uint64_t) chunk_size (rng), BLOCK_SIZE);
+    if (cursor + len > fs->size)
+      return false;
+    offset = cursor;
+    cursor += len;
+    return true;
+  }
+
+  /* Directories are small and written in one go. */
+  bool new_directory () {
+    const string &parent = dirs[rng () % dirs.size ()];
+    string path = (parent == "/" ? "" : parent) + "/" +
+      pick (rng, dir_words) + to_string (next_id++);
+    uint64_t offset, len = (rng () % 4 + 1) * BLOCK_SIZE;
+
+    if (!allocate (len, offset))
+      return false;
+    output_extent (offset, len, "d " + fs->dev + " " + path);
+    out.directories++;
+    dirs.push_back (path);
+    return true;
+  }
+
+  void new_file (open_file &f) {
+    /* Files mostly go into recently created directories. */
+    size_t recent = min (dirs.size (), (size_t) 64);
+    const string &dir = dirs[dirs.size () - 1 - rng () % recent];
+
+    f.object = "f " + fs->dev + " " + (dir == "/" ? "" : dir) + "/" +
+      pick (rng, file_words) + "-" + to_string (next_id++) +
+      pick (rng, file_exts);
+    f.remaining = round_up (max ((uint64_t) file_size (rng), (uint64_t) 1),
+                            BLOCK_SIZE);
+    f.extent_start = f.extent_end = 0;
+    out.files++;
+  }
+
+  void flush_extent (open_file &f) {
+    if (f.extent_end > f.extent_start)
+      output_extent (f.extent_start, f.extent_end - f.extent_start, f.object);
+    f.extent_start = f.extent_end = 0;
+  }
+
+public:
+  generator (const options &opts, sink &out, mt19937_64 &rng)
+    : opts (opts), out (out), rng (rng),
+      file_size (log (opts.file_median), opts.file_sigma),
+      chunk_size (log (opts.chunk_median), 1.0) {}
+
+  /* Fill 'fs' with 'nr_files' files.  Returns the number of files
+   * started before the filesystem filled up.
+   */
+  uint64_t fill (filesystem &f, uint64_t nr_files) {
+    uint64_t started = 0, offset;
+
+    fs = &f;
+    cursor = 0;
+    next_id = 0;
+    dirs.assign (1, "/");
+    writers.clear ();
+
+    /* Superblock and inode tables at the start. */
+    cursor = min (fs->size, round_up (fs->size / 64, BLOCK_SIZE));
+    if (!allocate (BLOCK_SIZE, offset))
+      return 0;
+    output_extent (offset, BLOCK_SIZE, "d " + fs->dev + " /");
+    out.directories++;
+
+    for (;;) {
+      /* Keep 'writers' files open while there are files to write. */
+      while (writers.size () < (size_t) opts.writers && started < nr_files) {
+        if (rng () % 8 == 0 && !new_directory ())
+          goto full;
+        writers.emplace_back ();
+        new_file (writers.back ());
+        started++;
+      }
+      if (writers.empty ())
+        break;
+
+      size_t i = rng () % writers.size ();
+      open_file &w = writers[i];
+      uint64_t len = min (w.remaining,
+                          round_up ((uint64_t) chunk_size (rng), BLOCK_SIZE));
+      if (!allocate (len, offset))
+        goto full;
+      if (offset != w.extent_end) {
+        flush_extent (w);
+        w.extent_start = offset;
+      }
+      w.extent_end = offset + len;
+      w.remaining -= len;
+      if (w.remaining == 0) {
+        flush_extent (w);
+        writers[i] = writers.back ();
+        writers.pop_back ();
+      }
+    }
+    return started;
+
+  full:
+    for (open_file &w : writers)
+      flush_extent (w);
+    return started;
+  }
+};
+
+static void
+generate_disk (const options &opts, sink &out, mt19937_64 &rng,
+               uint64_t nr_files)
+{
+  string dev = string ("/dev/sd") + (char) ('a' + (out.disk - 1) % 26);
+  uint64_t size = opts.disk_size / PART_ALIGN * PART_ALIGN;
+  uint64_t start = PART_ALIGN, usable = size - 2 * PART_ALIGN;
+  vector<filesystem> filesystems;
+  generator gen (opts, out, rng);
+
+  out.range (0, opts.disk_size, "v " + dev);
+
+  /* A small boot partition first, the rest split evenly. */
+  for (int i = 1; i <= opts.nr_partitions; ++i) {
+    uint64_t len;
+    string part = dev + to_string (i);
+
+    if (i == 1 && opts.nr_partitions > 1)
+      len = min (512 * MiB, usable / 8 / PART_ALIGN * PART_ALIGN);
+    else if (i == opts.nr_partitions)
+      len = size - PART_ALIGN - start;
+    else
+      len = (size - PART_ALIGN - start) / (opts.nr_partitions - i + 1)
+        / PART_ALIGN * PART_ALIGN;
+    out.range (start, start + len, "p " + part);
+
+    if (i < opts.nr_partitions || opts.nr_lvs == 0) {
+      filesystems.push_back (filesystem { part, { segment { 0, start, len } }, len });
+    }
+    else {
+      /* The last partition is an LVM PV.  LVs are allocated a run of
+       * PEs at a time in turn, as if they had been extended over time.
+       */
+      uint64_t pe = start + PART_ALIGN, pv_end = start + len;
+      vector<filesystem> lvs (opts.nr_lvs);
+
+      for (int j = 0; j < opts.nr_lvs; ++j) {
+        lvs[j].dev = "/dev/vg" + to_string (out.disk - 1) + "/lv" + to_string (j);
+        lvs[j].size = 0;
+      }
+      for (int j = 0; pe + PE_SIZE <= pv_end; j = (j + 1) % opts.nr_lvs) {
+        uint64_t n = min ((rng () % 64 + 1) * PE_SIZE,
+                          (pv_end - pe) / PE_SIZE * PE_SIZE);
+
+        out.range (pe, pe + n, "l " + lvs[j].dev);
+        lvs[j].segments.push_back (segment { lvs[j].size, pe, n });
+        lvs[j].size += n;
+        pe += n;
+      }
+      for (filesystem &lv : lvs)
+        if (lv.size > 0)
+          filesystems.push_back (lv);
+    }
+    start += len;
+  }
+
+  /* Files are shared out in proportion to filesystem size. */
+  for (filesystem &fs : filesystems) {
+    uint64_t n = (double) nr_files * fs.size / usable;
+    uint64_t started = gen.fill (fs, n);
+
+    if (started < n)
+      fprintf (stderr, "bmapgen: %s is full after %" PRIu64 " of %" PRIu64 " files\n",
+               fs.dev.c_str (), started, n);
+  }
+}
+
+static uint64_t
+parse_size (const char *str)
+{
+  char *end;
+  double n = strtod (str, &end);
+
+  switch (*end) {
+  case 'k': case 'K': n *= KiB; break;
+  case 'm': case 'M': n *= MiB; break;
+  case 'g': case 'G': n *= GiB; break;
+  case 't': case 'T': n *= 1024 * GiB; break;
+  case '\0': break;
+  default:
+    fprintf (stderr, "bmapgen: cannot parse size '%s'\n", str);
+    exit (EXIT_FAILURE);
+  }
+  return n;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: bmapgen [-x scale] [-d disks] [-S disk-size] [-f files]\n"
+           "               [-p partitions] [-l lvs] [-m median-file-size]\n"
+           "               [-M file-size-sigma] [-c median-chunk-size]\n"
+           "               [-w writers] [-g gap-probability] [-s seed]\n"
+           "               [-o bmap.txt] [-b bmap.bin]\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  options opts;
+  double scale = 1;
+  const char *text_file = NULL, *binary_file = NULL;
+  FILE *binary = NULL;
+  sink out;
+  int c;
+
+  while ((c = getopt (argc, argv, "x:d:S:f:p:l:m:M:c:w:g:s:o:b:")) != -1) {
+    switch (c) {
+    case 'x': scale = atof (optarg); break;
+    case 'd': opts.nr_disks = atoi (optarg); break;
+    case 'S': opts.disk_size = parse_size (optarg); break;
+    case 'f': opts.nr_files = strtoull (optarg, NULL, 0); break;
+    case 'p': opts.nr_partitions = atoi (optarg); break;
+    case 'l': opts.nr_lvs = atoi (optarg); break;
+    case 'm': opts.file_median = parse_size (optarg); break;
+    case 'M': opts.file_sigma = atof (optarg); break;
+    case 'c': opts.chunk_median = parse_size (optarg); break;
+    case 'w': opts.writers = atoi (optarg); break;
+    case 'g': opts.gap = atof (optarg); break;
+    case 's': opts.seed = strtoul (optarg, NULL, 0); break;
+    case 'o': text_file = optarg; break;
+    case 'b': binary_file = optarg; break;
+    default: usage ();
+    }
+  }
+  if (optind < argc)
+    usage ();
+
+  if (opts.disk_size == 0)
+    opts.disk_size = 6 * GiB * scale;
+  if (opts.nr_files == 0)
+    opts.nr_files = 20000 * scale;
+  if (opts.nr_disks < 1 || opts.nr_partitions < 1 || opts.nr_lvs < 0 ||
+      opts.writers < 1 || opts.file_median < 1 || opts.chunk_median < 1 ||
+      opts.disk_size < 64 * MiB * opts.nr_partitions) {
+    fprintf (stderr, "bmapgen: invalid options\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (text_file == NULL || strcmp (text_file, "-") == 0)
+    out.text = stdout;
+  else {
+    out.text = fopen (text_file, "w");
+    if (out.text == NULL) {
+      perror (text_file);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (binary_file) {
+    binary = fopen (binary_file, "w");
+    if (binary == NULL) {
+      perror (binary_file);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  mt19937_64 rng (opts.seed);
+
+  for (out.disk = 1; out.disk <= opts.nr_disks; ++out.disk) {
+    if (binary)
+      out.map = new_ranges ();
+    generate_disk (opts, out, rng, opts.nr_files / opts.nr_disks);
+    if (binary) {
+      if (ranges_write_binary (out.map, out.disk, binary) == -1) {
+        perror (binary_file);
+        exit (EXIT_FAILURE);
+      }
+      free_ranges (out.map);
+      out.map = NULL;
+    }
+  }
+
+  if (out.text != stdout && fclose (out.text) == EOF) {
+    perror (text_file);
+    exit (EXIT_FAILURE);
+  }
+  if (out.text == stdout && fflush (stdout) == EOF) {
+    perror ("stdout");
+    exit (EXIT_FAILURE);
+  }
+  if (binary && fclose (binary) == EOF) {
+    perror (binary_file);
+    exit (EXIT_FAILURE);
+  }
+
+  fprintf (stderr, "bmapgen: %d disks, %" PRIu64 " lines, %" PRIu64 " files, "
+           "%" PRIu64 " directories, %" PRIu64 " extents\n",
+           opts.nr_disks, out.lines, out.files, out.directories, out.extents);
+  exit (EXIT_SUCCESS);
+}
@@ -65,3 +65,15 @@ cleanup_free_stat_list (void *ptr)
 {
   guestfs_free_stat_list (* (struct guestfs_stat_list **) ptr);
 }
+
+void
+cleanup_free_partition_list (void *ptr)
+{
+  guestfs_free_partition_list (* (struct guestfs_partition_list **) ptr);
+}
+
+void
+cleanup_free_statvfs (void *ptr)
+{
+  guestfs_free_statvfs (* (struct guestfs_statvfs **) ptr);
+}
@@ -32,6 +32,10 @@
   __attribute__((cleanup(cleanup_free_xattr_list)))
 #define CLEANUP_FREE_STAT_LIST                                  \
   __attribute__((cleanup(cleanup_free_stat_list)))
+#define CLEANUP_FREE_PARTITION_LIST                             \
+  __attribute__((cleanup(cleanup_free_partition_list)))
+#define CLEANUP_FREE_STATVFS                                    \
+  __attribute__((cleanup(cleanup_free_statvfs)))
 
 #else
 #define CLEANUP_FREE
@@ -39,6 +43,8 @@
 #define CLEANUP_FREE_STATNS
 #define CLEANUP_FREE_XATTR_LIST
 #define CLEANUP_FREE_STAT_LIST
+#define CLEANUP_FREE_PARTITION_LIST
+#define CLEANUP_FREE_STATVFS
 #endif
 
 extern void cleanup_free (void *ptr);
@@ -47,5 +53,7 @@ extern void cleanup_free_string_list (char ***ptr);
 extern void cleanup_free_statns (void *ptr);
 extern void cleanup_free_xattr_list (void *ptr);
 extern void cleanup_free_stat_list (void *ptr);
+extern void cleanup_free_partition_list (void *ptr);
+extern void cleanup_free_statvfs (void *ptr);
 
 #endif /* CLEANUPS_H */
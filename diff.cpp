@@ -0,0 +1,331 @@
+/* virt-bmap-diff
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Compare two block maps, of two disk images or of two versions of
+ * one, and print the ranges of each object which were added or
+ * removed.
+ *
+ *   virt-bmap-diff [-d disk] [-o] old-bmap new-bmap
+ *
+ * Both maps are swept once, together, in order of offset: the
+ * segments of every layer of both maps are merged, and at each offset
+ * the objects covering it in the old map are compared with those in
+ * the new map.  Objects are matched by name, which is looked up once
+ * per object before the sweep, so the sweep only compares IDs.
+ *
+ * Differences are printed as block map lines prefixed by '-' for
+ * ranges an object no longer covers and '+' for ranges it now covers,
+ * with contiguous ranges merged.  Each line is printed when its range
+ * ends, so they come out roughly in order of offset.  With -o, only
+ * the names of the objects are printed, prefixed by 'A' (added), 'D'
+ * (deleted) or 'M' (moved: some of its ranges changed).
+ *
+ * The exit status is 0 if the maps are the same, 1 if they differ
+ * and 2 on error, like diff(1).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ranges.h"
+#include "ranges.hpp"
+
+using namespace std;
+using namespace bmap;
+
+/* Objects of both maps are given IDs in one space: an object in the
+ * new map keeps its ID there, and an object only in the old map gets
+ * its old ID plus the number of nodes of the new map.
+ */
+class object_ids {
+  const ranges_index &old_map, &new_map;
+  vector<object_id> old_to_common;
+  vector<bool> new_in_old;      /* by new ID */
+
+public:
+  object_ids (const ranges_index &old_map, const ranges_index &new_map);
+  object_id common (bool is_new, object_id id) const {
+    return is_new ? id : old_to_common[id];
+  }
+  size_t size () const { return new_map.names.nr_nodes () + old_map.names.nr_nodes (); }
+  bool in_old (object_id c) const {
+    return c >= new_map.names.nr_nodes () || new_in_old[c];
+  }
+  bool in_new (object_id c) const { return c < new_map.names.nr_nodes (); }
+  string name (object_id c) const {
+    if (c < new_map.names.nr_nodes ())
+      return object_name (new_map, c);
+    return object_name (old_map, c - new_map.names.nr_nodes ());
+  }
+};
+
+object_ids::object_ids (const ranges_index &old_map, const ranges_index &new_map)
+  : old_map (old_map), new_map (new_map),
+    old_to_common (old_map.names.nr_nodes (), 0),
+    new_in_old (new_map.names.nr_nodes (), false)
+{
+  string name;
+
+  for (object_id id = 1; id < old_map.names.nr_nodes (); ++id) {
+    if (!old_map.names.is_object (id))
+      continue;
+    old_map.names.name (id, name);
+    object_id n = new_map.names.find (name.c_str ());
+    if (n != 0) {
+      old_to_common[id] = n;
+      new_in_old[n] = true;
+    }
+    else
+      old_to_common[id] = new_map.names.nr_nodes () + id;
+  }
+}
+
+/* A range added to ('+') or removed from ('-') an object, which is
+ * extended while the following offsets differ in the same way.
+ */
+struct change {
+  object_id id;
+  char sign;
+  uint64_t start, end;
+};
+
+class differ {
+  const object_ids &ids;
+  int disk;
+  bool objects_only;
+  vector<change> pending;
+  vector<uint8_t> changed;      /* by common ID, for -o */
+  uint64_t nr_changes;
+
+  void print (const change &c);
+
+public:
+  differ (const object_ids &ids, int disk, bool objects_only)
+    : ids (ids), disk (disk), objects_only (objects_only), nr_changes (0) {
+    if (objects_only)
+      changed.resize (ids.size (), 0);
+  }
+  void add (uint64_t start, uint64_t end,
+            const vector<object_id> &removed, const vector<object_id> &added);
+  void finish ();
+  uint64_t count () const { return nr_changes; }
+};
+
+void
+differ::print (const change &c)
+{
+  nr_changes++;
+  if (objects_only)
+    changed[c.id] = 1;
+  else
+    printf ("%c %d %" PRIx64 " %" PRIx64 " %s\n",
+            c.sign, disk, c.start, c.end, ids.name (c.id).c_str ());
+}
+
+/* The objects in 'removed' and 'added' differ over [start, end),
+ * which is called in order of offset.  Pending changes which do not
+ * continue here are printed.
+ */
+void
+differ::add (uint64_t start, uint64_t end,
+             const vector<object_id> &removed, const vector<object_id> &added)
+{
+  vector<change> next;
+
+  for (int i = 0; i < 2; ++i) {
+    const vector<object_id> &list = i == 0 ? removed : added;
+    char sign = i == 0 ? '-' : '+';
+
+    for (object_id id : list) {
+      change c = { id, sign, start, end };
+
+      for (change &p : pending) {
+        if (p.id == id && p.sign == sign && p.end == start) {
+          c.start = p.start;
+          p.id = 0;             /* continued */
+          break;
+        }
+      }
+      next.push_back (c);
+    }
+  }
+
+  for (const change &p : pending)
+    if (p.id != 0)
+      print (p);
+  pending.swap (next);
+}
+
+void
+differ::finish ()
+{
+  for (const change &p : pending)
+    print (p);
+  pending.clear ();
+
+  if (objects_only) {
+    for (object_id c = 1; c < changed.size (); ++c) {
+      if (!changed[c])
+        continue;
+      printf ("%c %s\n",
+              !ids.in_old (c) ? 'A' : !ids.in_new (c) ? 'D' : 'M',
+              ids.name (c).c_str ());
+    }
+  }
+}
+
+/* Sweep both maps in order of offset, like for_each_best_run.  Every
+ * layer of both maps has a cursor, and within a layer segments do
+ * not overlap, so at each step the objects covering 'pos' are in the
+ * current segments of the cursors which have reached it.
+ */
+static void
+diff_maps (const ranges_index &old_map, const ranges_index &new_map,
+           const object_ids &ids, differ &d)
+{
+  struct cursor {
+    ranges::const_iterator iter, end;
+    bool is_new;
+  };
+  vector<cursor> cursors;
+  vector<object_id> old_objects, new_objects, removed, added;
+  uint64_t pos = UINT64_MAX;
+
+  for (int i = 0; i < 2; ++i) {
+    const ranges_index &map = i == 0 ? old_map : new_map;
+
+    for (const layer &l : map.layers) {
+      if (!l.map.empty ()) {
+        cursors.push_back (cursor { l.map.begin (), l.map.end (), i == 1 });
+        pos = min (pos, l.map.begin ()->first.lower ());
+      }
+    }
+  }
+
+  while (!cursors.empty ()) {
+    uint64_t next = UINT64_MAX;
+
+    old_objects.clear ();
+    new_objects.clear ();
+    for (const cursor &c : cursors) {
+      uint64_t lower = c.iter->first.lower ();
+
+      if (lower > pos) {
+        next = min (next, lower);
+        continue;
+      }
+      next = min (next, c.iter->first.upper ());
+      for (object_id id : c.iter->second)
+        (c.is_new ? new_objects : old_objects).push_back (ids.common (c.is_new, id));
+    }
+
+    if (old_objects != new_objects) {
+      sort (old_objects.begin (), old_objects.end ());
+      sort (new_objects.begin (), new_objects.end ());
+      removed.clear ();
+      added.clear ();
+      set_difference (old_objects.begin (), old_objects.end (),
+                      new_objects.begin (), new_objects.end (),
+                      back_inserter (removed));
+      set_difference (new_objects.begin (), new_objects.end (),
+                      old_objects.begin (), old_objects.end (),
+                      back_inserter (added));
+      if (!removed.empty () || !added.empty ())
+        d.add (pos, next, removed, added);
+    }
+
+    for (size_t i = 0; i < cursors.size (); ) {
+      if (cursors[i].iter->first.upper () == next)
+        ++cursors[i].iter;
+      if (cursors[i].iter == cursors[i].end)
+        cursors.erase (cursors.begin () + i);
+      else
+        ++i;
+    }
+    pos = next;
+  }
+
+  d.finish ();
+}
+
+static ranges_index *
+load (const char *filename, int disk)
+{
+  size_t bad_line;
+  void *map = ranges_load (filename, disk, &bad_line);
+
+  if (map == NULL) {
+    char msg[PATH_MAX + 64];
+
+    ranges_load_error (filename, disk, bad_line, msg, sizeof msg);
+    fprintf (stderr, "virt-bmap-diff: %s\n", msg);
+    exit (2);
+  }
+  return (ranges_index *) map;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: virt-bmap-diff [-d disk] [-o] old-bmap new-bmap\n");
+  exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int disk = 1;
+  bool objects_only = false;
+  int c;
+
+  while ((c = getopt (argc, argv, "d:o")) != -1) {
+    switch (c) {
+    case 'd': disk = atoi (optarg); break;
+    case 'o': objects_only = true; break;
+    default: usage ();
+    }
+  }
+  if (argc - optind != 2 || disk < 1)
+    usage ();
+
+  unique_ptr<ranges_index> old_map (load (argv[optind], disk));
+  unique_ptr<ranges_index> new_map (load (argv[optind+1], disk));
+
+  object_ids ids (*old_map, *new_map);
+  differ d (ids, disk, objects_only);
+  diff_maps (*old_map, *new_map, ids, d);
+
+  if (fflush (stdout) == EOF || ferror (stdout)) {
+    perror ("stdout");
+    exit (2);
+  }
+  exit (d.count () > 0 ? 1 : 0);
+}
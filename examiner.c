@@ -52,30 +52,123 @@
 
 #include <guestfs.h>
 
+#include "blockhash.h"
 #include "cleanups.h"
+#include "journal.h"
+#include "output.h"
 #include "ranges.h"
+#include "stats.h"
 #include "visit.h"
 
 static char *output = NULL;
-static char *disk = NULL;
 static const char *socket = NULL;
 static const char *format = "raw";
-static int fd = -1;
-static int64_t size = -1;
+static int extents = 0;
+static unsigned batch_size = 0;
+static enum output_compress compress = OUTPUT_COMPRESS_NONE;
+static unsigned nr_workers = 0;
+static int prefetch = 0;
+static char *stats_file = NULL;
+static char *binary_file = NULL;
+static char *journal_file = NULL;
+static int resume = 0;
+static char *hashes_file = NULL;
+static unsigned hash_shift = 12; /* see hash_block= */
+static unsigned hash_threads = 2;
 static int thread_running = 0;
 static pthread_t thread;
+static int thread_ret;
+
+/* The disks, in the order they were given on the command line. */
+struct disk {
+  char *filename;
+  int fd;
+  int64_t size;
+  void *ranges;                 /* NB: acquire current_object_mutex */
+};
+static struct disk *disks = NULL;
+static size_t nr_disks = 0;
 
-static struct thread_info {
+/* Each worker has its own appliance with all of the disks attached,
+ * and examines a share of the devices and filesystems.  Worker w
+ * opens disk d using the export name "w<w>d<d>" (see bmap_open), so
+ * we know which worker and disk each read belongs to.
+ *
+ * With prefetch=1 each worker has a second appliance, using export
+ * names "p<w>d<d>", which lists directories ahead of the first.  Its
+ * reads are not added to the map.
+ */
+struct worker {
+  size_t id;
   guestfs_h *g;
+  guestfs_h *pg;                /* prefetch appliance, or NULL */
+  pthread_t thread;
   int ret;
-} thread_info;
+  char **devices;               /* device i is disks[i] */
+
+  /* Current object being mapped by this worker, and the batch being
+   * run by its appliance (or NULL).  NB: acquire current_object_mutex
+   * before accessing.
+   */
+  char *current_object;
+  struct batch *active_batch;
+
+  uint64_t bytes_read;          /* updated atomically */
+  int count_devices;
+  int count_partitions;
+  int count_lvs;
+  int count_filesystems;
+  int count_regular;
+  int count_directory;
+};
+static struct worker *workers = NULL;
 
-/* Current object being mapped. */
 static pthread_mutex_t current_object_mutex = PTHREAD_MUTEX_INITIALIZER;
-static char *current_object = NULL;
 
-/* Ranges.  NB: acquire current_object_mutex before accessing. */
-static void *ranges = NULL;
+/* With journal=, each object is recorded in the journal as soon as it
+ * is finished (see journal_object).  NB: acquire current_object_mutex
+ * before adding records, so that those of different objects are not
+ * mixed up.
+ */
+static struct journal *journal = NULL;
+
+/* With resume=1, the objects and filesystems which the journal says
+ * were finished (see is_done).  Objects with ranges are found in the
+ * maps themselves, so only those without any are listed here.  The
+ * lists are sorted, and do not change once the journal is replayed.
+ */
+struct name_list {
+  char **names;
+  size_t nr, alloc;
+};
+static struct name_list done_empty_objects;
+static struct name_list done_filesystems;
+
+/* With hashes=, the data read for each object is passed to the
+ * hashing threads (see blockhash.c).
+ */
+static struct blockhash *blockhash = NULL;
+
+/* When batching (see flush_batch), the first disk is exported with an
+ * extra area after the end of the image.  The appliance reads one
+ * block from this area to tell us that it is starting the next object
+ * in the batch, or has finished the last one (see sentinel).
+ */
+#define SENTINEL_ALIGN (1024*1024)
+#define SENTINEL_STRIDE 4096
+static uint64_t sentinel_base = 0;
+
+struct batch {
+  size_t nr;                    /* number of objects in the batch */
+  size_t *offsets;              /* where each object starts in 'objects' */
+  size_t nr_alloc;
+  char *objects;                /* \0-separated object strings */
+  size_t objects_len;
+  FILE *objects_fp;             /* open_memstream writing 'objects' */
+  char *script;                 /* shell script run in the appliance */
+  size_t script_len;
+  FILE *script_fp;              /* open_memstream writing 'script' */
+};
 
 static void *start_thread (void *);
 
@@ -83,10 +176,23 @@ static int
 bmap_config (const char *key, const char *value)
 {
   if (strcmp (key, "disk") == 0) {
-    free (disk);
-    disk = nbdkit_absolute_path (value);
-    if (disk == NULL)
+    struct disk *p;
+    char *filename;
+
+    filename = nbdkit_absolute_path (value);
+    if (filename == NULL)
       return -1;
+    p = realloc (disks, (nr_disks + 1) * sizeof (struct disk));
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      free (filename);
+      return -1;
+    }
+    disks = p;
+    memset (&disks[nr_disks], 0, sizeof (struct disk));
+    disks[nr_disks].filename = filename;
+    disks[nr_disks].fd = -1;
+    nr_disks++;
   }
   else if (strcmp (key, "format") == 0) {
     format = value;
@@ -100,6 +206,98 @@ bmap_config (const char *key, const char *value)
   else if (strcmp (key, "socket") == 0) {
     socket = value;
   }
+  else if (strcmp (key, "compress") == 0) {
+    if (strcmp (value, "none") == 0)
+      compress = OUTPUT_COMPRESS_NONE;
+    else if (strcmp (value, "gzip") == 0) {
+#ifdef HAVE_ZLIB
+      compress = OUTPUT_COMPRESS_GZIP;
+#else
+      nbdkit_error ("compress=gzip: virt-bmap was compiled without zlib");
+      return -1;
+#endif
+    }
+    else {
+      nbdkit_error ("compress must be 'none' or 'gzip'");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "stats") == 0) {
+    free (stats_file);
+    stats_file = nbdkit_absolute_path (value);
+    if (stats_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "binary") == 0) {
+    free (binary_file);
+    binary_file = nbdkit_absolute_path (value);
+    if (binary_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "journal") == 0) {
+    free (journal_file);
+    journal_file = nbdkit_absolute_path (value);
+    if (journal_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "resume") == 0) {
+    if (sscanf (value, "%d", &resume) != 1) {
+      nbdkit_error ("could not parse resume parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "hashes") == 0) {
+    free (hashes_file);
+    hashes_file = nbdkit_absolute_path (value);
+    if (hashes_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "hash_block") == 0) {
+    unsigned long size;
+
+    if (sscanf (value, "%lu", &size) != 1 ||
+        size < 512 || size > 1073741824 || (size & (size - 1)) != 0) {
+      nbdkit_error ("hash_block must be a power of 2 between 512 and 1G: %s",
+                    value);
+      return -1;
+    }
+    for (hash_shift = 0; (1UL << hash_shift) < size; ++hash_shift)
+      ;
+  }
+  else if (strcmp (key, "hash_threads") == 0) {
+    if (sscanf (value, "%u", &hash_threads) != 1 || hash_threads == 0) {
+      nbdkit_error ("could not parse hash_threads parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "prefetch") == 0) {
+    if (sscanf (value, "%d", &prefetch) != 1) {
+      nbdkit_error ("could not parse prefetch parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "jobs") == 0) {
+    if (sscanf (value, "%u", &nr_workers) != 1 || nr_workers == 0) {
+      nbdkit_error ("could not parse jobs parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "batch") == 0) {
+    if (sscanf (value, "%u", &batch_size) != 1) {
+      nbdkit_error ("could not parse batch parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "mode") == 0) {
+    if (strcmp (value, "read") == 0)
+      extents = 0;
+    else if (strcmp (value, "extents") == 0)
+      extents = 1;
+    else {
+      nbdkit_error ("mode must be 'read' or 'extents'");
+      return -1;
+    }
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -108,43 +306,236 @@ bmap_config (const char *key, const char *value)
   return 0;
 }
 
+static int
+add_name (struct name_list *list, const char *name)
+{
+  if (list->nr >= list->alloc) {
+    size_t alloc = list->alloc ? list->alloc * 2 : 64;
+    char **p = realloc (list->names, alloc * sizeof (char *));
+
+    if (p == NULL)
+      return -1;
+    list->names = p;
+    list->alloc = alloc;
+  }
+  list->names[list->nr] = strdup (name);
+  if (list->names[list->nr] == NULL)
+    return -1;
+  list->nr++;
+  return 0;
+}
+
+static int
+compare_names (const void *av, const void *bv)
+{
+  return strcmp (* (char * const *) av, * (char * const *) bv);
+}
+
+static int
+find_name (const struct name_list *list, const char *name)
+{
+  return list->nr > 0 &&
+    bsearch (&name, list->names, list->nr, sizeof (char *),
+             compare_names) != NULL;
+}
+
+static void
+free_names (struct name_list *list)
+{
+  size_t i;
+
+  for (i = 0; i < list->nr; ++i)
+    free (list->names[i]);
+  free (list->names);
+  memset (list, 0, sizeof *list);
+}
+
+/* Replaying the journal (see open_journal). */
+struct replay_state {
+  size_t nr_objects;            /* objects finished */
+  size_t nr_ranges;             /* ranges of the object being replayed */
+  int error;                    /* out of memory, or wrong disks */
+};
+
+static void
+replay_range (int disk, uint64_t start, uint64_t end, const char *object,
+              void *rsv)
+{
+  struct replay_state *rs = rsv;
+
+  if ((size_t) disk > nr_disks) {
+    rs->error = 1;
+    return;
+  }
+  insert_range (disks[disk-1].ranges, start, end, object);
+  rs->nr_ranges++;
+}
+
+static void
+replay_object_done (const char *object, void *rsv)
+{
+  struct replay_state *rs = rsv;
+
+  if (rs->nr_ranges == 0 && add_name (&done_empty_objects, object) == -1)
+    rs->error = 1;
+  rs->nr_ranges = 0;
+  rs->nr_objects++;
+}
+
+static void
+replay_filesystem_done (const char *dev, void *rsv)
+{
+  struct replay_state *rs = rsv;
+
+  if (add_name (&done_filesystems, dev) == -1)
+    rs->error = 1;
+}
+
+/* Open the journal, and with resume=1 put everything in it back into
+ * the maps first.
+ */
+static int
+open_journal (void)
+{
+  struct replay_state rs = { 0, 0, 0 };
+  struct journal_replay replay = {
+    replay_range, replay_object_done, replay_filesystem_done, &rs
+  };
+
+  journal = journal_open (journal_file, resume ? &replay : NULL);
+  if (journal == NULL) {
+    nbdkit_error ("%s: %m", journal_file);
+    return -1;
+  }
+  if (rs.error) {
+    nbdkit_error ("%s: cannot replay the journal: "
+                  "out of memory, or it is for different disks",
+                  journal_file);
+    return -1;
+  }
+
+  if (resume) {
+    qsort (done_empty_objects.names, done_empty_objects.nr, sizeof (char *),
+           compare_names);
+    qsort (done_filesystems.names, done_filesystems.nr, sizeof (char *),
+           compare_names);
+    printf ("virt-bmap: resuming: %zu objects and %zu filesystems "
+            "were examined already\n",
+            rs.nr_objects, done_filesystems.nr);
+  }
+
+  return 0;
+}
+
 static int
 bmap_config_complete (void)
 {
   struct stat statbuf;
-  guestfs_h *g;
+  size_t i;
   int err;
 
-  if (!output || !disk || !socket) {
+  if (!output || nr_disks == 0 || !socket) {
     nbdkit_error ("missing parameters: are you using the 'virt-bmap' wrapper?");
     return -1;
   }
 
-  ranges = new_ranges ();
+  if (resume && !journal_file) {
+    nbdkit_error ("resume=1 needs the journal of the run to resume");
+    return -1;
+  }
 
-  fd = open (disk, O_RDONLY);
-  if (fd == -1) {
-    nbdkit_error ("%s: %m", disk);
+  /* Objects finished by the run being resumed are not read again, so
+   * they could not be hashed.
+   */
+  if (resume && hashes_file) {
+    nbdkit_error ("hashes cannot be used with resume=1");
+    return -1;
+  }
+
+  /* Extents are reported as offsets within the guest-visible disk,
+   * which are only the same as offsets in the file for raw images.
+   */
+  if (extents && strcmp (format, "raw") != 0) {
+    nbdkit_error ("mode=extents can only be used with raw disk images");
     return -1;
   }
 
-  if (fstat (fd, &statbuf) == -1) {
-    nbdkit_error ("fstat: %m");
+  /* Likewise sentinel reads past the end of the image only arrive
+   * here unchanged if the image is raw.
+   */
+  if (batch_size > 0 && strcmp (format, "raw") != 0) {
+    nbdkit_error ("batch can only be used with raw disk images");
+    return -1;
+  }
+
+  /* By default examine the disks in parallel, one worker each. */
+  if (nr_workers == 0)
+    nr_workers = nr_disks;
+
+  if (stats_file)
+    stats_init ();
+
+#if !HAVE_DECL_NBDKIT_EXPORT_NAME
+  if (nr_disks > 1 || nr_workers > 1) {
+    nbdkit_error ("this nbdkit does not support export names, "
+                  "so only a single disk and job can be used");
+    return -1;
+  }
+#endif
+
+  for (i = 0; i < nr_disks; ++i) {
+    disks[i].ranges = new_ranges ();
+
+    disks[i].fd = open (disks[i].filename, O_RDONLY);
+    if (disks[i].fd == -1) {
+      nbdkit_error ("%s: %m", disks[i].filename);
+      return -1;
+    }
+
+    if (fstat (disks[i].fd, &statbuf) == -1) {
+      nbdkit_error ("fstat: %m");
+      return -1;
+    }
+    disks[i].size = statbuf.st_size;
+  }
+  sentinel_base = (disks[0].size + SENTINEL_ALIGN - 1) &
+    ~(uint64_t) (SENTINEL_ALIGN - 1);
+
+  if (journal_file && open_journal () == -1)
     return -1;
+
+  if (hashes_file) {
+    blockhash = blockhash_start (hashes_file, hash_shift, hash_threads);
+    if (blockhash == NULL) {
+      nbdkit_error ("%s: %m", hashes_file);
+      return -1;
+    }
   }
-  size = statbuf.st_size;
 
-  /* Open the guestfs handle synchronously so we can print errors. */
-  g = guestfs_create ();
-  if (!g) {
-    nbdkit_error ("guestfs_create: %m");
+  /* Open the guestfs handles synchronously so we can print errors. */
+  workers = calloc (nr_workers, sizeof (struct worker));
+  if (workers == NULL) {
+    nbdkit_error ("calloc: %m");
     return -1;
   }
+  for (i = 0; i < nr_workers; ++i) {
+    workers[i].id = i;
+    workers[i].g = guestfs_create ();
+    if (!workers[i].g) {
+      nbdkit_error ("guestfs_create: %m");
+      return -1;
+    }
+    if (prefetch) {
+      workers[i].pg = guestfs_create ();
+      if (!workers[i].pg) {
+        nbdkit_error ("guestfs_create: %m");
+        return -1;
+      }
+    }
+  }
 
   /* Start the guestfs thread. */
-  memset (&thread_info, 0, sizeof thread_info);
-  thread_info.g = g;
-  err = pthread_create (&thread, NULL, start_thread, &thread_info);
+  err = pthread_create (&thread, NULL, start_thread, NULL);
   if (err != 0) {
     nbdkit_error ("cannot start guestfs thread: %s", strerror (err));
     return -1;
@@ -159,8 +550,7 @@ bmap_unload (void)
 {
   int err;
   void *retv;
-
-  free_ranges (ranges);
+  size_t i;
 
   if (thread_running) {
     err = pthread_join (thread, &retv);
@@ -170,20 +560,65 @@ bmap_unload (void)
       fprintf (stderr, "ERROR: failed to construct block map, see earlier errors\n");
     /* unfortunately we can't return the correct exit code here XXX */
   }
-  if (fd >= 0)
-    close (fd);
+
+  for (i = 0; workers && i < nr_workers; ++i) {
+    if (workers[i].g)
+      guestfs_close (workers[i].g);
+    if (workers[i].pg)
+      guestfs_close (workers[i].pg);
+    free_string_list (workers[i].devices);
+    free (workers[i].current_object);
+  }
+  free (workers);
+
+  for (i = 0; i < nr_disks; ++i) {
+    if (disks[i].ranges)
+      free_ranges (disks[i].ranges);
+    if (disks[i].fd >= 0)
+      close (disks[i].fd);
+    free (disks[i].filename);
+  }
+  free (disks);
+
+  /* If the run failed, keep what was done for resume=1. */
+  if (journal && journal_close (journal) == -1)
+    perror (journal_file);
+  free_names (&done_empty_objects);
+  free_names (&done_filesystems);
+
+  if (blockhash)
+    blockhash_finish (blockhash);
+
   free (output);
-  free (disk);
+  free (stats_file);
+  free (binary_file);
+  free (journal_file);
+  free (hashes_file);
+  stats_free ();
 }
 
 #define bmap_config_help                                        \
   "output=<OUTPUT>     Output filename (block map)\n"           \
-  "disk=<DISK>         Input disk filename"                     \
-  "format=raw|qcow2|.. Format of input disk (default: raw)\n"
+  "disk=<DISK>         Input disk filename (may be repeated)\n"  \
+  "format=raw|qcow2|.. Format of input disk (default: raw)\n" \
+  "mode=read|extents   How to find file blocks (default: read)\n" \
+  "batch=<N>           Map up to N files per appliance call\n" \
+  "compress=none|gzip  Compress the output (default: none)\n" \
+  "jobs=<N>            Number of appliances (default: one per disk)\n" \
+  "stats=<FILE>        Write timing statistics as JSON to FILE\n" \
+  "binary=<FILE>       Also write a binary block map to FILE\n" \
+  "journal=<FILE>      Record finished objects in FILE\n" \
+  "resume=1            Resume the run recorded in the journal\n" \
+  "hashes=<FILE>       Write a hash of each block of each object to FILE\n" \
+  "hash_block=<BYTES>  Block size for hashes= (default: 4096)\n" \
+  "hash_threads=<N>    Threads hashing blocks (default: 2)\n" \
+  "prefetch=1          List directories ahead using a second appliance\n"
 
 /* The per-connection handle. */
 struct bmap_handle {
-  /* empty */
+  struct worker *worker;        /* worker whose appliance connected,
+                                   NULL for prefetch appliances */
+  size_t disk;                  /* index into disks[] */
 };
 
 /* Create the per-connection handle. */
@@ -191,17 +626,36 @@ static void *
 bmap_open (int readonly)
 {
   struct bmap_handle *h;
+  size_t w = 0, d = 0;
+  char kind = 'w';
 
   if (!readonly) {
     nbdkit_error ("handle must be opened readonly");
     return NULL;
   }
 
+#if HAVE_DECL_NBDKIT_EXPORT_NAME
+  {
+    const char *name = nbdkit_export_name ();
+    int n = 0;
+
+    if (name && *name &&
+        (sscanf (name, "%c%zud%zu%n", &kind, &w, &d, &n) != 3 ||
+         (kind != 'w' && kind != 'p') ||
+         name[n] != '\0' || w >= nr_workers || d >= nr_disks)) {
+      nbdkit_error ("unknown export name: %s", name);
+      return NULL;
+    }
+  }
+#endif
+
   h = malloc (sizeof *h);
   if (h == NULL) {
     nbdkit_error ("malloc: %m");
     return NULL;
   }
+  h->worker = kind == 'w' ? &workers[w] : NULL;
+  h->disk = d;
 
   return h;
 }
@@ -215,103 +669,293 @@ bmap_close (void *handle)
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+/* Workers run in parallel, and all shared data is protected by
+ * current_object_mutex.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 bmap_get_size (void *handle)
 {
-  return size;
+  struct bmap_handle *h = handle;
+
+  if (h->disk == 0 && batch_size > 0)
+    return sentinel_base + (batch_size + 1) * SENTINEL_STRIDE;
+  return disks[h->disk].size;
 }
 
 /* Mark the start and end of guestfs bmap operations.  This is called
- * from the guestfs thread, so we must lock any shared data structures.
+ * from the guestfs threads, so we must lock any shared data structures.
  */
 static void
-mark_start (const char *object)
+mark_start (struct worker *w, const char *object)
 {
   pthread_mutex_lock (&current_object_mutex);
-  free (current_object);
-  current_object = strdup (object);
-  if (current_object == NULL)
+  free (w->current_object);
+  w->current_object = strdup (object);
+  if (w->current_object == NULL)
     abort ();
   pthread_mutex_unlock (&current_object_mutex);
 }
 
+/* Record in the journal that 'object' is finished, with all of its
+ * ranges.  NB: acquire current_object_mutex.
+ */
+static void
+journal_extent (uint64_t start, uint64_t end, const char *object, void *diskv)
+{
+  journal_range (journal, * (int *) diskv, start, end, object);
+}
+
+static void
+journal_object (const char *object)
+{
+  size_t i;
+  int disk;
+
+  if (journal == NULL)
+    return;
+  for (i = 0; i < nr_disks; ++i) {
+    if (disks[i].ranges) {
+      disk = i + 1;
+      find_object (disks[i].ranges, object, journal_extent, &disk);
+    }
+  }
+  journal_object_done (journal, object);
+}
+
+/* Returns true if 'object' was finished by the run being resumed. */
+static int
+is_done (const char *object)
+{
+  size_t i;
+  int r = 0;
+
+  if (!resume)
+    return 0;
+  if (find_name (&done_empty_objects, object))
+    return 1;
+
+  pthread_mutex_lock (&current_object_mutex);
+  for (i = 0; i < nr_disks && !r; ++i)
+    r = disks[i].ranges && ranges_object_id (disks[i].ranges, object) != 0;
+  pthread_mutex_unlock (&current_object_mutex);
+  return r;
+}
+
+/* 'done' is false if the bmap operation failed. */
+static void
+mark_end (struct worker *w, int done)
+{
+  pthread_mutex_lock (&current_object_mutex);
+  if (done && w->current_object)
+    journal_object (w->current_object);
+  free (w->current_object);
+  w->current_object = NULL;
+  pthread_mutex_unlock (&current_object_mutex);
+}
+
+/* Add a range to a disk's map.  NB: acquire current_object_mutex. */
+static void
+insert (struct disk *disk, uint64_t start, uint64_t end, const char *object)
+{
+  uint64_t t = stats_enabled ? stats_now () : 0;
+
+  insert_range (disk->ranges, start, end, object);
+  stats_insert (t);
+}
+
+static void
+add_range (struct bmap_handle *h, uint64_t offset, uint32_t count)
+{
+  struct disk *disk = &disks[h->disk];
+
+  pthread_mutex_lock (&current_object_mutex);
+  if (h->worker && h->worker->current_object && disk->ranges)
+    insert (disk, offset, offset+count, h->worker->current_object);
+  pthread_mutex_unlock (&current_object_mutex);
+}
+
+/* A read in the sentinel area.  Sentinel block i > 0 starts object
+ * i-1 of the batch, and block 0 ends the current object.
+ */
 static void
-mark_end (void)
+sentinel (struct worker *w, uint64_t offset)
 {
+  uint64_t i;
+
   pthread_mutex_lock (&current_object_mutex);
-  free (current_object);
-  current_object = NULL;
+  if (w->active_batch && offset >= sentinel_base) {
+    i = (offset - sentinel_base) / SENTINEL_STRIDE;
+    if (w->current_object)      /* the previous object is finished */
+      journal_object (w->current_object);
+    free (w->current_object);
+    w->current_object = NULL;
+    if (i > 0 && i <= w->active_batch->nr) {
+      w->current_object =
+        strdup (w->active_batch->objects + w->active_batch->offsets[i-1]);
+      if (w->current_object == NULL)
+        abort ();
+    }
+  }
   pthread_mutex_unlock (&current_object_mutex);
 }
 
+/* Queue data read for the worker's current object to be hashed, if
+ * it is a file.  Partitions and LVs are mapped by reading the whole
+ * device, which would put every block of the disk in the manifest.
+ * The data is copied, so the appliance does not wait for the hashing.
+ */
 static void
-add_range (uint64_t offset, uint32_t count)
+hash_read (struct bmap_handle *h, const void *buf, uint32_t count,
+           uint64_t offset)
 {
+  char *object = NULL;
+
   pthread_mutex_lock (&current_object_mutex);
-  if (current_object)
-    insert_range (ranges, offset, offset+count, current_object);
+  if (h->worker->current_object && h->worker->current_object[0] == 'f') {
+    object = strdup (h->worker->current_object);
+    if (object == NULL)
+      abort ();
+  }
   pthread_mutex_unlock (&current_object_mutex);
+
+  if (object) {
+    blockhash_add (blockhash, h->disk + 1, offset, buf, count, object);
+    free (object);
+  }
 }
 
 /* Read data from the file. */
 static int
 bmap_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  struct bmap_handle *h = handle;
+  struct disk *disk = &disks[h->disk];
+  uint64_t size = disk->size;
+  void *data;
+  uint32_t len;
+  uint64_t start;
   ssize_t r;
 
-  add_range (offset, count);
+  /* Anything past the end of the image is either padding or a
+   * sentinel (only when batching).
+   */
+  if (offset >= size) {
+    if (h->disk == 0 && h->worker)
+      sentinel (h->worker, offset);
+    memset (buf, 0, count);
+    return 0;
+  }
+  if (offset + count > size) {
+    memset (buf + (size - offset), 0, offset + count - size);
+    count = size - offset;
+  }
+
+  add_range (h, offset, count);
 
-  if (lseek (fd, offset, SEEK_SET) == -1) {
-    nbdkit_error ("lseek: %m");
-    return -1;
+  if (h->worker) {
+    __atomic_add_fetch (&h->worker->bytes_read, count, __ATOMIC_RELAXED);
+    stats_read (count);
   }
 
+  data = buf;
+  len = count;
+  start = offset;
   while (count > 0) {
-    r = read (fd, buf, count);
+    r = pread (disk->fd, buf, count, offset);
     if (r == -1) {
-      nbdkit_error ("read: %m");
+      nbdkit_error ("pread: %m");
       return -1;
     }
     if (r == 0) {
-      nbdkit_error ("read: unexpected end of file");
+      nbdkit_error ("pread: unexpected end of file");
       return -1;
     }
     count -= r;
     buf += r;
+    offset += r;
   }
 
+  if (blockhash && h->worker)
+    hash_read (h, data, len, start);
+
   return 0;
 }
 
-/* This is the guestfs thread which calls back into nbdkit. */
+/* This is the guestfs thread which calls back into nbdkit.  It starts
+ * the workers, waits for them to finish, and writes the output.
+ */
+
+/* Run a debug command in the appliance, recording the time taken
+ * under 'name' for stats=.
+ */
+static char *
+debug (guestfs_h *g, const char *name, const char *subcmd,
+       const char **argv)
+{
+  uint64_t t = stats_now ();
+  char *r;
+
+  r = guestfs_debug (g, subcmd, (char **) argv);
+  stats_rpc (name, t);
+  return r;
+}
 
-static int count_partitions = 0;
-static int count_lvs = 0;
-static int count_filesystems = 0;
-static int count_regular = 0;
-static int count_directory = 0;
+/* Phases of the mapping run are recorded for stats=, with the bytes
+ * read and objects mapped by the worker during the phase.
+ */
+struct phase {
+  uint64_t start;
+  uint64_t bytes;
+  uint64_t objects;
+};
 
-static int examine_devices (guestfs_h *g);
-static int examine_partitions (guestfs_h *g);
-static int examine_lvs (guestfs_h *g);
-static int examine_filesystems (guestfs_h *g);
-static int examine_filesystem (guestfs_h *g, const char *dev, const char *type);
-static int visit_fn (const char *dir, const char *name, const struct guestfs_statns *stat, const struct guestfs_xattr_list *xattrs, void *opaque);
+static uint64_t
+worker_objects (struct worker *w)
+{
+  return w->count_devices + w->count_partitions + w->count_lvs +
+    w->count_directory + w->count_regular;
+}
+
+static void
+begin_phase (struct worker *w, struct phase *p)
+{
+  p->start = stats_now ();
+  p->bytes = __atomic_load_n (&w->bytes_read, __ATOMIC_RELAXED);
+  p->objects = worker_objects (w);
+}
+
+static void
+end_phase (struct worker *w, struct phase *p,
+           const char *name, const char *object)
+{
+  stats_phase (name, object, w->id, p->start, stats_now (),
+               __atomic_load_n (&w->bytes_read, __ATOMIC_RELAXED) - p->bytes,
+               worker_objects (w) - p->objects);
+}
+
+static int examine_devices (struct worker *w);
+static int examine_partitions (struct worker *w);
+static int examine_lvs (struct worker *w);
+static int examine_filesystems (struct worker *w);
+static int examine_filesystem (struct worker *w, const char *dev, const char *type);
+static int partition_range (struct worker *w, const char *dev, size_t *disk, int64_t *start, int64_t *end);
+static int visit_fn (const char *path, const char *name, const struct guestfs_statns *stat, const struct guestfs_xattr_list *xattrs, void *opaque);
+static void *worker_thread (void *);
 static int ranges_to_output (void);
 
 static void *
-start_thread (void *infov)
+start_thread (void *unused)
 {
-  struct thread_info *info = infov;
-  guestfs_h *g = info->g;
   size_t i;
-  CLEANUP_FREE char *server = NULL;
-  const char *servers[2];
+  int err, started = 0;
+  int count_devices = 0, count_partitions = 0, count_lvs = 0;
+  int count_filesystems = 0, count_regular = 0, count_directory = 0;
+  uint64_t bytes_read = 0, examine_start, examine_end, t;
 
-  info->ret = -1;
+  thread_ret = -1;
 
   /* Wait for the socket to appear, ie. for nbdkit to start up. */
   for (i = 0; i < 10; ++i) {
@@ -324,6 +968,163 @@ start_thread (void *infov)
   goto error;
 
  nbdkit_started:
+  examine_start = stats_now ();
+  for (i = 0; i < nr_workers; ++i) {
+    err = pthread_create (&workers[i].thread, NULL,
+                          worker_thread, &workers[i]);
+    if (err != 0) {
+      fprintf (stderr, "cannot start worker thread: %s\n", strerror (err));
+      break;
+    }
+    started++;
+  }
+
+  for (i = 0; i < started; ++i) {
+    err = pthread_join (workers[i].thread, NULL);
+    if (err != 0) {
+      fprintf (stderr, "cannot join worker thread: %s\n", strerror (err));
+      goto error;
+    }
+    if (workers[i].ret == -1)
+      goto error;
+
+    count_devices += workers[i].count_devices;
+    count_partitions += workers[i].count_partitions;
+    count_lvs += workers[i].count_lvs;
+    count_filesystems += workers[i].count_filesystems;
+    count_regular += workers[i].count_regular;
+    count_directory += workers[i].count_directory;
+    bytes_read += workers[i].bytes_read;
+  }
+  if (started < nr_workers)
+    goto error;
+  examine_end = stats_now ();
+  stats_phase ("examine", NULL, -1, examine_start, examine_end, bytes_read,
+               count_devices + count_partitions + count_lvs +
+               count_directory + count_regular);
+
+  /* The workers are finished, so nothing more will be queued. */
+  if (blockhash) {
+    struct blockhash *bh = blockhash;
+
+    blockhash = NULL;
+    if (blockhash_finish (bh) == -1) {
+      perror (hashes_file);
+      goto error;
+    }
+    printf ("virt-bmap: block hashes written to %s\n", hashes_file);
+  }
+
+  /* Convert ranges to final output file. */
+  printf ("virt-bmap: writing %s\n", output);
+  t = stats_now ();
+  if (ranges_to_output () == -1)
+    goto error;
+  stats_phase ("output", NULL, -1, t, stats_now (), 0, 0);
+
+  /* The output is complete, so nothing needs to be resumed. */
+  if (journal) {
+    journal_close (journal);
+    journal = NULL;
+    unlink (journal_file);
+  }
+
+  /* Print summary. */
+  printf ("virt-bmap: successfully examined %zu disks, %d partitions,\n"
+          "           %d logical volumes, %d filesystems, %d directories,\n"
+          "           %d files\n"
+          "virt-bmap: output written to %s\n",
+          nr_disks, count_partitions, count_lvs,
+          count_filesystems, count_directory, count_regular,
+          output);
+
+  if (stats_file) {
+    double secs = (examine_end - examine_start) / 1e9;
+    struct ranges_stats rs;
+    uint64_t map_segments = 0, map_objects = 0, map_bytes = 0;
+    uint64_t map_name_bytes = 0, map_reverse_bytes = 0;
+
+    /* Memory used by the block maps, to size hosts for big guests. */
+    for (i = 0; i < nr_disks; ++i) {
+      ranges_stats (disks[i].ranges, &rs);
+      map_segments += rs.nr_segments;
+      map_objects += rs.nr_objects;
+      map_bytes += rs.total_bytes;
+      map_name_bytes += rs.name_bytes;
+      map_reverse_bytes += rs.reverse_bytes;
+    }
+
+    stats_set_int ("disks", nr_disks);
+    stats_set_int ("jobs", nr_workers);
+    stats_set_int ("devices", count_devices);
+    stats_set_int ("partitions", count_partitions);
+    stats_set_int ("lvs", count_lvs);
+    stats_set_int ("filesystems", count_filesystems);
+    stats_set_int ("directories", count_directory);
+    stats_set_int ("files", count_regular);
+    stats_set_double ("examine_seconds", secs);
+    stats_set_double ("files_per_second",
+                      secs > 0 ? count_regular / secs : 0);
+    stats_set_double ("bytes_per_second", secs > 0 ? bytes_read / secs : 0);
+    stats_set_int ("map_segments", map_segments);
+    stats_set_int ("map_objects", map_objects);
+    stats_set_int ("map_bytes", map_bytes);
+    stats_set_int ("map_name_bytes", map_name_bytes);
+    stats_set_int ("map_reverse_bytes", map_reverse_bytes);
+    if (stats_write (stats_file) == -1) {
+      perror (stats_file);
+      goto error;
+    }
+    printf ("virt-bmap: statistics written to %s\n", stats_file);
+  }
+
+  thread_ret = 0;
+ error:
+  /* Kill the nbdkit process so it exits.  The nbdkit process is us,
+   * so we're killing ourself here.
+   */
+  kill (getpid (), SIGTERM);
+
+  return &thread_ret;
+}
+
+/* Work is shared out between the workers by handing out the next
+ * device, partition, LV or filesystem to whichever worker asks first.
+ * Every appliance sees the same disks so the lists are the same.
+ */
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_device = 0;
+static size_t next_partition = 0;
+static size_t next_lv = 0;
+static size_t next_filesystem = 0;
+
+static size_t
+claim (size_t *next)
+{
+  size_t r;
+
+  pthread_mutex_lock (&work_mutex);
+  r = (*next)++;
+  pthread_mutex_unlock (&work_mutex);
+
+  return r;
+}
+
+static void *
+worker_thread (void *wv)
+{
+  struct worker *w = wv;
+  guestfs_h *g = w->g;
+  size_t i;
+  CLEANUP_FREE char *server = NULL;
+  const char *servers[2];
+  struct phase phase;
+  uint64_t t;
+
+  w->ret = -1;
+
+  begin_phase (w, &phase);
+
   if (asprintf (&server, "unix:%s", socket) == -1) {
     perror ("asprintf");
     goto error;
@@ -332,82 +1133,126 @@ start_thread (void *infov)
   servers[0] = server;
   servers[1] = NULL;
 
-  if (guestfs_add_drive_opts (g, "" /* export name */,
-                              GUESTFS_ADD_DRIVE_OPTS_READONLY, 1,
-                              GUESTFS_ADD_DRIVE_OPTS_FORMAT, format,
-                              GUESTFS_ADD_DRIVE_OPTS_PROTOCOL, "nbd",
-                              GUESTFS_ADD_DRIVE_OPTS_SERVER, servers,
-                              -1) == -1)
-    goto error;
+  for (i = 0; i < nr_disks; ++i) {
+    char exportname[64];
+
+    snprintf (exportname, sizeof exportname, "w%zud%zu", w->id, i);
+    if (guestfs_add_drive_opts (g, exportname,
+                                GUESTFS_ADD_DRIVE_OPTS_READONLY, 1,
+                                GUESTFS_ADD_DRIVE_OPTS_FORMAT, format,
+                                GUESTFS_ADD_DRIVE_OPTS_PROTOCOL, "nbd",
+                                GUESTFS_ADD_DRIVE_OPTS_SERVER, servers,
+                                -1) == -1)
+      goto error;
+  }
 
+  t = stats_now ();
   if (guestfs_launch (g) == -1)
     goto error;
+  stats_rpc ("launch", t);
+
+  if (w->pg) {
+    for (i = 0; i < nr_disks; ++i) {
+      char exportname[64];
+
+      snprintf (exportname, sizeof exportname, "p%zud%zu", w->id, i);
+      if (guestfs_add_drive_opts (w->pg, exportname,
+                                  GUESTFS_ADD_DRIVE_OPTS_READONLY, 1,
+                                  GUESTFS_ADD_DRIVE_OPTS_FORMAT, format,
+                                  GUESTFS_ADD_DRIVE_OPTS_PROTOCOL, "nbd",
+                                  GUESTFS_ADD_DRIVE_OPTS_SERVER, servers,
+                                  -1) == -1)
+        goto error;
+    }
+    if (guestfs_launch (w->pg) == -1)
+      goto error;
+  }
+
+  w->devices = guestfs_list_devices (g);
+  if (w->devices == NULL)
+    goto error;
+  end_phase (w, &phase, "launch", NULL);
 
   /* Examine non-filesystem objects. */
-  if (examine_devices (g) == -1)
-    goto error;
-  if (examine_partitions (g) == -1)
+  begin_phase (w, &phase);
+  if (examine_devices (w) == -1)
     goto error;
-  if (examine_lvs (g) == -1)
+  end_phase (w, &phase, "devices", NULL);
+  begin_phase (w, &phase);
+  if (examine_partitions (w) == -1)
     goto error;
-
-  /* Examine filesystems. */
-  if (examine_filesystems (g) == -1)
+  end_phase (w, &phase, "partitions", NULL);
+  begin_phase (w, &phase);
+  if (examine_lvs (w) == -1)
     goto error;
+  end_phase (w, &phase, "lvs", NULL);
 
-  /* Convert ranges to final output file. */
-  printf ("virt-bmap: writing %s\n", output);
-  if (ranges_to_output () == -1)
+  /* Examine filesystems (each is a separate phase). */
+  if (examine_filesystems (w) == -1)
     goto error;
 
-  /* Print summary. */
-  printf ("virt-bmap: successfully examined %d partitions, %d logical volumes,\n"
-          "           %d filesystems, %d directories, %d files\n"
-          "virt-bmap: output written to %s\n",
-          count_partitions, count_lvs,
-          count_filesystems, count_directory, count_regular,
-          output);
-  info->ret = 0;
+  w->ret = 0;
  error:
   guestfs_close (g);
+  w->g = NULL;
+  if (w->pg) {
+    guestfs_close (w->pg);
+    w->pg = NULL;
+  }
 
-  /* Kill the nbdkit process so it exits.  The nbdkit process is us,
-   * so we're killing ourself here.
-   */
-  kill (getpid (), SIGTERM);
+  return NULL;
+}
 
-  return &info->ret;
+/* Return the index of the disk which appears as 'dev' in the
+ * appliance, or -1 if it is not a whole disk.
+ */
+static ssize_t
+device_to_disk (struct worker *w, const char *dev)
+{
+  size_t i;
+
+  for (i = 0; w->devices[i] != NULL && i < nr_disks; ++i)
+    if (strcmp (w->devices[i], dev) == 0)
+      return i;
+
+  return -1;
 }
 
 static int
-examine_devices (guestfs_h *g)
+examine_devices (struct worker *w)
 {
-  CLEANUP_FREE_STRING_LIST char **devices = NULL;
-  size_t i;
+  guestfs_h *g = w->g;
+  size_t i, n;
 
-  /* Get list of devices. */
-  devices = guestfs_list_devices (g);
-  if (devices == NULL)
-    return -1;
+  for (n = 0; w->devices[n] != NULL && n < nr_disks; ++n)
+    ;
 
-  for (i = 0; devices[i] != NULL; ++i) {
+  while ((i = claim (&next_device)) < n) {
     CLEANUP_FREE char *object = NULL;
-    int64_t size;
+    int64_t devsize;
 
-    printf ("virt-bmap: examining %s ...\n", devices[i]);
+    printf ("virt-bmap: examining %s ...\n", w->devices[i]);
+    w->count_devices++;
 
-    if (asprintf (&object, "v %s", devices[i]) == -1)
+    if (asprintf (&object, "v %s", w->devices[i]) == -1)
       return -1;
+    if (is_done (object))
+      continue;
 
     /* We don't actually bother to examine the device, which would be
      * slow and pointless.  We just mark it in the map.
      */
-    size = guestfs_blockdev_getsize64 (g, devices[i]);
-    if (size == -1)
+    devsize = guestfs_blockdev_getsize64 (g, w->devices[i]);
+    if (devsize == -1)
       return -1;
 
+    /* Don't include the sentinel area in the device. */
+    if (devsize > disks[i].size)
+      devsize = disks[i].size;
+
     pthread_mutex_lock (&current_object_mutex);
-    insert_range (ranges, 0, size, object);
+    insert (&disks[i], 0, devsize, object);
+    journal_object (object);
     pthread_mutex_unlock (&current_object_mutex);
   }
 
@@ -415,10 +1260,11 @@ examine_devices (guestfs_h *g)
 }
 
 static int
-examine_partitions (guestfs_h *g)
+examine_partitions (struct worker *w)
 {
+  guestfs_h *g = w->g;
   CLEANUP_FREE_STRING_LIST char **parts = NULL;
-  size_t i;
+  size_t i, n;
   const char *argv[2];
   char *r;
 
@@ -426,25 +1272,46 @@ examine_partitions (guestfs_h *g)
   parts = guestfs_list_partitions (g);
   if (parts == NULL)
     return -1;
+  for (n = 0; parts[n] != NULL; ++n)
+    ;
 
-  for (i = 0; parts[i] != NULL; ++i) {
+  while ((i = claim (&next_partition)) < n) {
     CLEANUP_FREE char *object = NULL;
     printf ("virt-bmap: examining %s ...\n", parts[i]);
-    count_partitions++;
+    w->count_partitions++;
 
     if (asprintf (&object, "p %s", parts[i]) == -1)
       return -1;
+    if (is_done (object))
+      continue;
+
+    if (extents) {
+      size_t disk;
+      int64_t start, end;
+
+      /* The partition table tells us where the partition is, so
+       * there is no need to read the whole thing.
+       */
+      if (partition_range (w, parts[i], &disk, &start, &end) == -1)
+        return -1;
+
+      pthread_mutex_lock (&current_object_mutex);
+      insert (&disks[disk], start, end, object);
+      journal_object (object);
+      pthread_mutex_unlock (&current_object_mutex);
+      continue;
+    }
 
     argv[0] = parts[i];
     argv[1] = NULL;
-    r = guestfs_debug (g, "bmap_device", (char **) argv);
+    r = debug (g, "bmap_device", "bmap_device", argv);
     if (r == NULL)
       return -1;
     free (r);
-    mark_start (object);
+    mark_start (w, object);
     argv[0] = NULL;
-    r = guestfs_debug (g, "bmap", (char **) argv);
-    mark_end ();
+    r = debug (g, "bmap", "bmap", argv);
+    mark_end (w, r != NULL);
     if (r == NULL)
       return -1;
     free (r);
@@ -454,37 +1321,45 @@ examine_partitions (guestfs_h *g)
 }
 
 static int
-examine_lvs (guestfs_h *g)
+examine_lvs (struct worker *w)
 {
+  guestfs_h *g = w->g;
   CLEANUP_FREE_STRING_LIST char **lvs = NULL;
-  size_t i;
+  size_t i, n;
   const char *argv[2];
   char *r;
 
-  /* Get LVs. */
+  /* Get LVs.  An LV can span several disks, but since every read
+   * arrives on the connection for the disk it came from, the LV is
+   * correctly mapped on all of them.
+   */
   lvs = guestfs_lvs (g);
   if (lvs == NULL)
     return -1;
+  for (n = 0; lvs[n] != NULL; ++n)
+    ;
 
-  for (i = 0; lvs[i] != NULL; ++i) {
+  while ((i = claim (&next_lv)) < n) {
     CLEANUP_FREE char *object = NULL;
 
     printf ("virt-bmap: examining %s ...\n", lvs[i]);
-    count_lvs++;
+    w->count_lvs++;
 
     if (asprintf (&object, "l %s", lvs[i]) == -1)
       return -1;
+    if (is_done (object))
+      continue;
 
     argv[0] = lvs[i];
     argv[1] = NULL;
-    r = guestfs_debug (g, "bmap_device", (char **) argv);
+    r = debug (g, "bmap_device", "bmap_device", argv);
     if (r == NULL)
       return -1;
     free (r);
-    mark_start (object);
+    mark_start (w, object);
     argv[0] = NULL;
-    r = guestfs_debug (g, "bmap", (char **) argv);
-    mark_end ();
+    r = debug (g, "bmap", "bmap", argv);
+    mark_end (w, r != NULL);
     if (r == NULL)
       return -1;
     free (r);
@@ -494,84 +1369,510 @@ examine_lvs (guestfs_h *g)
 }
 
 static int
-examine_filesystems (guestfs_h *g)
+examine_filesystems (struct worker *w)
 {
   CLEANUP_FREE_STRING_LIST char **filesystems = NULL;
-  size_t i;
+  size_t i, n;
 
   /* Get the filesystems in the disk image. */
-  filesystems = guestfs_list_filesystems (g);
+  filesystems = guestfs_list_filesystems (w->g);
   if (filesystems == NULL)
     return -1;
+  for (n = 0; filesystems[n] != NULL; n += 2)
+    ;
 
-  for (i = 0; filesystems[i] != NULL; i += 2) {
-    if (examine_filesystem (g, filesystems[i], filesystems[i+1]) == -1)
+  while ((i = claim (&next_filesystem)) < n / 2) {
+    if (examine_filesystem (w, filesystems[2*i], filesystems[2*i+1]) == -1)
       return -1;
   }
 
   return 0;
 }
 
-static size_t
-count_strings (char *const *argv)
+/* Find the disk containing a partition, and the byte range [start,
+ * end) of the partition within the disk.  Returns -1 on error,
+ * including if 'dev' is not a partition.
+ */
+static int
+partition_range (struct worker *w, const char *dev,
+                 size_t *disk, int64_t *start, int64_t *end)
 {
-  size_t r;
+  guestfs_h *g = w->g;
+  CLEANUP_FREE char *parent = NULL;
+  CLEANUP_FREE_PARTITION_LIST struct guestfs_partition_list *parts = NULL;
+  int partnum;
+  ssize_t d;
+  size_t i;
 
-  for (r = 0; argv[r]; ++r)
-    ;
+  parent = guestfs_part_to_dev (g, dev);
+  if (parent == NULL)
+    return -1;
+  d = device_to_disk (w, parent);
+  if (d == -1) {
+    fprintf (stderr, "virt-bmap: %s is not one of the disks\n", parent);
+    return -1;
+  }
+  *disk = d;
+  partnum = guestfs_part_to_partnum (g, dev);
+  if (partnum == -1)
+    return -1;
+  parts = guestfs_part_list (g, parent);
+  if (parts == NULL)
+    return -1;
 
-  return r;
+  for (i = 0; i < parts->len; ++i) {
+    if (parts->val[i].part_num == partnum) {
+      *start = parts->val[i].part_start;
+      *end = parts->val[i].part_end + 1; /* part_end is inclusive */
+      return 0;
+    }
+  }
+
+  fprintf (stderr, "virt-bmap: partition %s not found on %s\n", dev, parent);
+  return -1;
+}
+
+/* Filesystems where FIEMAP returns offsets relative to the start of
+ * the block device.  Others (eg. btrfs, which returns its own logical
+ * addresses) have to be mapped by reading files.
+ */
+static const char *fiemap_filesystems[] = {
+  "ext2", "ext3", "ext4", "xfs", "vfat", NULL
+};
+
+/* If extents can be used on the filesystem 'dev', return the byte
+ * offset of the filesystem within the disk, and the disk.  Otherwise
+ * return -1, and the caller should fall back to reading files.
+ */
+static int64_t
+filesystem_offset (struct worker *w, const char *dev, const char *type,
+                   size_t *disk)
+{
+  guestfs_h *g = w->g;
+  int64_t start, end;
+  ssize_t d;
+  size_t i;
+  int r;
+
+  for (i = 0; fiemap_filesystems[i] != NULL; ++i)
+    if (strcmp (type, fiemap_filesystems[i]) == 0)
+      break;
+  if (fiemap_filesystems[i] == NULL)
+    return -1;
+
+  d = device_to_disk (w, dev);
+  if (d >= 0) {
+    *disk = d;
+    return 0;
+  }
+
+  /* Otherwise it had better be a partition.  LVs and other
+   * device-mapper devices are not handled.
+   */
+  guestfs_push_error_handler (g, NULL, NULL);
+  r = partition_range (w, dev, disk, &start, &end);
+  guestfs_pop_error_handler (g);
+  if (r == -1)
+    return -1;
+
+  return start;
+}
+
+/* Quote a string so it can be passed through the appliance shell. */
+static char *
+shell_quote (const char *str)
+{
+  size_t i, len = 3;
+  char *ret, *p;
+
+  for (i = 0; str[i] != '\0'; ++i)
+    len += str[i] == '\'' ? 4 : 1;
+
+  ret = p = malloc (len);
+  if (ret == NULL) {
+    perror ("malloc");
+    return NULL;
+  }
+
+  *p++ = '\'';
+  for (i = 0; str[i] != '\0'; ++i) {
+    if (str[i] == '\'') {
+      memcpy (p, "'\\''", 4);
+      p += 4;
+    }
+    else
+      *p++ = str[i];
+  }
+  *p++ = '\'';
+  *p = '\0';
+
+  return ret;
+}
+
+struct extent {
+  uint64_t start;
+  uint64_t end;
+};
+
+/* Ask the appliance for the extents of 'path' (on the currently
+ * mounted filesystem) and add them to the map without reading any of
+ * the file.  Returns -1 if the extents could not be determined, in
+ * which case the caller should fall back to reading the file.  The
+ * number of bytes mapped is added to '*bytes'.
+ */
+static int
+map_extents (guestfs_h *g, size_t disk, int64_t fs_offset,
+             const char *path, const char *object, uint64_t *bytes)
+{
+  CLEANUP_FREE char *sysroot_path = NULL, *quoted = NULL, *cmd = NULL;
+  CLEANUP_FREE char *out = NULL;
+  CLEANUP_FREE struct extent *exts = NULL;
+  size_t i, nr_exts = 0, alloc_exts = 0;
+  const char *argv[2];
+  char *line, *next;
+
+  if (asprintf (&sysroot_path, "/sysroot%s", path) == -1)
+    return -1;
+  quoted = shell_quote (sysroot_path);
+  if (quoted == NULL)
+    return -1;
+  /* -b512 makes filefrag report sectors whatever the block size. */
+  if (asprintf (&cmd, "filefrag -v -b512 %s", quoted) == -1)
+    return -1;
+
+  argv[0] = cmd;
+  argv[1] = NULL;
+  guestfs_push_error_handler (g, NULL, NULL);
+  out = debug (g, "filefrag", "sh", argv);
+  guestfs_pop_error_handler (g);
+  if (out == NULL)
+    return -1;
+
+  for (line = out; line != NULL && *line != '\0'; line = next) {
+    uint64_t lstart, lend, pstart, pend, len;
+    const char *flags;
+    int n;
+
+    next = strchr (line, '\n');
+    if (next)
+      *next++ = '\0';
+
+    /* Extent lines look like:
+     *    0:        0..       7:      34816..     34823:      8:   last,eof
+     * Everything else (headers, summary) is ignored.
+     */
+    if (sscanf (line, " %*u: %" SCNu64 "..%" SCNu64 ": %" SCNu64
+                "..%" SCNu64 ": %" SCNu64 ":%n",
+                &lstart, &lend, &pstart, &pend, &len, &n) != 5)
+      continue;
+    flags = line + n;
+
+    /* The data is not (only) in the extent, so we have to read it. */
+    if (strstr (flags, "unknown_loc") || strstr (flags, "delalloc") ||
+        strstr (flags, "encoded") || strstr (flags, "data_encrypted") ||
+        strstr (flags, "not_aligned") || strstr (flags, "inline") ||
+        strstr (flags, "tail_packed"))
+      return -1;
+
+    /* Unwritten extents are never read from disk. */
+    if (strstr (flags, "unwritten"))
+      continue;
+
+    if (nr_exts >= alloc_exts) {
+      struct extent *p;
+
+      alloc_exts = alloc_exts ? alloc_exts * 2 : 16;
+      p = realloc (exts, alloc_exts * sizeof (struct extent));
+      if (p == NULL) {
+        perror ("realloc");
+        return -1;
+      }
+      exts = p;
+    }
+    exts[nr_exts].start = fs_offset + pstart * 512;
+    exts[nr_exts].end = fs_offset + (pend + 1) * 512;
+    nr_exts++;
+  }
+
+  pthread_mutex_lock (&current_object_mutex);
+  for (i = 0; i < nr_exts; ++i)
+    insert (&disks[disk], exts[i].start, exts[i].end, object);
+  journal_object (object);
+  pthread_mutex_unlock (&current_object_mutex);
+
+  for (i = 0; i < nr_exts; ++i)
+    *bytes += exts[i].end - exts[i].start;
+
+  return 0;
 }
 
 struct visit_context {
+  struct worker *w;
   guestfs_h *g;
   const char *dev;              /* filesystem */
-  size_t nr_files;              /* used for progress bar */
-  size_t files_processed;
+  size_t disk;                  /* disk containing filesystem (extents) */
+  int64_t offset;               /* of filesystem in disk, -1 = read files */
+  size_t extents_ok;            /* files mapped using extents */
+  size_t extents_failed;        /* files where we had to fall back */
+  struct batch batch;           /* files waiting to be read */
+  size_t files_processed;       /* used for progress bar */
+  uint64_t nr_inodes;           /* inodes in use, or 0 if not known */
+  uint64_t used_bytes;          /* space in use, or 0 if not known */
+  uint64_t bytes_read_start;    /* w->bytes_read when we started */
+  uint64_t extent_bytes;        /* bytes mapped using extents */
 };
 
+/* Add a file or directory to the batch.  Instead of two appliance
+ * calls per object, the appliance is sent a single script which reads
+ * every object in the batch, between sentinel reads (see sentinel)
+ * which tell us which object each read belongs to.
+ *
+ * As with the bmap command, the object is opened (a directory by
+ * changing into it) before its sentinel, and ended by sentinel 0
+ * before the next object is opened, so that the reads which look up
+ * its path are not charged to any object.  If it cannot be opened,
+ * nothing is read for it.
+ */
+static int
+add_to_batch (struct visit_context *context, char type,
+              const char *path, const char *object)
+{
+  struct batch *b = &context->batch;
+  CLEANUP_FREE char *sysroot_path = NULL, *quoted = NULL;
+
+  if (b->nr == 0) {
+    b->objects_fp = open_memstream (&b->objects, &b->objects_len);
+    b->script_fp = open_memstream (&b->script, &b->script_len);
+    if (b->objects_fp == NULL || b->script_fp == NULL) {
+      perror ("open_memstream");
+      return -1;
+    }
+
+    /* Sentinels are read with O_DIRECT so they always reach us, and
+     * caches are dropped before each object (as the bmap command
+     * does) so that its blocks are really read from the disk.
+     */
+    fprintf (b->script_fp,
+             "s() { dd if=%s of=/dev/null bs=%d count=1 skip=$1 iflag=direct 2>/dev/null; }\n"
+             "d() { echo 3 > /proc/sys/vm/drop_caches; }\n",
+             context->w->devices[0], SENTINEL_STRIDE);
+  }
+
+  if (b->nr >= b->nr_alloc) {
+    size_t *p;
+
+    b->nr_alloc = b->nr_alloc ? b->nr_alloc * 2 : 64;
+    p = realloc (b->offsets, b->nr_alloc * sizeof (size_t));
+    if (p == NULL) {
+      perror ("realloc");
+      return -1;
+    }
+    b->offsets = p;
+  }
+  b->offsets[b->nr] = ftell (b->objects_fp);
+  fputs (object, b->objects_fp);
+  fputc ('\0', b->objects_fp);
+
+  if (asprintf (&sysroot_path, "/sysroot%s", path) == -1)
+    return -1;
+  quoted = shell_quote (sysroot_path);
+  if (quoted == NULL)
+    return -1;
+  b->nr++;
+  if (type == 'd')
+    fprintf (b->script_fp,
+             "cd %s 2>/dev/null && { d; s %" PRIu64 "; ls -f >/dev/null 2>&1; s %" PRIu64 "; }\n",
+             quoted, sentinel_base / SENTINEL_STRIDE + b->nr,
+             sentinel_base / SENTINEL_STRIDE);
+  else
+    fprintf (b->script_fp,
+             "{ d; s %" PRIu64 "; cat; s %" PRIu64 "; } >/dev/null 2>&1 < %s\n",
+             sentinel_base / SENTINEL_STRIDE + b->nr,
+             sentinel_base / SENTINEL_STRIDE, quoted);
+
+  return 0;
+}
+
+/* Run the batch in the appliance. */
+static int
+flush_batch (struct visit_context *context)
+{
+  struct batch *b = &context->batch;
+  const char *argv[2];
+  char *r;
+
+  if (b->nr == 0)
+    return 0;
+
+  if (fclose (b->script_fp) == EOF || fclose (b->objects_fp) == EOF) {
+    perror ("fclose");
+    return -1;
+  }
+  b->script_fp = b->objects_fp = NULL;
+
+  pthread_mutex_lock (&current_object_mutex);
+  context->w->active_batch = b;
+  pthread_mutex_unlock (&current_object_mutex);
+
+  argv[0] = b->script;
+  argv[1] = NULL;
+  r = debug (context->g, "batch", "sh", argv);
+
+  pthread_mutex_lock (&current_object_mutex);
+  context->w->active_batch = NULL;
+  free (context->w->current_object);
+  context->w->current_object = NULL;
+  pthread_mutex_unlock (&current_object_mutex);
+
+  free (b->script);
+  free (b->objects);
+  b->script = b->objects = NULL;
+  b->nr = 0;
+
+  if (r == NULL)
+    return -1;
+  free (r);
+  return 0;
+}
+
 static int
-examine_filesystem (guestfs_h *g, const char *dev, const char *type)
+examine_filesystem (struct worker *w, const char *dev, const char *type)
 {
+  guestfs_h *g = w->g;
+  struct phase phase;
+  uint64_t t;
   int r;
 
+  if (resume && find_name (&done_filesystems, dev)) {
+    printf ("virt-bmap: filesystem on %s was examined already\n", dev);
+    return 0;
+  }
+
   /* Try to mount it. */
+  begin_phase (w, &phase);
   guestfs_push_error_handler (g, NULL, NULL);
+  t = stats_now ();
   r = guestfs_mount_ro (g, dev, "/");
+  stats_rpc ("mount_ro", t);
   guestfs_pop_error_handler (g);
   if (r == 0) {
     struct visit_context context;
-    CLEANUP_FREE_STRING_LIST char **files = NULL;
+    struct visit_options options;
+    CLEANUP_FREE_STATVFS struct guestfs_statvfs *vfs = NULL;
+    int vr;
 
     /* Mountable, so examine the filesystem. */
     printf ("virt-bmap: examining filesystem on %s (%s) ...\n", dev, type);
-    count_filesystems++;
+    w->count_filesystems++;
 
-    /* Read how many files/directories there are so we can estimate
-     * progress.
+    /* Find out roughly how big the filesystem is so we can estimate
+     * progress, without having to walk it twice.
      */
-    files = guestfs_find (g, "/");
+    guestfs_push_error_handler (g, NULL, NULL);
+    t = stats_now ();
+    vfs = guestfs_statvfs (g, "/");
+    stats_rpc ("statvfs", t);
+    guestfs_pop_error_handler (g);
 
     /* Set filesystem readahead to 0, but ignore error if not possible. */
     guestfs_push_error_handler (g, NULL, NULL);
     guestfs_blockdev_setra (g, dev, 0);
     guestfs_pop_error_handler (g);
 
+    memset (&context, 0, sizeof context);
+    context.w = w;
     context.g = g;
     context.dev = dev;
-    context.nr_files = count_strings (files);
+    context.offset = -1;
+    if (extents) {
+      context.offset = filesystem_offset (w, dev, type, &context.disk);
+      if (context.offset == -1)
+        printf ("virt-bmap: cannot use extents on %s, reading files instead\n",
+                dev);
+    }
     context.files_processed = 0;
-    if (visit (g, "/", visit_fn, &context) == -1)
+    if (vfs) {
+      /* Filesystems without inodes (eg. vfat) report 0 files. */
+      if (vfs->files > vfs->ffree)
+        context.nr_inodes = vfs->files - vfs->ffree;
+      if (vfs->blocks > vfs->bfree)
+        context.used_bytes = (vfs->blocks - vfs->bfree) * vfs->frsize;
+    }
+    context.bytes_read_start =
+      __atomic_load_n (&w->bytes_read, __ATOMIC_RELAXED);
+
+    /* visit_fn only needs the file type, which comes with the
+     * directory listing, so don't fetch stats or xattrs.
+     */
+    memset (&options, 0, sizeof options);
+    options.flags = 0;
+    if (w->pg) {
+      guestfs_push_error_handler (w->pg, NULL, NULL);
+      if (guestfs_mount_ro (w->pg, dev, "/") == 0)
+        options.prefetch = w->pg;
+      guestfs_pop_error_handler (w->pg);
+    }
+
+    vr = visit (g, "/", &options, visit_fn, &context);
+    if (w->pg)
+      guestfs_umount_all (w->pg);
+    if (vr == 0)
+      vr = flush_batch (&context);
+    if (context.batch.script_fp)
+      fclose (context.batch.script_fp);
+    if (context.batch.objects_fp)
+      fclose (context.batch.objects_fp);
+    free (context.batch.script);
+    free (context.batch.objects);
+    free (context.batch.offsets);
+    if (vr == -1)
       return -1;
   }
 
+  t = stats_now ();
   guestfs_umount_all (g);
+  stats_rpc ("umount_all", t);
+  end_phase (w, &phase, "filesystem", dev);
+
+  if (journal) {
+    pthread_mutex_lock (&current_object_mutex);
+    journal_filesystem_done (journal, dev);
+    pthread_mutex_unlock (&current_object_mutex);
+  }
 
   return 0;
 }
 
+/* Estimate progress from the number of inodes in use, or if the
+ * filesystem doesn't tell us that, from the number of bytes mapped so
+ * far compared to the space in use.  Neither is exact (eg. hard links
+ * are visited more than once) so the estimate is capped.
+ */
+static void
+print_progress (struct visit_context *context)
+{
+  double pct = -1;
+
+  if (context->nr_inodes > 0)
+    pct = 100.0 * context->files_processed / context->nr_inodes;
+  else if (context->used_bytes > 0) {
+    uint64_t bytes =
+      __atomic_load_n (&context->w->bytes_read, __ATOMIC_RELAXED) -
+      context->bytes_read_start + context->extent_bytes;
+
+    pct = 100.0 * bytes / context->used_bytes;
+  }
+
+  if (pct < 0)
+    printf ("%zu        \r", context->files_processed);
+  else
+    printf ("%zu (%.1f%%)        \r",
+            context->files_processed, pct > 99.9 ? 99.9 : pct);
+  fflush (stdout);
+}
+
 static int
-visit_fn (const char *dir, const char *name,
+visit_fn (const char *path, const char *name,
           const struct guestfs_statns *stat,
           const struct guestfs_xattr_list *xattrs,
           void *contextv)
@@ -579,21 +1880,13 @@ visit_fn (const char *dir, const char *name,
   struct visit_context *context = contextv;
   guestfs_h *g = context->g;
   char type = '?';
-  CLEANUP_FREE char *path = NULL, *object = NULL;
+  CLEANUP_FREE char *object = NULL;
   const char *argv[2];
   char *r;
 
   context->files_processed++;
-  if ((context->files_processed & 255) == 0) {
-    printf ("%zu/%zu (%.1f%%)        \r",
-            context->files_processed, context->nr_files,
-            100.0 * context->files_processed / context->nr_files);
-    fflush (stdout);
-  }
-
-  path = full_path (dir, name);
-  if (path == NULL)
-    return -1;
+  if ((context->files_processed & 255) == 0)
+    print_progress (context);
 
   if (is_reg (stat->st_mode))
     type = 'f';
@@ -606,67 +1899,143 @@ visit_fn (const char *dir, const char *name,
   if (asprintf (&object, "%c %s %s", type, context->dev, path) == -1)
     return -1;
 
-  if (type == 'f') {            /* regular file */
-    count_regular++;
-  bmap_file:
-    argv[0] = path;
-    argv[1] = NULL;
-    r = guestfs_debug (g, "bmap_file", (char **) argv);
-    if (r == NULL)
-      return -1;
-    free (r);
-    mark_start (object);
-    argv[0] = NULL;
-    r = guestfs_debug (g, "bmap", (char **) argv);
-    mark_end ();
-    if (r == NULL)
-      return -1;
-    free (r);
+  if (type == 'f')              /* regular file */
+    context->w->count_regular++;
+  else if (type == 'd')         /* directory */
+    context->w->count_directory++;
+  else
+    return 0;
+
+  if (is_done (object))
+    return 0;
+
+  if (context->offset >= 0) {
+    if (map_extents (g, context->disk, context->offset, path, object,
+                     &context->extent_bytes) == 0) {
+      context->extents_ok++;
+      return 0;
+    }
+    context->extents_failed++;
+
+    /* If extents don't work at all on this filesystem, stop trying. */
+    if (context->extents_ok == 0 && context->extents_failed >= 16) {
+      printf ("virt-bmap: extents do not work on %s, reading files instead\n",
+              context->dev);
+      context->offset = -1;
+    }
   }
-  else if (type == 'd') {       /* directory */
-    count_directory++;
-    goto bmap_file;
+
+  if (batch_size > 0) {
+    if (add_to_batch (context, type, path, object) == -1)
+      return -1;
+    if (context->batch.nr >= batch_size ||
+        ftell (context->batch.script_fp) >= 256 * 1024)
+      return flush_batch (context);
+    return 0;
   }
 
+  argv[0] = path;
+  argv[1] = NULL;
+  r = debug (g, "bmap_file", "bmap_file", argv);
+  if (r == NULL)
+    return -1;
+  free (r);
+  mark_start (context->w, object);
+  argv[0] = NULL;
+  r = debug (g, "bmap", "bmap", argv);
+  mark_end (context->w, r != NULL);
+  if (r == NULL)
+    return -1;
+  free (r);
+
   return 0;
 }
 
 /* Convert ranges to output file format. */
 static void print_range (uint64_t start, uint64_t end, const char *object, void *opaque);
 
+struct print_context {
+  struct output *o;
+  int disk;                     /* disk index printed in the output */
+};
+
 static int
 ranges_to_output (void)
 {
-  FILE *fp;
+  struct print_context pc;
+  void *maps[nr_disks];
+  size_t i;
+  int r = 0;
 
+  /* Nothing more is added to the maps by now, so detach them from
+   * bmap_pread and write them out without holding current_object_mutex.
+   */
   pthread_mutex_lock (&current_object_mutex);
+  for (i = 0; i < nr_disks; ++i) {
+    maps[i] = disks[i].ranges;
+    disks[i].ranges = NULL;
+  }
+  pthread_mutex_unlock (&current_object_mutex);
 
   /* Write out the ranges to 'output'. */
-  fp = fopen (output, "w");
-  if (fp == NULL) {
+  pc.o = output_open (output, compress);
+  if (pc.o == NULL) {
     perror (output);
-    return -1;
+    r = -1;
+  }
+  else {
+    for (i = 0; i < nr_disks; ++i) {
+      pc.disk = i + 1;
+      iter_range (maps[i], print_range, &pc);
+    }
+    if (output_close (pc.o) == -1) {
+      perror (output);
+      r = -1;
+    }
   }
 
-  iter_range (ranges, print_range, fp);
+  /* The binary block map also holds the reverse (object -> extents)
+   * index, so tools can load it without parsing the text output.
+   */
+  if (binary_file) {
+    FILE *fp = fopen (binary_file, "w");
 
-  fclose (fp);
+    if (fp == NULL) {
+      perror (binary_file);
+      r = -1;
+    }
+    else {
+      for (i = 0; i < nr_disks; ++i) {
+        if (ranges_write_binary (maps[i], i + 1, fp) == -1) {
+          perror (binary_file);
+          r = -1;
+          break;
+        }
+      }
+      if (fclose (fp) == EOF) {
+        perror (binary_file);
+        r = -1;
+      }
+    }
+  }
 
+  pthread_mutex_lock (&current_object_mutex);
+  for (i = 0; i < nr_disks; ++i)
+    disks[i].ranges = maps[i];
   pthread_mutex_unlock (&current_object_mutex);
 
-  return 0;
+  return r;
 }
 
 static void
 print_range (uint64_t start, uint64_t end, const char *object, void *opaque)
 {
-  FILE *fp = opaque;
+  struct print_context *pc = opaque;
 
-  /* Note that the initial '1' is meant to signify the first disk.
-   * Currently we can only map a single disk, but in future we
-   * should be able to handle multiple disks.
+  /* Note that the initial column is the disk index, counting from 1
+   * in the order the disks were given on the command line.
    */
-  fprintf (fp, "1 %" PRIx64 " %" PRIx64 " %s\n", start, end, object);
+  output_range (pc->o, pc->disk, start, end, object);
 }
 
 /* Register the nbdkit plugin. */
@@ -0,0 +1,242 @@
+/* virt-bmap-heat
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Join a heatmap saved by the logger (see heatmap= in logger.c) with
+ * the block map, and list the objects which were accessed most.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "heatmap.h"
+#include "ranges.h"
+
+/* Heat of each object.  A block's counters are shared between the
+ * objects in it by the number of bytes of the block each one covers,
+ * so an object much smaller than a block only gets a share of the
+ * block's accesses.
+ */
+struct object_heat {
+  uint32_t id;
+  double reads, writes;
+  uint64_t bytes;
+};
+
+struct join {
+  const struct heatmap *hm;
+  uint64_t *read_sums;          /* read_sums[b] = reads of blocks [0, b) */
+  uint64_t *write_sums;
+  const char *types;            /* -t, or NULL for all types */
+  void *ranges;
+  struct object_heat *objects;  /* indexed by object ID */
+};
+
+static int per_mb = 0;
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: virt-bmap-heat [-n top] [-t types] [-m] bmap heatmap\n");
+  exit (EXIT_FAILURE);
+}
+
+/* Load disk 1 from the block map, which may be text or binary. */
+static void *
+load_bmap (const char *bmap_file)
+{
+  void *map;
+  size_t line;
+  char msg[PATH_MAX + 64];
+
+  map = ranges_load (bmap_file, 1, &line);
+  if (map == NULL) {
+    ranges_load_error (bmap_file, 1, line, msg, sizeof msg);
+    fprintf (stderr, "virt-bmap-heat: %s\n", msg);
+  }
+  return map;
+}
+
+/* Sum of counters[b] * (bytes of block b in [start, end)) / block size. */
+static double
+heat_of (const struct heatmap *hm, const uint8_t *counters,
+         const uint64_t *sums, uint64_t start, uint64_t end)
+{
+  const unsigned shift = hm->block_shift;
+  const double block_size = UINT64_C(1) << shift;
+  uint64_t first, last;
+
+  if (end > hm->nr_blocks << shift)
+    end = hm->nr_blocks << shift;
+  if (start >= end)
+    return 0;
+
+  first = start >> shift;
+  last = (end - 1) >> shift;
+  if (first == last)
+    return counters[first] * (end - start) / block_size;
+
+  return counters[first] * (((first + 1) << shift) - start) / block_size +
+    (sums[last] - sums[first + 1]) +
+    counters[last] * (end - (last << shift)) / block_size;
+}
+
+/* Callback from iter_range_id. */
+static void
+join_callback (uint64_t start, uint64_t end, uint32_t id, void *opaque)
+{
+  struct join *j = opaque;
+  struct object_heat *o = &j->objects[id];
+
+  if (j->types && strchr (j->types, ranges_object_type (j->ranges, id)) == NULL)
+    return;
+
+  o->id = id;
+  o->reads += heat_of (j->hm, j->hm->reads, j->read_sums, start, end);
+  o->writes += heat_of (j->hm, j->hm->writes, j->write_sums, start, end);
+  o->bytes += end - start;
+}
+
+static double
+sort_key (const struct object_heat *o)
+{
+  double heat = o->reads + o->writes;
+
+  if (per_mb)
+    heat = o->bytes ? heat * 1048576 / o->bytes : 0;
+  return heat;
+}
+
+static int
+compare_heat (const void *av, const void *bv)
+{
+  const struct object_heat *a = av, *b = bv;
+  double ka = sort_key (a), kb = sort_key (b);
+
+  if (ka != kb)
+    return ka > kb ? -1 : 1;
+  return a->id < b->id ? -1 : a->id > b->id;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct heatmap *hm;
+  struct join j;
+  struct ranges_stats stats;
+  const char *types = NULL;
+  size_t top = 20, n, i, alloc;
+  uint64_t b;
+  char *name;
+  int c;
+
+  while ((c = getopt (argc, argv, "n:t:m")) != -1) {
+    switch (c) {
+    case 'n': top = strtoul (optarg, NULL, 0); break;
+    case 't': types = optarg; break;
+    case 'm': per_mb = 1; break;
+    default: usage ();
+    }
+  }
+  if (argc - optind != 2)
+    usage ();
+
+  j.ranges = load_bmap (argv[optind]);
+  if (j.ranges == NULL)
+    exit (EXIT_FAILURE);
+
+  hm = heatmap_read (argv[optind+1]);
+  if (hm == NULL) {
+    if (errno == EINVAL)
+      fprintf (stderr, "virt-bmap-heat: %s: not a heatmap file\n",
+               argv[optind+1]);
+    else
+      perror (argv[optind+1]);
+    exit (EXIT_FAILURE);
+  }
+
+  j.hm = hm;
+  j.types = types;
+  j.read_sums = malloc ((hm->nr_blocks + 1) * sizeof (uint64_t));
+  j.write_sums = malloc ((hm->nr_blocks + 1) * sizeof (uint64_t));
+  ranges_stats (j.ranges, &stats);
+  j.objects = calloc (stats.nr_name_nodes, sizeof (struct object_heat));
+  if (j.read_sums == NULL || j.write_sums == NULL || j.objects == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  j.read_sums[0] = j.write_sums[0] = 0;
+  for (b = 0; b < hm->nr_blocks; ++b) {
+    j.read_sums[b+1] = j.read_sums[b] + hm->reads[b];
+    j.write_sums[b+1] = j.write_sums[b] + hm->writes[b];
+  }
+
+  iter_range_id (j.ranges, join_callback, &j);
+
+  /* Pack the objects which were accessed at the front, and sort them. */
+  for (i = n = 0; i < stats.nr_name_nodes; ++i)
+    if (j.objects[i].reads > 0 || j.objects[i].writes > 0)
+      j.objects[n++] = j.objects[i];
+  qsort (j.objects, n, sizeof (struct object_heat), compare_heat);
+  if (top > 0 && n > top)
+    n = top;
+
+  printf ("%12s %12s %12s  %s\n",
+          per_mb ? "reads/MB" : "reads", per_mb ? "writes/MB" : "writes",
+          "bytes", "object");
+  alloc = 256;
+  name = malloc (alloc);
+  if (name == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; ++i) {
+    const struct object_heat *o = &j.objects[i];
+    double scale = per_mb ? 1048576.0 / o->bytes : 1;
+    size_t len = ranges_object_name (j.ranges, o->id, name, alloc);
+
+    if (len >= alloc) {
+      alloc = len + 1;
+      name = realloc (name, alloc);
+      if (name == NULL) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
+      }
+      ranges_object_name (j.ranges, o->id, name, alloc);
+    }
+    printf ("%12.1f %12.1f %12" PRIu64 "  %s\n",
+            o->reads * scale, o->writes * scale, o->bytes, name);
+  }
+
+  free (name);
+  free (j.objects);
+  free (j.write_sums);
+  free (j.read_sums);
+  heatmap_free (hm);
+  free_ranges (j.ranges);
+  exit (EXIT_SUCCESS);
+}
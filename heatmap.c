@@ -0,0 +1,212 @@
+/* virt-bmap block access heatmap
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Logging every request is impossible over a workload running for
+ * days, so instead the logger can count the accesses to each block
+ * (see heatmap= in logger.c) and write the counts out now and then.
+ * virt-bmap-heat joins them with the block map afterwards.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "heatmap.h"
+
+#define HEATMAP_VERSION 1
+
+/* Header of a heatmap file, followed by nr_blocks read counters and
+ * nr_blocks write counters.
+ */
+struct heatmap_header {
+  char magic[8];                /* HEATMAP_MAGIC */
+  uint32_t version;
+  uint32_t block_shift;
+  uint64_t disk_size;
+  uint64_t nr_blocks;
+  uint64_t time;
+};
+
+static struct heatmap *
+alloc_heatmap (uint64_t disk_size, unsigned block_shift)
+{
+  struct heatmap *hm;
+
+  hm = calloc (1, sizeof *hm);
+  if (hm == NULL)
+    return NULL;
+  hm->disk_size = disk_size;
+  hm->block_shift = block_shift;
+  hm->nr_blocks = (disk_size + (UINT64_C(1) << block_shift) - 1) >> block_shift;
+  hm->reads = calloc (hm->nr_blocks ? hm->nr_blocks : 1, 1);
+  hm->writes = calloc (hm->nr_blocks ? hm->nr_blocks : 1, 1);
+  if (hm->reads == NULL || hm->writes == NULL) {
+    heatmap_free (hm);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return hm;
+}
+
+struct heatmap *
+heatmap_new (uint64_t disk_size, unsigned block_shift)
+{
+  if (block_shift < 9 || block_shift > 30) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return alloc_heatmap (disk_size, block_shift);
+}
+
+void
+heatmap_free (struct heatmap *hm)
+{
+  if (hm) {
+    free (hm->reads);
+    free (hm->writes);
+    free (hm);
+  }
+}
+
+void
+heatmap_add (struct heatmap *hm, uint64_t offset, uint32_t count, int is_read)
+{
+  uint8_t *counters = is_read ? hm->reads : hm->writes;
+  uint64_t b, last;
+
+  if (count == 0 || offset >= hm->disk_size)
+    return;
+  last = (offset + count - 1) >> hm->block_shift;
+  if (last >= hm->nr_blocks)
+    last = hm->nr_blocks - 1;
+
+  for (b = offset >> hm->block_shift; b <= last; ++b) {
+    uint8_t c = __atomic_load_n (&counters[b], __ATOMIC_RELAXED);
+
+    while (c < HEATMAP_MAX &&
+           !__atomic_compare_exchange_n (&counters[b], &c, c + 1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+}
+
+static int
+write_all (FILE *fp, const void *buf, size_t len)
+{
+  if (len > 0 && fwrite (buf, len, 1, fp) != 1)
+    return -1;
+  return 0;
+}
+
+int
+heatmap_write (struct heatmap *hm, const char *filename)
+{
+  struct heatmap_header h;
+  char *tmp;
+  FILE *fp;
+  int err;
+
+  if (asprintf (&tmp, "%s.tmp", filename) == -1)
+    return -1;
+  fp = fopen (tmp, "w");
+  if (fp == NULL)
+    goto error;
+
+  memset (&h, 0, sizeof h);
+  memcpy (h.magic, HEATMAP_MAGIC, sizeof h.magic);
+  h.version = HEATMAP_VERSION;
+  h.block_shift = hm->block_shift;
+  h.disk_size = hm->disk_size;
+  h.nr_blocks = hm->nr_blocks;
+  h.time = hm->time = time (NULL);
+
+  if (write_all (fp, &h, sizeof h) == -1 ||
+      write_all (fp, hm->reads, hm->nr_blocks) == -1 ||
+      write_all (fp, hm->writes, hm->nr_blocks) == -1) {
+    err = errno;
+    fclose (fp);
+    errno = err ? err : EIO;
+    goto error_unlink;
+  }
+  if (fclose (fp) == EOF)
+    goto error_unlink;
+  if (rename (tmp, filename) == -1)
+    goto error_unlink;
+
+  free (tmp);
+  return 0;
+
+ error_unlink:
+  err = errno;
+  unlink (tmp);
+  errno = err;
+ error:
+  err = errno;
+  free (tmp);
+  errno = err;
+  return -1;
+}
+
+struct heatmap *
+heatmap_read (const char *filename)
+{
+  struct heatmap_header h;
+  struct heatmap *hm = NULL;
+  FILE *fp;
+  int err;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL)
+    return NULL;
+
+  if (fread (&h, sizeof h, 1, fp) != 1 ||
+      memcmp (h.magic, HEATMAP_MAGIC, sizeof h.magic) != 0 ||
+      h.version != HEATMAP_VERSION ||
+      h.block_shift < 9 || h.block_shift > 30 ||
+      h.nr_blocks != (h.disk_size + (UINT64_C(1) << h.block_shift) - 1) >> h.block_shift) {
+    errno = ferror (fp) ? EIO : EINVAL;
+    goto error;
+  }
+
+  hm = alloc_heatmap (h.disk_size, h.block_shift);
+  if (hm == NULL)
+    goto error;
+  hm->time = h.time;
+  if (hm->nr_blocks > 0 &&
+      (fread (hm->reads, hm->nr_blocks, 1, fp) != 1 ||
+       fread (hm->writes, hm->nr_blocks, 1, fp) != 1)) {
+    errno = ferror (fp) ? EIO : EINVAL;
+    goto error;
+  }
+
+  fclose (fp);
+  return hm;
+
+ error:
+  err = errno;
+  heatmap_free (hm);
+  fclose (fp);
+  errno = err;
+  return NULL;
+}
@@ -0,0 +1,62 @@
+/* virt-bmap block access heatmap
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <stdint.h>
+
+/* Counts of the reads and writes of each block of a disk.  Counters
+ * are 8 bits and saturate at HEATMAP_MAX, so a heatmap of a 1 TB disk
+ * at 64K per block takes 32 MB.
+ */
+struct heatmap {
+  uint64_t disk_size;
+  unsigned block_shift;         /* block size is 1 << block_shift */
+  uint64_t nr_blocks;
+  uint64_t time;                /* when written or read, seconds since the epoch */
+  uint8_t *reads;
+  uint8_t *writes;
+};
+
+#define HEATMAP_MAX 255
+
+/* Magic at the start of a heatmap file. */
+#define HEATMAP_MAGIC "VBMAPHOT"
+
+/* Returns NULL with errno set on error. */
+extern struct heatmap *heatmap_new (uint64_t disk_size, unsigned block_shift);
+extern void heatmap_free (struct heatmap *hm);
+
+/* Count an access to [offset, offset+count).  Thread safe (counters
+ * are updated atomically) and does not take a lock.
+ */
+extern void heatmap_add (struct heatmap *hm, uint64_t offset, uint32_t count, int is_read);
+
+/* Write a snapshot of the counters to 'filename', replacing it
+ * atomically.  Accesses may be counted while this runs.  Returns -1
+ * with errno set on error.
+ */
+extern int heatmap_write (struct heatmap *hm, const char *filename);
+
+/* Read a heatmap file.  Returns NULL with errno set on error, EINVAL
+ * if the file is not a heatmap.
+ */
+extern struct heatmap *heatmap_read (const char *filename);
+
+#endif /* HEATMAP_H */
@@ -0,0 +1,408 @@
+/* virt-bmap examiner journal
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Mapping a big guest takes hours, and everything mapped so far is
+ * only held in memory until the output is written at the end.  The
+ * journal keeps a copy on disk, one line per record:
+ *
+ *   1 541400 544400 d /dev/sda1 /lost+found    a range, as in the output
+ *   = d /dev/sda1 /lost+found                  the object is finished
+ *   * /dev/sda1                                the filesystem is finished
+ *
+ * The ranges of an object are written just before its '=' record.
+ * When replaying, ranges are only used once that record is read, so a
+ * journal cut short anywhere by a crash still describes exactly the
+ * objects which were finished.
+ *
+ * Records are buffered, and written out and synced together at most
+ * every JOURNAL_SYNC_SECONDS (or when the buffer fills up), by a
+ * thread of the journal's own.  The threads adding records hold the
+ * examiner's locks, which every read from the appliances needs, so
+ * they must never wait for the disk: they keep adding records to a
+ * second buffer while the first is written.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include "journal.h"
+
+#define JOURNAL_SYNC_SECONDS 10
+#define BUFFER_SIZE (1024*1024)
+
+struct journal {
+  int fd;
+  int error;                    /* errno of first error, or 0 */
+  pthread_t thread;             /* see writer_thread */
+
+  /* NB: acquire 'lock' before accessing any of these. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;          /* the buffer is full, or 'stop' set */
+  char *buf;                    /* records not written out yet */
+  size_t len, alloc;
+  char *spare;                  /* next buffer, while 'buf' is written */
+  size_t spare_alloc;
+  int stop;
+};
+
+static void
+set_error (struct journal *j, int err)
+{
+  if (j->error == 0)
+    j->error = err;
+}
+
+static int
+full_write (int fd, const char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Append to the buffer.  NB: acquire j->lock. */
+static void
+append (struct journal *j, const char *s, size_t n)
+{
+  if (j->len + n > j->alloc) {
+    size_t alloc = j->alloc ? j->alloc : BUFFER_SIZE;
+    char *p;
+
+    while (j->len + n > alloc)
+      alloc *= 2;
+    p = realloc (j->buf, alloc);
+    if (p == NULL) {
+      set_error (j, errno);
+      return;
+    }
+    j->buf = p;
+    j->alloc = alloc;
+  }
+  memcpy (j->buf + j->len, s, n);
+  j->len += n;
+}
+
+/* Write out the buffer and sync the file.  The lock is dropped while
+ * writing.  NB: acquire j->lock.
+ */
+static void
+write_buffer (struct journal *j)
+{
+  char *buf;
+  size_t len, alloc;
+  int err = 0;
+
+  if (j->len == 0)
+    return;
+
+  buf = j->buf;
+  len = j->len;
+  alloc = j->alloc;
+  j->buf = j->spare;
+  j->alloc = j->spare_alloc;
+  j->len = 0;
+  j->spare = NULL;
+  j->spare_alloc = 0;
+  pthread_mutex_unlock (&j->lock);
+
+  if (full_write (j->fd, buf, len) == -1 || fdatasync (j->fd) == -1)
+    err = errno;
+
+  pthread_mutex_lock (&j->lock);
+  if (err)
+    set_error (j, err);
+  j->spare = buf;
+  j->spare_alloc = alloc;
+}
+
+/* Write out the buffer every JOURNAL_SYNC_SECONDS, or sooner if it
+ * fills up, and once more when the journal is closed.
+ */
+static void *
+writer_thread (void *jv)
+{
+  struct journal *j = jv;
+  struct timespec deadline;
+  int stop;
+
+  pthread_mutex_lock (&j->lock);
+  do {
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOURNAL_SYNC_SECONDS;
+    while (!j->stop && j->len < BUFFER_SIZE &&
+           pthread_cond_timedwait (&j->wake, &j->lock, &deadline) != ETIMEDOUT)
+      ;
+    stop = j->stop;
+    write_buffer (j);
+  } while (!stop);
+  pthread_mutex_unlock (&j->lock);
+
+  return NULL;
+}
+
+void
+journal_range (struct journal *j, int disk, uint64_t start, uint64_t end,
+               const char *object)
+{
+  char prefix[64];
+  int n;
+
+  n = snprintf (prefix, sizeof prefix, "%d %" PRIx64 " %" PRIx64 " ",
+                disk, start, end);
+  pthread_mutex_lock (&j->lock);
+  append (j, prefix, n);
+  append (j, object, strlen (object));
+  append (j, "\n", 1);
+  pthread_mutex_unlock (&j->lock);
+}
+
+static void
+add_done (struct journal *j, const char *prefix, const char *name)
+{
+  pthread_mutex_lock (&j->lock);
+  append (j, prefix, 2);
+  append (j, name, strlen (name));
+  append (j, "\n", 1);
+  if (j->len >= BUFFER_SIZE)
+    pthread_cond_signal (&j->wake);
+  pthread_mutex_unlock (&j->lock);
+}
+
+void
+journal_object_done (struct journal *j, const char *object)
+{
+  add_done (j, "= ", object);
+}
+
+void
+journal_filesystem_done (struct journal *j, const char *dev)
+{
+  add_done (j, "* ", dev);
+}
+
+/* Parse a number ending in a space in the line [p, nl). */
+static const char *
+parse_number (const char *p, const char *nl, int base, uint64_t *v)
+{
+  char *end;
+
+  if (p >= nl ||
+      !(base == 16 ? isxdigit ((unsigned char) *p) : isdigit ((unsigned char) *p)))
+    return NULL;
+  errno = 0;
+  *v = strtoull (p, &end, base);
+  if (errno != 0 || end >= nl || *end != ' ')
+    return NULL;
+  return end + 1;
+}
+
+struct pending_range {
+  int disk;
+  uint64_t start, end;
+  const char *object;           /* in the journal, not \0-terminated */
+  size_t len;
+};
+
+/* Replay the records in 'fd', and return the length of the journal up
+ * to the end of the last complete record.
+ */
+static off_t
+replay_journal (int fd, const struct journal_replay *replay)
+{
+  struct stat statbuf;
+  const char *data, *p, *nl, *end;
+  struct pending_range *pending = NULL;
+  size_t nr_pending = 0, alloc_pending = 0, i;
+  char *name = NULL;
+  off_t committed = 0;
+
+  if (fstat (fd, &statbuf) == -1)
+    return -1;
+  if (statbuf.st_size == 0)
+    return 0;
+  data = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+  end = data + statbuf.st_size;
+
+  for (p = data; p < end; p = nl + 1) {
+    nl = memchr (p, '\n', end - p);
+    if (nl == NULL)
+      break;                    /* cut short */
+
+    if (*p == '=' || *p == '*') {
+      if (nl - p < 2 || p[1] != ' ')
+        break;
+      free (name);
+      name = strndup (p + 2, nl - (p + 2));
+      if (name == NULL)
+        goto error;
+      if (*p == '=') {
+        for (i = 0; i < nr_pending; ++i)
+          if (pending[i].len == (size_t) (nl - (p + 2)) &&
+              memcmp (pending[i].object, p + 2, pending[i].len) == 0)
+            replay->range (pending[i].disk, pending[i].start, pending[i].end,
+                           name, replay->opaque);
+        replay->object_done (name, replay->opaque);
+      }
+      else
+        replay->filesystem_done (name, replay->opaque);
+      nr_pending = 0;
+      committed = nl + 1 - data;
+    }
+    else {
+      struct pending_range r;
+      uint64_t disk;
+      const char *q = p;
+
+      if ((q = parse_number (q, nl, 10, &disk)) == NULL ||
+          (q = parse_number (q, nl, 16, &r.start)) == NULL ||
+          (q = parse_number (q, nl, 16, &r.end)) == NULL ||
+          disk == 0 || disk > INT_MAX || q == nl)
+        break;
+      r.disk = disk;
+      r.object = q;
+      r.len = nl - q;
+
+      if (nr_pending >= alloc_pending) {
+        struct pending_range *np;
+
+        alloc_pending = alloc_pending ? alloc_pending * 2 : 64;
+        np = realloc (pending, alloc_pending * sizeof *pending);
+        if (np == NULL)
+          goto error;
+        pending = np;
+      }
+      pending[nr_pending++] = r;
+    }
+  }
+
+  free (name);
+  free (pending);
+  munmap ((void *) data, statbuf.st_size);
+  return committed;
+
+ error:
+  free (name);
+  free (pending);
+  munmap ((void *) data, statbuf.st_size);
+  errno = ENOMEM;
+  return -1;
+}
+
+struct journal *
+journal_open (const char *filename, const struct journal_replay *replay)
+{
+  struct journal *j;
+  off_t committed;
+  int err;
+
+  j = calloc (1, sizeof *j);
+  if (j == NULL)
+    return NULL;
+
+  j->fd = open (filename,
+                O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC|(replay ? 0 : O_TRUNC),
+                0666);
+  if (j->fd == -1)
+    goto error;
+
+  /* A record cut short would run into the next record written, so
+   * throw it away.
+   */
+  if (replay) {
+    committed = replay_journal (j->fd, replay);
+    if (committed == -1 || ftruncate (j->fd, committed) == -1)
+      goto error_close;
+  }
+
+  pthread_mutex_init (&j->lock, NULL);
+  pthread_cond_init (&j->wake, NULL);
+  err = pthread_create (&j->thread, NULL, writer_thread, j);
+  if (err != 0) {
+    pthread_mutex_destroy (&j->lock);
+    pthread_cond_destroy (&j->wake);
+    errno = err;
+    goto error_close;
+  }
+  return j;
+
+ error_close:
+  err = errno;
+  close (j->fd);
+  errno = err;
+ error:
+  err = errno;
+  free (j);
+  errno = err;
+  return NULL;
+}
+
+int
+journal_close (struct journal *j)
+{
+  int err;
+
+  pthread_mutex_lock (&j->lock);
+  j->stop = 1;
+  pthread_cond_signal (&j->wake);
+  pthread_mutex_unlock (&j->lock);
+  pthread_join (j->thread, NULL);
+
+  if (close (j->fd) == -1)
+    set_error (j, errno);
+
+  err = j->error;
+  pthread_mutex_destroy (&j->lock);
+  pthread_cond_destroy (&j->wake);
+  free (j->buf);
+  free (j->spare);
+  free (j);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
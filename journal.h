@@ -0,0 +1,66 @@
+/* virt-bmap examiner journal
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The journal records each object when it has been mapped, and each
+ * filesystem when all of it has, so that a run which dies can be
+ * resumed without mapping them again.  See journal.c.
+ */
+
+struct journal;
+
+/* Called for every record of a journal being replayed.  The ranges of
+ * an object are only passed once its object_done record is found, so
+ * objects which were being mapped when the run died are left out.
+ */
+struct journal_replay {
+  void (*range) (int disk, uint64_t start, uint64_t end, const char *object, void *opaque);
+  void (*object_done) (const char *object, void *opaque);
+  void (*filesystem_done) (const char *dev, void *opaque);
+  void *opaque;
+};
+
+/* Open 'filename' for appending records.  If 'replay' is NULL the
+ * journal is started afresh, otherwise the records already in it are
+ * replayed first, and anything after the last complete record is
+ * discarded.  Returns NULL with errno set on error.
+ */
+extern struct journal *journal_open (const char *filename, const struct journal_replay *replay);
+
+/* Append records.  The ranges of an object must be followed by its
+ * object_done record, with no other records in between, so the caller
+ * must serialize them.  Records are buffered and written out, and the
+ * file synced, at most every few seconds by another thread, so these
+ * never wait for the disk.  Errors are remembered and reported by
+ * journal_close.
+ */
+extern void journal_range (struct journal *j, int disk, uint64_t start, uint64_t end, const char *object);
+extern void journal_object_done (struct journal *j, const char *object);
+extern void journal_filesystem_done (struct journal *j, const char *dev);
+
+/* Write out and sync any buffered records and close the file.
+ * Returns -1 with errno set if anything failed since journal_open.
+ */
+extern int journal_close (struct journal *j);
+
+#endif /* JOURNAL_H */
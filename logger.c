@@ -27,23 +27,126 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <fnmatch.h>
+
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
 #include "cleanups.h"
+#include "heatmap.h"
 #include "ranges.h"
+#include "shared.h"
 
 static char *file = NULL;
 static char *bmap = NULL;
 static char *logfile = NULL;
 static void *ranges = NULL;
+static void *blocks = NULL;     /* block table of 'ranges', or NULL */
+static char *index_file = NULL;
+static void *shared = NULL;     /* shared index used instead of 'ranges', see index= */
 static FILE *logfp = NULL;
+static int show_extents = 0;
+static uint64_t flush_ns = 1000000000; /* see flush= */
+static int log_accesses = 1;    /* see log= */
+static char *heatmap_file = NULL;
+static unsigned heatmap_shift = 16; /* see heatmap_block= */
+static uint64_t heatmap_interval_ns = UINT64_C(60000000000); /* see heatmap_interval= */
+static struct heatmap *heatmap = NULL;
+
+/* Filters on the objects logged (see types=, device=, path=), and
+ * the bitset of object IDs which pass them, or NULL to log every
+ * object.
+ */
+static const char *types = NULL;
+static const char **devices = NULL;
+static size_t nr_devices = 0;
+static const char **paths = NULL;
+static size_t nr_paths = 0;
+static uint8_t *logged = NULL;
+
+/* NB: acquire 'log_lock' before writing to the log, or accessing
+ * 'handles' or the 'run' of any handle.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static struct handle *handles = NULL;
+static pthread_t timer;
+static int timer_started = 0;
+static int timer_stop = 0;
+
+/* Set by SIGUSR1: print block map statistics to the log. */
+static volatile sig_atomic_t print_stats = 0;
+
+static void
+usr1_handler (int sig)
+{
+  print_stats = 1;
+}
+
+/* When several objects overlap an access, the most specific one is
+ * logged.
+ */
+static int
+priority_of_type (int type)
+{
+  switch (type) {
+  case 'v': return 1;           /* whole device (least important) */
+  case 'p': return 2;
+  case 'l': return 3;
+  case 'd': return 4;
+  case 'f': return 5;           /* file (most important) */
+  default: return 6;
+  }
+}
+
+/* Object names are stored compressed in the ranges index, so they
+ * are only rebuilt when printed.  Returns NULL if out of memory.
+ */
+static char *
+object_name (uint32_t object)
+{
+  size_t len;
+  char *name;
+
+  if (shared)
+    len = shared_index_object_name (shared, object, NULL, 0);
+  else
+    len = ranges_object_name (ranges, object, NULL, 0);
+  name = malloc (len + 1);
+  if (name == NULL)
+    return NULL;
+  if (shared)
+    shared_index_object_name (shared, object, name, len + 1);
+  else
+    ranges_object_name (ranges, object, name, len + 1);
+  return name;
+}
+
+/* Append 'value' to a list of config values. */
+static int
+append_value (const char ***list, size_t *nr, const char *value)
+{
+  const char **p;
+
+  p = realloc (*list, (*nr + 1) * sizeof (const char *));
+  if (p == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  *list = p;
+  (*list)[(*nr)++] = value;
+  return 0;
+}
 
 static int
 logger_config (const char *key, const char *value)
@@ -66,6 +169,71 @@ logger_config (const char *key, const char *value)
     if (logfile == NULL)
       return -1;
   }
+  else if (strcmp (key, "extents") == 0) {
+    if (sscanf (value, "%d", &show_extents) != 1) {
+      nbdkit_error ("could not parse extents parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "flush") == 0) {
+    double secs;
+
+    if (sscanf (value, "%lg", &secs) != 1 || secs < 0 || secs > 3600) {
+      nbdkit_error ("could not parse flush parameter: %s", value);
+      return -1;
+    }
+    flush_ns = secs * 1000000000;
+  }
+  else if (strcmp (key, "log") == 0) {
+    if (sscanf (value, "%d", &log_accesses) != 1) {
+      nbdkit_error ("could not parse log parameter: %s", value);
+      return -1;
+    }
+  }
+  else if (strcmp (key, "index") == 0) {
+    free (index_file);
+    index_file = nbdkit_absolute_path (value);
+    if (index_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "types") == 0) {
+    types = value;
+  }
+  else if (strcmp (key, "device") == 0) {
+    if (append_value (&devices, &nr_devices, value) == -1)
+      return -1;
+  }
+  else if (strcmp (key, "path") == 0) {
+    if (append_value (&paths, &nr_paths, value) == -1)
+      return -1;
+  }
+  else if (strcmp (key, "heatmap") == 0) {
+    free (heatmap_file);
+    heatmap_file = nbdkit_absolute_path (value);
+    if (heatmap_file == NULL)
+      return -1;
+  }
+  else if (strcmp (key, "heatmap_block") == 0) {
+    unsigned long size;
+
+    if (sscanf (value, "%lu", &size) != 1 ||
+        size < 512 || size > 1073741824 || (size & (size - 1)) != 0) {
+      nbdkit_error ("heatmap_block must be a power of 2 between 512 and 1G: %s",
+                    value);
+      return -1;
+    }
+    for (heatmap_shift = 0; (1UL << heatmap_shift) < size; ++heatmap_shift)
+      ;
+  }
+  else if (strcmp (key, "heatmap_interval") == 0) {
+    double secs;
+
+    if (sscanf (value, "%lg", &secs) != 1 || secs < 0 || secs > 86400) {
+      nbdkit_error ("could not parse heatmap_interval parameter: %s", value);
+      return -1;
+    }
+    heatmap_interval_ns = secs * 1000000000;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -74,63 +242,259 @@ logger_config (const char *key, const char *value)
   return 0;
 }
 
+/* Load disk 1 from the block map, which may be text or binary. */
 static int
-logger_config_complete (void)
+load_bmap (const char *bmap_file)
 {
-  FILE *fp;
-  const char *bmap_file = bmap ? bmap : "bmap";
-  CLEANUP_FREE char *line = NULL;
-  size_t alloc;
-  ssize_t len;
-  size_t count;
+  size_t line;
+  char msg[PATH_MAX + 64];
 
-  if (!file) {
-    nbdkit_error ("missing 'file=...' parameter, see virt-bmap(1)");
+  ranges = ranges_load (bmap_file, 1, &line);
+  if (ranges == NULL) {
+    ranges_load_error (bmap_file, 1, line, msg, sizeof msg);
+    nbdkit_error ("%s", msg);
     return -1;
   }
 
-  ranges = new_ranges ();
+  return 0;
+}
+
+/* Attach to the shared index (see index= and shared.cpp), writing it
+ * from the block map first if it is missing or was written from any
+ * other block map (or another version of this one, see shared_source).
+ * Several loggers starting at once may all write it, but each
+ * replaces it atomically with the same contents.
+ */
+static int
+attach_index (const char *bmap_file)
+{
+  struct stat bmap_stat;
+  struct shared_source source;
+  int have_bmap;
+
+  memset (&source, 0, sizeof source);
+  have_bmap = stat (bmap_file, &bmap_stat) == 0;
+  if (have_bmap) {
+    source.dev = bmap_stat.st_dev;
+    source.ino = bmap_stat.st_ino;
+    source.size = bmap_stat.st_size;
+    source.mtime_sec = bmap_stat.st_mtim.tv_sec;
+    source.mtime_nsec = bmap_stat.st_mtim.tv_nsec;
+    source.disk = 1;
+  }
+
+  /* Without the block map, use whatever index there is. */
+  shared = shared_index_open (index_file);
+  if (shared) {
+    if (!have_bmap || shared_index_is_from (shared, &source))
+      return 0;
+    nbdkit_debug ("%s: not written from %s as it is now, rewriting it",
+                  index_file, bmap_file);
+    shared_index_close (shared);
+    shared = NULL;
+  }
+  else if (errno == EINVAL)
+    nbdkit_debug ("%s: not a shared index of this version, rewriting it",
+                  index_file);
+  else if (errno != ENOENT) {
+    nbdkit_error ("%s: %m", index_file);
+    return -1;
+  }
+
+  if (load_bmap (bmap_file) == -1)
+    return -1;
+  if (shared_index_write (ranges, priority_of_type, &source, index_file) == -1) {
+    nbdkit_error ("%s: %m", index_file);
+    return -1;
+  }
+  free_ranges (ranges);
+  ranges = NULL;
 
-  /* Load ranges from bmap file. */
-  fp = fopen (bmap_file, "r");
-  if (fp == NULL) {
-    nbdkit_error ("open: %s: %m", bmap_file);
+  shared = shared_index_open (index_file);
+  if (shared == NULL) {
+    nbdkit_error ("%s: %m", index_file);
     return -1;
   }
+  return 0;
+}
+
+/* Returns true if the object called 'name' passes the filters.
+ * Object names are "<type> <device>" or "<type> <device> <path>",
+ * see virt-bmap(1).
+ */
+static int
+filter_object (const char *name)
+{
+  const char *device, *path;
+  size_t len, i;
+
+  if (types && (name[0] == '\0' || strchr (types, name[0]) == NULL))
+    return 0;
+
+  device = name[0] != '\0' && name[1] == ' ' ? name + 2 : "";
+  len = strcspn (device, " ");
+  path = device[len] == ' ' ? device + len + 1 : NULL;
+
+  if (nr_devices > 0) {
+    for (i = 0; i < nr_devices; ++i)
+      if (strlen (devices[i]) <= len &&
+          strncmp (device, devices[i], strlen (devices[i])) == 0)
+        break;
+    if (i == nr_devices)
+      return 0;
+  }
 
-  count = 0;
-  while (errno = 0, (len = getline (&line, &alloc, fp)) != -1) {
-    uint64_t start, end;
-    int object_offset;
-    const char *object;
+  if (nr_paths > 0) {
+    if (path == NULL)
+      return 0;
+    for (i = 0; i < nr_paths; ++i)
+      if (fnmatch (paths[i], path, 0) == 0)
+        break;
+    if (i == nr_paths)
+      return 0;
+  }
 
-    if (len > 0 && line[len-1] == '\n')
-      line[--len] = '\0';
+  return 1;
+}
 
-    if (sscanf (line, "1 %" SCNx64 " %" SCNx64 " %n",
-                &start, &end, &object_offset) >= 2) {
-      count++;
-      object = line + object_offset;
-      insert_range (ranges, start, end, object);
-    }
+#define BIT_IS_SET(bits, i) ((bits)[(i) >> 3] & (1 << ((i) & 7)))
+#define SET_BIT(bits, i) ((bits)[(i) >> 3] |= 1 << ((i) & 7))
+
+struct filter_data {
+  uint8_t *seen;
+  int err;
+};
+
+/* Callback from iter_range_id (or called for each object of the
+ * shared index), filtering each object once.
+ */
+static void
+filter_callback (uint64_t start, uint64_t end, uint32_t object, void *opaque)
+{
+  struct filter_data *data = opaque;
+  char *name;
+
+  if (data->err || BIT_IS_SET (data->seen, object))
+    return;
+  SET_BIT (data->seen, object);
+
+  name = object_name (object);
+  if (name == NULL) {
+    data->err = errno;
+    return;
   }
+  if (filter_object (name))
+    SET_BIT (logged, object);
+  free (name);
+}
 
-  if (errno) {
-    nbdkit_error ("getline: %s: %m", bmap_file);
-    fclose (fp);
+/* Filters are matched against object names, which are slow to
+ * rebuild, so match each object once here and look the result up
+ * in the 'logged' bitset for each access.
+ */
+static int
+build_filter (void)
+{
+  struct ranges_stats stats;
+  struct filter_data data;
+  uint32_t nr_nodes, id;
+  size_t size;
+
+  if (!types && nr_devices == 0 && nr_paths == 0)
+    return 0;
+
+  if (shared)
+    nr_nodes = shared_index_nr_nodes (shared);
+  else {
+    ranges_stats (ranges, &stats);
+    nr_nodes = stats.nr_name_nodes;
+  }
+  size = (nr_nodes + 7) / 8;
+  logged = calloc (size, 1);
+  data.seen = calloc (size, 1);
+  data.err = 0;
+  if (logged == NULL || data.seen == NULL) {
+    nbdkit_error ("calloc: %m");
+    free (data.seen);
     return -1;
   }
 
-  if (count == 0) {
-    nbdkit_error ("no ranges were read from block map file: %s", bmap_file);
+  if (shared) {
+    for (id = 1; id < nr_nodes; ++id)
+      if (shared_index_is_object (shared, id))
+        filter_callback (0, 0, id, &data);
+  }
+  else
+    iter_range_id (ranges, filter_callback, &data);
+  free (data.seen);
+  if (data.err) {
+    errno = data.err;
+    nbdkit_error ("malloc: %m");
     return -1;
   }
 
-  if (fclose (fp) == -1) {
-    nbdkit_error ("fclose: %s: %m", bmap_file);
+  return 0;
+}
+
+static int
+logger_config_complete (void)
+{
+  const char *bmap_file = bmap ? bmap : "bmap";
+  struct sigaction sa;
+  struct stat statbuf;
+
+  if (!file) {
+    nbdkit_error ("missing 'file=...' parameter, see virt-bmap(1)");
     return -1;
   }
 
+  if (heatmap_file) {
+    if (stat (file, &statbuf) == -1) {
+      nbdkit_error ("stat: %s: %m", file);
+      return -1;
+    }
+    heatmap = heatmap_new (statbuf.st_size, heatmap_shift);
+    if (heatmap == NULL) {
+      nbdkit_error ("heatmap_new: %m");
+      return -1;
+    }
+  }
+
+  /* With log=0 only the heatmap is kept, which does not need the
+   * block map.
+   */
+  if (!log_accesses)
+    return 0;
+
+  if (index_file) {
+    if (attach_index (bmap_file) == -1)
+      return -1;
+  }
+  else {
+    /* Load ranges from bmap file. */
+    if (load_bmap (bmap_file) == -1)
+      return -1;
+
+    /* The block table finds the object to log for each access
+     * directly by block number.  It is used when the best object only
+     * changes on 1K boundaries.  Otherwise (eg. a partition starting
+     * at sector 63, or 512 byte extents from mode=extents) every
+     * overlapping object is looked at for each access instead.
+     */
+    blocks = new_block_table (ranges, priority_of_type);
+    if (blocks == NULL) {
+      if (errno != EINVAL) {
+        nbdkit_error ("new_block_table: %m");
+        return -1;
+      }
+      nbdkit_debug ("%s: not block aligned, not using a block table",
+                    bmap_file);
+    }
+  }
+
+  if (build_filter () == -1)
+    return -1;
+
   /* Set up log file. */
   if (logfile) {
     logfp = fopen (logfile, "w");
@@ -140,16 +504,49 @@ logger_config_complete (void)
     }
   }
 
+  sa.sa_handler = usr1_handler;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction (SIGUSR1, &sa, NULL) == -1) {
+    nbdkit_error ("sigaction: %m");
+    return -1;
+  }
+
   return 0;
 }
 
 static void
 logger_unload (void)
 {
+  /* The timer thread prints to the log, so stop it first. */
+  if (timer_started) {
+    pthread_mutex_lock (&log_lock);
+    timer_stop = 1;
+    pthread_cond_signal (&timer_cond);
+    pthread_mutex_unlock (&log_lock);
+    pthread_join (timer, NULL);
+  }
+
   if (logfp)
     fclose (logfp);
 
-  free_ranges (ranges);
+  if (heatmap) {
+    if (heatmap_write (heatmap, heatmap_file) == -1)
+      nbdkit_error ("%s: %m", heatmap_file);
+    heatmap_free (heatmap);
+  }
+
+  if (blocks)
+    free_block_table (blocks);
+  if (ranges)
+    free_ranges (ranges);
+  if (shared)
+    shared_index_close (shared);
+  free (index_file);
+  free (logged);
+  free (paths);
+  free (devices);
+  free (heatmap_file);
   free (logfile);
   free (bmap);
   free (file);
@@ -158,7 +555,17 @@ logger_unload (void)
 #define logger_config_help                                        \
   "file=<DISK>         Input disk filename\n"                     \
   "logfile=<OUTPUT>    Log file (default: stdout)\n"              \
-  "bmap=<BMAP>         Block map (default: \"bmap\")"             \
+  "bmap=<BMAP>         Block map (default: \"bmap\")\n"           \
+  "extents=1           Log all extents of each object accessed\n" \
+  "flush=<SECS>        Print accesses at least this often (default: 1)\n" \
+  "index=<FILE>        Shared index, written from the block map if needed\n" \
+  "log=0               Do not log accesses, only keep the heatmap\n" \
+  "heatmap=<FILE>      Count accesses to each block and save them here\n" \
+  "heatmap_block=<BYTES> Heatmap block size (default: 65536)\n" \
+  "heatmap_interval=<SECS> Save the heatmap this often (default: 60)\n" \
+  "types=<TYPES>       Only log objects of these types, eg. \"fd\"\n" \
+  "device=<PREFIX>     Only log objects on devices starting with this\n" \
+  "path=<GLOB>         Only log files and directories matching this" \
 
 /* See log_operation below. */
 struct operation {
@@ -166,26 +573,129 @@ struct operation {
   uint32_t count;
   uint64_t offset;
   int priority;
-  uint64_t start;
-  uint64_t end;
-  const char *object;
+  uint32_t object;              /* object ID, see ranges.h */
+};
+
+/* Contiguous and overlapping accesses to the same object are merged
+ * into a run, which is printed when the next access does not continue
+ * it, or when it is older than flush= (see timer_thread).
+ */
+struct run {
+  int pending;
+  uint64_t start, end;
+  uint64_t time;                /* when the run was started */
 };
 
 /* The per-connection handle. */
 struct handle {
+  struct handle *next;          /* in 'handles' */
   int fd;
 
   /* See log_operation below. */
   struct operation last;
   struct operation current;
+  struct run run;
 };
 
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Print the pending run of 'h', if any.  Returns true if anything
+ * was printed.
+ */
+static int
+print_run (struct handle *h, FILE *fp)
+{
+  if (!h->run.pending)
+    return 0;
+
+  /* It would be nice to print an offset relative to the current
+   * object here, but that's not possible since we don't have the
+   * information about precisely what file offsets map to what
+   * blocks.
+   */
+  fprintf (fp, " %" PRIx64 "-%" PRIx64, h->run.start, h->run.end);
+  h->run.pending = 0;
+  return 1;
+}
+
+/* Print runs which have been pending for longer than flush=, so the
+ * log keeps up with a guest which has stopped doing I/O, and save the
+ * heatmap every heatmap_interval=.
+ */
+static void *
+timer_thread (void *unused)
+{
+  FILE *fp = logfp ? logfp : stdout;
+  const int flushing = log_accesses && flush_ns > 0;
+  const int snapshots = heatmap && heatmap_interval_ns > 0;
+  struct timespec ts;
+  struct handle *h;
+  uint64_t now, wait_ns, next_snapshot;
+  int printed;
+
+  next_snapshot = now_ns () + heatmap_interval_ns;
+
+  pthread_mutex_lock (&log_lock);
+  while (!timer_stop) {
+    now = now_ns ();
+    wait_ns = flushing ? flush_ns : UINT64_MAX;
+    if (snapshots) {
+      if (next_snapshot <= now)
+        wait_ns = 0;
+      else if (next_snapshot - now < wait_ns)
+        wait_ns = next_snapshot - now;
+    }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait_ns / 1000000000;
+    ts.tv_nsec += wait_ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait (&timer_cond, &log_lock, &ts);
+    if (timer_stop)
+      break;
+
+    now = now_ns ();
+    if (flushing) {
+      printed = 0;
+      for (h = handles; h != NULL; h = h->next)
+        if (h->run.pending && now - h->run.time >= flush_ns)
+          printed |= print_run (h, fp);
+      if (printed)
+        fflush (fp);
+    }
+
+    /* The counters are updated without the lock, so don't hold up
+     * the log while the heatmap is written.
+     */
+    if (snapshots && now >= next_snapshot) {
+      pthread_mutex_unlock (&log_lock);
+      if (heatmap_write (heatmap, heatmap_file) == -1)
+        nbdkit_error ("%s: %m", heatmap_file);
+      pthread_mutex_lock (&log_lock);
+      next_snapshot = now + heatmap_interval_ns;
+    }
+  }
+  pthread_mutex_unlock (&log_lock);
+
+  return NULL;
+}
+
 /* Create the per-connection handle. */
 static void *
 logger_open (int readonly)
 {
   struct handle *h;
-  int flags;
+  int flags, err;
 
   h = malloc (sizeof *h);
   if (h == NULL) {
@@ -195,6 +705,7 @@ logger_open (int readonly)
 
   memset (&h->last, 0, sizeof h->last);
   memset (&h->current, 0, sizeof h->current);
+  memset (&h->run, 0, sizeof h->run);
 
   flags = O_CLOEXEC|O_NOCTTY;
   if (readonly)
@@ -209,6 +720,27 @@ logger_open (int readonly)
     return NULL;
   }
 
+  /* The timer thread is started here rather than when the plugin is
+   * loaded, because nbdkit may fork into the background after that.
+   */
+  pthread_mutex_lock (&log_lock);
+  if (!timer_started &&
+      ((log_accesses && flush_ns > 0) ||
+       (heatmap && heatmap_interval_ns > 0))) {
+    err = pthread_create (&timer, NULL, timer_thread, NULL);
+    if (err != 0) {
+      pthread_mutex_unlock (&log_lock);
+      nbdkit_error ("pthread_create: %s", strerror (err));
+      close (h->fd);
+      free (h);
+      return NULL;
+    }
+    timer_started = 1;
+  }
+  h->next = handles;
+  handles = h;
+  pthread_mutex_unlock (&log_lock);
+
   return h;
 }
 
@@ -217,6 +749,19 @@ static void
 logger_close (void *handle)
 {
   struct handle *h = handle;
+  struct handle **hp;
+  FILE *fp = logfp ? logfp : stdout;
+
+  pthread_mutex_lock (&log_lock);
+  if (print_run (h, fp))
+    fflush (fp);
+  for (hp = &handles; *hp != NULL; hp = &(*hp)->next) {
+    if (*hp == h) {
+      *hp = h->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&log_lock);
 
   close (h->fd);
   free (h);
@@ -240,31 +785,38 @@ logger_get_size (void *handle)
 }
 
 static int
-priority_of_object (const char *object)
+priority_of_object (uint32_t object)
 {
-  switch (object[0]) {
-  case 'v': return 1;           /* whole device (least important) */
-  case 'p': return 2;
-  case 'l': return 3;
-  case 'd': return 4;
-  case 'f': return 5;           /* file (most important) */
-  default: return 6;
-  }
+  return priority_of_type (ranges_object_type (ranges, object));
+}
+
+/* Callback from find_object, printing one extent of the object. */
+static void
+extent_callback (uint64_t start, uint64_t end, const char *object, void *opaque)
+{
+  FILE *fp = opaque;
+
+  fprintf (fp, " %" PRIx64 "-%" PRIx64, start, end);
 }
 
-/* Callback from find_range.  Save the highest priority object into
+/* Callback from shared_index_extents, printing one extent. */
+static void
+shared_extent_callback (uint64_t start, uint64_t end, void *opaque)
+{
+  extent_callback (start, end, NULL, opaque);
+}
+
+/* Callback from find_range_id.  Save the highest priority object into
  * the handle for later printing.
  */
 static void
-log_callback (uint64_t start, uint64_t end, const char *object, void *opaque)
+log_callback (uint64_t start, uint64_t end, uint32_t object, void *opaque)
 {
   struct handle *h = opaque;
   int priority = priority_of_object (object);
 
   if (priority > h->current.priority) {
     h->current.priority = priority;
-    h->current.start = start;
-    h->current.end = end;
     h->current.object = object;
   }
 }
@@ -272,6 +824,15 @@ log_callback (uint64_t start, uint64_t end, const char *object, void *opaque)
 static void
 log_operation (struct handle *h, uint64_t offset, uint32_t count, int is_read)
 {
+  FILE *fp = logfp ? logfp : stdout;
+  uint64_t now;
+  int printed = 0;
+
+  if (heatmap)
+    heatmap_add (heatmap, offset, count, is_read);
+  if (!log_accesses)
+    return;
+
   /* Because Boost interval_map is really bloody slow, implement a
    * shortcut here.  We can remove this once Boost performance
    * problems have been fixed.
@@ -285,32 +846,87 @@ log_operation (struct handle *h, uint64_t offset, uint32_t count, int is_read)
   h->current.count = count;
   h->current.offset = offset;
   h->current.priority = 0;
-  find_range (ranges, offset, offset+count, log_callback, h);
+  if (shared)
+    h->current.object = shared_index_find (shared, offset, offset+count,
+                                           &h->current.priority);
+  else if (blocks) {
+    h->current.object = block_table_find (blocks, offset, offset+count);
+    if (h->current.object != 0)
+      h->current.priority = priority_of_object (h->current.object);
+  }
+  else
+    find_range_id (ranges, offset, offset+count, log_callback, h);
+  if (logged && h->current.priority > 0 &&
+      !BIT_IS_SET (logged, h->current.object))
+    h->current.priority = 0;
  skip_find_range:
 
-  if (h->current.priority > 0) {
-    FILE *fp = logfp ? logfp : stdout;
+  if (!print_stats && h->current.priority == 0)
+    return;
+
+  now = now_ns ();
+  pthread_mutex_lock (&log_lock);
+
+  if (print_stats) {
+    print_stats = 0;
+    print_run (h, fp);
+    fprintf (fp, "\n\nblock map statistics:\n");
+    if (shared)
+      shared_index_print_stats (shared, fp);
+    else
+      ranges_print_stats (ranges, fp);
+    if (blocks)
+      fprintf (fp, "block table:      %zu bytes\n", block_table_bytes (blocks));
+    h->last.object = 0;         /* print the object name again */
+    printed = 1;
+  }
 
+  if (h->current.priority > 0) {
     if (h->current.priority != h->last.priority ||
         h->current.is_read != h->last.is_read ||
-        h->last.object == NULL ||
-        strcmp (h->current.object, h->last.object) != 0) {
+        h->current.object != h->last.object) {
+      CLEANUP_FREE char *object = object_name (h->current.object);
+
+      print_run (h, fp);
       fprintf (fp,
                "\n"
                "%s %s\n",
-               is_read ? "read" : "write", h->current.object);
+               is_read ? "read" : "write", object ? object : "?");
+      if (show_extents && object) {
+        fprintf (fp, "extents:");
+        if (shared)
+          shared_index_extents (shared, h->current.object,
+                                shared_extent_callback, fp);
+        else
+          find_object (ranges, object, extent_callback, fp);
+        fprintf (fp, "\naccessed:");
+      }
 
       h->last = h->current;
+      printed = 1;
     }
 
-    /* It would be nice to print an offset relative to the current
-     * object here, but that's not possible since we don't have the
-     * information about precisely what file offsets map to what
-     * blocks.
-     */
-    fprintf (fp, " %" PRIx64 "-%" PRIx64, offset, offset+count);
-    fflush (fp);
+    if (h->run.pending &&
+        offset <= h->run.end && offset + count >= h->run.start) {
+      if (offset < h->run.start)
+        h->run.start = offset;
+      if (offset + count > h->run.end)
+        h->run.end = offset + count;
+    }
+    else {
+      printed |= print_run (h, fp);
+      h->run.pending = 1;
+      h->run.start = offset;
+      h->run.end = offset + count;
+      h->run.time = now;
+    }
+    if (now - h->run.time >= flush_ns)
+      printed |= print_run (h, fp);
   }
+
+  if (printed)
+    fflush (fp);
+  pthread_mutex_unlock (&log_lock);
 }
 
 /* Read data from the file. */
@@ -0,0 +1,364 @@
+/* virt-bmap output writer
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Block maps can be hundreds of megabytes, so instead of one fprintf
+ * per line we format lines by hand into a large buffer and write it
+ * out in big chunks.  When compressing, the compression is done by a
+ * helper thread while the next buffer is being filled.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "output.h"
+
+#define BUFFER_SIZE (1024*1024)
+
+/* Longest line prefix: disk index, two 64 bit hex numbers, spaces. */
+#define MAX_PREFIX (10 + 1 + 16 + 1 + 16 + 1)
+
+struct output {
+  int fd;
+  enum output_compress compress;
+  int error;                    /* errno of first error, or 0 */
+
+  char *buf[2];                 /* buf[cur] is being filled */
+  int cur;
+  size_t len;
+
+  /* The compression thread takes 'pending' and sets it back to NULL
+   * when it is done with it.  NB: acquire 'lock' before accessing.
+   */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const char *pending;
+  size_t pending_len;
+  int finish;
+#ifdef HAVE_ZLIB
+  z_stream zs;
+  unsigned char *zbuf;
+#endif
+};
+
+static void
+set_error (struct output *o, int err)
+{
+  if (o->error == 0)
+    o->error = err;
+}
+
+static int
+full_write (int fd, const char *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, buf, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Compress 'len' bytes of 'buf' (flushing the stream if 'finish') and
+ * write out the compressed data.  Called from the compression thread.
+ */
+static int
+deflate_buffer (struct output *o, const char *buf, size_t len, int finish)
+{
+  int r;
+
+  o->zs.next_in = (unsigned char *) buf;
+  o->zs.avail_in = len;
+
+  do {
+    o->zs.next_out = o->zbuf;
+    o->zs.avail_out = BUFFER_SIZE;
+    r = deflate (&o->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (r == Z_STREAM_ERROR) {
+      errno = EIO;
+      return -1;
+    }
+    if (full_write (o->fd, (char *) o->zbuf,
+                    BUFFER_SIZE - o->zs.avail_out) == -1)
+      return -1;
+  } while (o->zs.avail_out == 0);
+
+  return 0;
+}
+
+static void *
+compress_thread (void *ov)
+{
+  struct output *o = ov;
+  const char *buf;
+  size_t len;
+  int finish, err = 0;
+
+  for (;;) {
+    pthread_mutex_lock (&o->lock);
+    while (o->pending == NULL && !o->finish)
+      pthread_cond_wait (&o->cond, &o->lock);
+    buf = o->pending;
+    len = buf ? o->pending_len : 0;
+    finish = buf == NULL && o->finish;
+    pthread_mutex_unlock (&o->lock);
+
+    if (err == 0 && deflate_buffer (o, buf, len, finish) == -1)
+      err = errno;
+
+    pthread_mutex_lock (&o->lock);
+    if (err)
+      set_error (o, err);
+    o->pending = NULL;
+    pthread_cond_broadcast (&o->cond);
+    pthread_mutex_unlock (&o->lock);
+
+    if (finish)
+      return NULL;
+  }
+}
+#endif /* HAVE_ZLIB */
+
+/* Write out the current buffer and start filling the other one. */
+static void
+flush_buffer (struct output *o)
+{
+  if (o->len == 0)
+    return;
+
+  if (o->compress == OUTPUT_COMPRESS_NONE) {
+    if (o->error == 0 && full_write (o->fd, o->buf[o->cur], o->len) == -1)
+      set_error (o, errno);
+    o->len = 0;
+    return;
+  }
+
+  /* Wait for the compression thread to finish the other buffer. */
+  pthread_mutex_lock (&o->lock);
+  while (o->pending != NULL)
+    pthread_cond_wait (&o->cond, &o->lock);
+  o->pending = o->buf[o->cur];
+  o->pending_len = o->len;
+  pthread_cond_broadcast (&o->cond);
+  pthread_mutex_unlock (&o->lock);
+
+  o->cur = 1 - o->cur;
+  o->len = 0;
+}
+
+struct output *
+output_open (const char *filename, enum output_compress compress)
+{
+  struct output *o;
+  int err;
+
+#ifndef HAVE_ZLIB
+  if (compress == OUTPUT_COMPRESS_GZIP) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+#endif
+
+  o = calloc (1, sizeof *o);
+  if (o == NULL)
+    return NULL;
+  o->compress = compress;
+  o->buf[0] = malloc (BUFFER_SIZE);
+  o->buf[1] = malloc (BUFFER_SIZE);
+  if (o->buf[0] == NULL || o->buf[1] == NULL)
+    goto error;
+
+  o->fd = open (filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+  if (o->fd == -1)
+    goto error;
+
+#ifdef HAVE_ZLIB
+  if (compress == OUTPUT_COMPRESS_GZIP) {
+    o->zbuf = malloc (BUFFER_SIZE);
+    if (o->zbuf == NULL)
+      goto error_close;
+    /* Fast compression, since we are compressing on the fly.
+     * windowBits + 16 selects the gzip format.
+     */
+    if (deflateInit2 (&o->zs, 1, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) != Z_OK) {
+      errno = ENOMEM;
+      goto error_close;
+    }
+    pthread_mutex_init (&o->lock, NULL);
+    pthread_cond_init (&o->cond, NULL);
+    err = pthread_create (&o->thread, NULL, compress_thread, o);
+    if (err != 0) {
+      deflateEnd (&o->zs);
+      errno = err;
+      goto error_close;
+    }
+  }
+#endif
+
+  return o;
+
+#ifdef HAVE_ZLIB
+ error_close:
+  err = errno;
+  close (o->fd);
+  free (o->zbuf);
+  errno = err;
+#endif
+ error:
+  err = errno;
+  free (o->buf[0]);
+  free (o->buf[1]);
+  free (o);
+  errno = err;
+  return NULL;
+}
+
+void
+output_write (struct output *o, const char *buf, size_t len)
+{
+  size_t n;
+
+  while (len > 0) {
+    if (o->len == BUFFER_SIZE)
+      flush_buffer (o);
+    n = BUFFER_SIZE - o->len;
+    if (n > len)
+      n = len;
+    memcpy (o->buf[o->cur] + o->len, buf, n);
+    o->len += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Format 'v' in lowercase hex (no leading zeroes) at 'p', returning
+ * the end of the number.
+ */
+static inline char *
+format_hex (char *p, uint64_t v)
+{
+  static const char digits[] = "0123456789abcdef";
+  int n = (64 - __builtin_clzll (v | 1) + 3) / 4;
+  char *end = p + n;
+
+  do {
+    *--end = digits[v & 15];
+    v >>= 4;
+  } while (end > p);
+
+  return p + n;
+}
+
+void
+output_range (struct output *o, int disk, uint64_t start, uint64_t end,
+              const char *object)
+{
+  size_t objlen = strlen (object);
+  char *p;
+
+  if (BUFFER_SIZE - o->len < MAX_PREFIX + objlen + 1) {
+    flush_buffer (o);
+
+    /* Silly long object name, don't bother with the fast path. */
+    if (MAX_PREFIX + objlen + 1 > BUFFER_SIZE) {
+      char prefix[MAX_PREFIX + 1];
+
+      snprintf (prefix, sizeof prefix, "%d %" PRIx64 " %" PRIx64 " ",
+                disk, start, end);
+      output_write (o, prefix, strlen (prefix));
+      output_write (o, object, objlen);
+      output_write (o, "\n", 1);
+      return;
+    }
+  }
+
+  p = o->buf[o->cur] + o->len;
+  if (disk >= 0 && disk <= 9)
+    *p++ = '0' + disk;
+  else
+    p += sprintf (p, "%d", disk);
+  *p++ = ' ';
+  p = format_hex (p, start);
+  *p++ = ' ';
+  p = format_hex (p, end);
+  *p++ = ' ';
+  memcpy (p, object, objlen);
+  p += objlen;
+  *p++ = '\n';
+  o->len = p - o->buf[o->cur];
+}
+
+int
+output_close (struct output *o)
+{
+  int err;
+
+  flush_buffer (o);
+
+#ifdef HAVE_ZLIB
+  if (o->compress == OUTPUT_COMPRESS_GZIP) {
+    pthread_mutex_lock (&o->lock);
+    o->finish = 1;
+    pthread_cond_broadcast (&o->cond);
+    pthread_mutex_unlock (&o->lock);
+    pthread_join (o->thread, NULL);
+    deflateEnd (&o->zs);
+    pthread_mutex_destroy (&o->lock);
+    pthread_cond_destroy (&o->cond);
+    free (o->zbuf);
+  }
+#endif
+
+  if (close (o->fd) == -1)
+    set_error (o, errno);
+
+  err = o->error;
+  free (o->buf[0]);
+  free (o->buf[1]);
+  free (o);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
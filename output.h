@@ -0,0 +1,48 @@
+/* virt-bmap output writer
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum output_compress {
+  OUTPUT_COMPRESS_NONE = 0,
+  OUTPUT_COMPRESS_GZIP,
+};
+
+struct output;
+
+/* Open 'filename' for writing.  On error returns NULL with errno set. */
+extern struct output *output_open (const char *filename, enum output_compress compress);
+
+/* Append one block map line ("disk start end object\n").  Errors are
+ * remembered and reported by output_close.
+ */
+extern void output_range (struct output *o, int disk, uint64_t start, uint64_t end, const char *object);
+
+/* Append arbitrary bytes. */
+extern void output_write (struct output *o, const char *buf, size_t len);
+
+/* Flush everything and close the file.  Returns -1 with errno set if
+ * anything failed since output_open.
+ */
+extern int output_close (struct output *o);
+
+#endif /* OUTPUT_H */
@@ -1,11 +1,10 @@
-all:ranges
+all:ranges ranges-check bmapgen
 CPPFLAGS+=-std=c++0x -Wall -pedantic
 CPPFLAGS+=-g -O3
 CPPFLAGS+=-isystem ~/custom/boost/
 
 # CPPFLAGS+=-fopenmp
 CPPFLAGS+=-march=native
-LDFLAGS+=-ltcmalloc
 
 # CXX=/usr/lib/gcc-snapshot/bin/g++
 # CC=/usr/lib/gcc-snapshot/bin/gcc
@@ -15,8 +14,35 @@ LDFLAGS+=-ltcmalloc
 %:%.o
 	$(CXX) $(CPPFLAGS) $^ -o $@ $(LDFLAGS)
 
-ranges.cpp: ranges.h
+ranges: ranges.o ranges-bench.o
 
-ranges.o: ranges.cpp
-	$(CXX) $(CPPFLAGS) $^ -o $@ -c
+ranges.o: ranges.cpp ranges.h ranges.hpp
+	$(CXX) $(CPPFLAGS) $< -o $@ -c
+
+ranges-bench.o: ranges-bench.cpp ranges.h ranges.hpp
+	$(CXX) $(CPPFLAGS) $< -o $@ -c
+
+# Check that every ranges engine gives the same results as the
+# reference, and compare their speed.
+ranges-check: ranges.o shared.o ranges-check.o
+
+ranges-check.o: ranges-check.cpp ranges.h ranges.hpp shared.h
+	$(CXX) $(CPPFLAGS) $< -o $@ -c
+
+shared.o: shared.cpp ranges.h ranges.hpp shared.h
+	$(CXX) $(CPPFLAGS) $< -o $@ -c
+
+# Generate synthetic block maps of any size, see bmapgen.cpp.
+bmapgen: ranges.o bmapgen.o
+
+bmapgen.o: bmapgen.cpp ranges.h
+	$(CXX) $(CPPFLAGS) $< -o $@ -c
+
+check: ranges-check bmapgen
+	./ranges-check bmap.txt
+	./bmapgen -x 4 -l 3 -o bmapgen.txt
+	./ranges-check bmapgen.txt
+	rm -f bmapgen.txt
+
+.PHONY: all check
 
@@ -0,0 +1,338 @@
+#define BOOST_RESULT_OF_USE_DECTYPE
+#define BOOST_SPIRIT_USE_PHOENIX_V3
+
+/* virt-bmap ranges benchmark
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Loads bmap.txt into the ranges index and times lookups.  Built by
+ * q27152834.mak, not part of the plugins.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <iterator>
+#include <boost/accumulators/accumulators.hpp>
+#include <boost/accumulators/statistics.hpp>
+
+#include "ranges.h"
+#include "ranges.hpp"
+
+std::map<char, size_t> histo;
+
+struct segment {
+    uint64_t start, end;
+    std::vector<uint32_t> objects;
+};
+
+std::string object_name(void* bmap_data, uint32_t id) {
+    std::string name(ranges_object_name(bmap_data, id, NULL, 0), '\0');
+    ranges_object_name(bmap_data, id, &name[0], name.size() + 1);
+    return name;
+}
+
+/* The index only exposes objects through callbacks, so collect the
+ * segments for the statistics.
+ */
+std::vector<segment> get_segments(void* bmap_data) {
+    std::vector<segment> segments;
+
+    iter_range_id(bmap_data,
+            [](uint64_t start, uint64_t end, uint32_t object, void *opaque) {
+            auto& segments = *static_cast<std::vector<segment>*>(opaque);
+            if (segments.empty() || segments.back().start != start || segments.back().end != end)
+                segments.push_back(segment { start, end, {} });
+            segments.back().objects.push_back(object);
+            }, &segments);
+
+    return segments;
+}
+
+/* Segments of different layers overlap, so count the union. */
+uint64_t covered_size(std::vector<segment> const& segments) {
+    uint64_t size = 0, covered = 0;
+    for (auto const& s : segments) {
+        if (s.end <= covered)
+            continue;
+        size += s.end - std::max(s.start, covered);
+        covered = s.end;
+    }
+    return size;
+}
+
+std::vector<std::pair<uint64_t, uint64_t> > generate_test_queries(uint64_t size, size_t n) {
+    std::vector<std::pair<uint64_t, uint64_t> > queries;
+    queries.reserve(n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto start = (static_cast<uint64_t>(rand()) * rand()) % size;
+        auto end   = start + rand();
+
+        queries.emplace_back(start,end);
+    }
+
+    return queries;
+}
+
+void* read_mapfile(const char* fname) {
+    std::ifstream ifs(fname, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    auto bmap_data = new bmap::ranges_index();
+
+    auto bad_line = bmap::parse_bmap_text(text.data(), text.data() + text.size(),
+            [&](int disk, uint64_t b, uint64_t e, const char* object, size_t len) {
+            if (disk != 1)
+                return;
+            histo[object[0]]++;
+            bmap_data->insert(b, e, object, len);
+            });
+    if (bad_line)
+    {
+        std::cout << fname << ":" << bad_line << ": invalid block map line\n";
+        exit(255);
+    } else
+    {
+        std::cout << "Parsed ok\n";
+    }
+
+    return bmap_data;
+}
+
+void report_statistics(void* bmap_data, std::vector<segment> const& segments) {
+    size_t total = 0;
+    for (auto e : histo) total += e.second;
+
+    std::cout << "Histogram of " << total << " input lines\n";
+
+    for (auto e : histo)
+        std::cout << e.first << ": " << e.second << "\n";
+
+    namespace ba = boost::accumulators;
+    ba::accumulator_set<double, ba::stats<ba::tag::mean, ba::tag::max, ba::tag::min> > 
+        object_sets, interval_widths;
+
+    for (auto const& r : segments)
+    {
+        auto width = r.end - r.start;
+        assert(width % 1024 == 0);
+
+        interval_widths(width);
+        object_sets(r.objects.size());
+    }
+
+    std::cout << std::fixed;
+    std::cout << "ranges size:            " << covered_size(segments)           << "\n";
+    std::cout << "ranges iterative size:  " << segments.size()                  << "\n";
+
+    std::cout << "Min object set:         " << ba::min(object_sets)             << "\n" ;
+    std::cout << "Max object set:         " << ba::max(object_sets)             << "\n" ;
+    std::cout << "Average object set:     " << ba::mean(object_sets)            << "\n" ;
+    std::cout << "Min interval width:     " << ba::min(interval_widths)         << "\n" ;
+    std::cout << "Max interval width:     " << ba::max(interval_widths)         << "\n" ;
+    std::cout << "Average interval width: " << ba::mean(interval_widths)/1024.0 << "k\n" ;
+    std::cout << "First:                  [" << segments.front().start << "," << segments.front().end << ")\n" ;
+    std::cout << "Last:                   [" << segments.back().start << "," << segments.back().end << ")\n" ;
+
+    std::cout << "Index statistics:\n";
+    std::cout.flush();
+    ranges_print_stats(bmap_data, stdout);
+}
+
+void perform_comparative_benchmarks(void* bmap_data, uint64_t size, size_t number_of_queries) {
+    srand(42);
+    auto const queries = generate_test_queries(size, number_of_queries);
+
+    using hrc = std::chrono::high_resolution_clock;
+    {
+        auto start = hrc::now();
+        size_t callbacks = 0;
+
+        for (auto const& q: queries)
+        {
+            find_range(bmap_data, q.first, q.second, 
+                    [](uint64_t start, uint64_t end, const char *object, void *opaque) {
+                    ++(*static_cast<size_t*>(opaque));
+                    }, &callbacks);
+        }
+        std::cout << number_of_queries << " 'random' OLD lookups resulted in " << callbacks 
+                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+    }
+
+    {
+        auto start = hrc::now();
+        size_t callbacks = 0;
+
+        for (auto const& q: queries)
+        {
+            find_range_ex(bmap_data, q.first, q.second, 
+                    [](uint64_t start, uint64_t end, const char *object, void *opaque) {
+                    ++(*static_cast<size_t*>(opaque));
+                    }, &callbacks);
+        }
+        std::cout << number_of_queries << " 'random' NEW lookups resulted in " << callbacks 
+                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+    }
+
+    {
+        auto start = hrc::now();
+        size_t callbacks = 0;
+
+        for (auto const& q: queries)
+        {
+            find_range_id(bmap_data, q.first, q.second, 
+                    [](uint64_t start, uint64_t end, uint32_t object, void *opaque) {
+                    ++(*static_cast<size_t*>(opaque));
+                    }, &callbacks);
+        }
+        std::cout << number_of_queries << " 'random' ID lookups resulted in " << callbacks 
+                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+    }
+
+    {
+        auto start = hrc::now();
+        size_t callbacks = 0;
+        auto const& index = *static_cast<bmap::ranges_index const*>(bmap_data);
+
+        for (auto const& q: queries)
+        {
+            bmap::for_each_overlap(index, q.first, q.second,
+                    [&](uint64_t start, uint64_t end, bmap::object_id object) {
+                    ++callbacks;
+                    });
+        }
+        std::cout << number_of_queries << " 'random' INLINE lookups resulted in " << callbacks 
+                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+    }
+}
+
+/* Look up every object in the reverse index, and check that its
+ * extents are exactly the segments containing it, merged.
+ */
+void check_reverse_index(void* bmap_data, std::vector<segment> const& segments) {
+    std::map<uint32_t, std::vector<std::pair<uint64_t, uint64_t> > > expected;
+
+    for (auto const& s : segments)
+        for (auto object : s.objects) {
+            auto& v = expected[object];
+            if (!v.empty() && v.back().second == s.start)
+                v.back().second = s.end;
+            else
+                v.emplace_back(s.start, s.end);
+        }
+
+    using hrc = std::chrono::high_resolution_clock;
+    auto start = hrc::now();
+    size_t extents = 0;
+
+    for (auto const& e : expected)
+    {
+        std::vector<std::pair<uint64_t, uint64_t> > got;
+        auto name = object_name(bmap_data, e.first);
+        if (ranges_object_id(bmap_data, name.c_str()) != e.first) {
+            std::cout << "Object ID mismatch for " << name << "\n";
+            exit(1);
+        }
+        extents += find_object(bmap_data, name.c_str(),
+                [](uint64_t start, uint64_t end, const char *object, void *opaque) {
+                static_cast<std::vector<std::pair<uint64_t, uint64_t> >*>(opaque)->emplace_back(start, end);
+                }, &got);
+        if (got != e.second) {
+            std::cout << "Reverse index mismatch for " << name << "\n";
+            exit(1);
+        }
+    }
+    std::cout << expected.size() << " reverse lookups returned " << extents
+              << " extents in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+}
+
+/* Write the index as a binary block map, load it back, and check
+ * nothing changed.
+ */
+void check_binary(void* bmap_data, std::vector<segment> const& segments) {
+    FILE* fp = tmpfile();
+    int disk;
+
+    if (fp == NULL || ranges_write_binary(bmap_data, 1, fp) == -1) {
+        perror("ranges_write_binary");
+        exit(1);
+    }
+    std::cout << "Binary block map:       " << ftell(fp) << " bytes\n";
+    rewind(fp);
+
+    using hrc = std::chrono::high_resolution_clock;
+    auto start = hrc::now();
+    void* loaded = ranges_read_binary(fp, &disk);
+    if (loaded == NULL) {
+        perror("ranges_read_binary");
+        exit(1);
+    }
+    std::cout << "Binary load:            " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+    fclose(fp);
+
+    auto copy = get_segments(loaded);
+    bool same = disk == 1 && copy.size() == segments.size();
+    for (size_t i = 0; same && i < copy.size(); ++i) {
+        same = copy[i].start == segments[i].start && copy[i].end == segments[i].end &&
+            copy[i].objects == segments[i].objects;
+        for (size_t j = 0; same && j < copy[i].objects.size(); ++j)
+            same = object_name(loaded, copy[i].objects[j]) == object_name(bmap_data, segments[i].objects[j]);
+    }
+    if (!same) {
+        std::cout << "Binary block map differs after loading\n";
+        exit(1);
+    }
+    check_reverse_index(loaded, copy);
+    free_ranges(loaded);
+}
+
+int main() {
+    auto bmap = read_mapfile("bmap.txt");
+    auto segments = get_segments(bmap);
+
+    report_statistics(bmap, segments);
+
+    perform_comparative_benchmarks(bmap, covered_size(segments), 1000);
+
+    check_reverse_index(bmap, segments);
+    check_binary(bmap, segments);
+
+#if 0 // to dump ranges to console
+    for (auto const& r : segments)
+    {
+        std::cout << "[" << r.start << "," << r.end << ")\t" << r.objects.size() << "\t";
+        for (auto id : r.objects)
+            std::cout << object_name(bmap, id) << "\t";
+        std::cout << "\n";
+    }
+#endif
+
+    free_ranges(bmap);
+}
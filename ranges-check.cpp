@@ -0,0 +1,836 @@
+/* virt-bmap ranges differential check
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Builds every ranges engine from the same block map, runs the same
+ * random queries against all of them, checks that they all find the
+ * same objects, and times each one.  Built by q27152834.mak.
+ *
+ *   ranges-check [-q queries] [-s seed] [bmap.txt]
+ *
+ * Engines split the disk into segments differently, so results are
+ * compared after clipping each hit to the query window and merging
+ * the overlapping and adjacent hits of each object.
+ *
+ * The logger only wants the best object for each access (see
+ * priority_of_type), so the engines which only find that are checked
+ * and timed separately, with the memory each one needs on top of the
+ * index.
+ *
+ * Finally the reverse index (find_object) is checked against the
+ * merged lines of each object, with the lines inserted in several
+ * orders, since the examiner does not map an object in order, and
+ * with objects of every possible type, loaded from text and binary
+ * block maps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/icl/interval.hpp>
+#include <boost/icl/interval_map.hpp>
+#include <boost/container/flat_set.hpp>
+
+#include "ranges.h"
+#include "ranges.hpp"
+#include "shared.h"
+
+using namespace std;
+
+struct line {
+  uint64_t start, end;
+  string object;
+};
+
+struct hit {
+  string object;
+  uint64_t start, end;
+
+  bool operator< (const hit &h) const {
+    return object < h.object || (object == h.object && start < h.start);
+  }
+  bool operator== (const hit &h) const {
+    return object == h.object && start == h.start && end == h.end;
+  }
+};
+
+class engine {
+public:
+  virtual ~engine () {}
+  virtual const char *name () const = 0;
+  virtual void build (const vector<line> &lines) = 0;
+
+  /* Count the hits for [start, end), for timing. */
+  virtual size_t count (uint64_t start, uint64_t end) const = 0;
+
+  /* Append the hits for [start, end) to 'hits'. */
+  virtual void query (uint64_t start, uint64_t end, vector<hit> &hits) const = 0;
+};
+
+/* The input lines themselves, which every other engine must agree
+ * with.  Long lines (devices, partitions) are checked one by one, the
+ * rest are found by binary search on the start offset.
+ */
+class reference_engine : public engine {
+  static const uint64_t LONG = 16 * 1024 * 1024;
+  vector<line> long_lines, short_lines;
+
+  template <typename F>
+  void visit (uint64_t start, uint64_t end, F f) const {
+    for (const line &l : long_lines)
+      if (l.start < end && l.end > start)
+        f (l);
+    auto first = lower_bound (short_lines.begin (), short_lines.end (),
+                              start >= LONG ? start - LONG : 0,
+                              [](const line &l, uint64_t s) { return l.start < s; });
+    for (auto it = first; it != short_lines.end () && it->start < end; ++it)
+      if (it->end > start)
+        f (*it);
+  }
+
+public:
+  const char *name () const { return "reference"; }
+  void build (const vector<line> &lines) {
+    for (const line &l : lines)
+      (l.end - l.start > LONG ? long_lines : short_lines).push_back (l);
+    sort (short_lines.begin (), short_lines.end (),
+          [](const line &a, const line &b) { return a.start < b.start; });
+  }
+  size_t count (uint64_t start, uint64_t end) const {
+    size_t n = 0;
+    visit (start, end, [&](const line &) { n++; });
+    return n;
+  }
+  void query (uint64_t start, uint64_t end, vector<hit> &hits) const {
+    visit (start, end, [&](const line &l) {
+        hits.push_back (hit { l.object, l.start, l.end });
+      });
+  }
+};
+
+/* The original index: one interval_map of flat_sets of every object
+ * overlapping each segment.
+ */
+class icl_engine : public engine {
+  boost::icl::interval_map<uint64_t, boost::container::flat_set<uint32_t> > map;
+  vector<string> names;
+
+public:
+  const char *name () const { return "icl"; }
+  void build (const vector<line> &lines) {
+    unordered_map<string, uint32_t> ids;
+    for (const line &l : lines) {
+      auto r = ids.insert (make_pair (l.object, (uint32_t) names.size ()));
+      if (r.second)
+        names.push_back (l.object);
+      boost::container::flat_set<uint32_t> obj_set;
+      obj_set.insert (r.first->second);
+      map.add (std::make_pair (boost::icl::interval<uint64_t>::right_open (l.start, l.end),
+                               obj_set));
+    }
+  }
+  size_t count (uint64_t start, uint64_t end) const {
+    size_t n = 0;
+    auto r = map.equal_range (boost::icl::interval<uint64_t>::right_open (start, end));
+    for (auto it = r.first; it != r.second; ++it)
+      n += it->second.size ();
+    return n;
+  }
+  void query (uint64_t start, uint64_t end, vector<hit> &hits) const {
+    auto r = map.equal_range (boost::icl::interval<uint64_t>::right_open (start, end));
+    for (auto it = r.first; it != r.second; ++it)
+      for (uint32_t id : it->second)
+        hits.push_back (hit { names[id], it->first.lower (), it->first.upper () });
+  }
+};
+
+/* The layered index through ranges.hpp, with inlined callbacks. */
+class index_engine : public engine {
+protected:
+  unique_ptr<bmap::ranges_index> idx;
+
+public:
+  const char *name () const { return "index"; }
+  void build (const vector<line> &lines) {
+    idx.reset (new bmap::ranges_index ());
+    for (const line &l : lines)
+      idx->insert (l.start, l.end, l.object.c_str ());
+  }
+  size_t count (uint64_t start, uint64_t end) const {
+    size_t n = 0;
+    bmap::for_each_overlap (*idx, start, end,
+                            [&](uint64_t, uint64_t, bmap::object_id) { n++; });
+    return n;
+  }
+  void query (uint64_t start, uint64_t end, vector<hit> &hits) const {
+    bmap::for_each_overlap (*idx, start, end,
+                            [&](uint64_t s, uint64_t e, bmap::object_id id) {
+                              hits.push_back (hit { bmap::object_name (*idx, id), s, e });
+                            });
+  }
+};
+
+/* The layered index written as a binary block map and loaded back. */
+class binary_engine : public index_engine {
+public:
+  const char *name () const { return "binary"; }
+  void build (const vector<line> &lines) {
+    index_engine::build (lines);
+
+    FILE *fp = tmpfile ();
+    int disk;
+    if (fp == NULL || ranges_write_binary (idx.get (), 1, fp) == -1) {
+      perror ("ranges_write_binary");
+      exit (EXIT_FAILURE);
+    }
+    rewind (fp);
+    void *loaded = ranges_read_binary (fp, &disk);
+    if (loaded == NULL) {
+      perror ("ranges_read_binary");
+      exit (EXIT_FAILURE);
+    }
+    fclose (fp);
+    idx.reset ((bmap::ranges_index *) loaded);
+  }
+};
+
+/* The layered index loaded by the plugins' parser (ranges_load)
+ * straight from the file, rather than from the lines read here.
+ */
+class load_engine : public index_engine {
+  const char *filename;
+
+public:
+  explicit load_engine (const char *filename) : filename (filename) {}
+  const char *name () const { return "ranges_load"; }
+  void build (const vector<line> &) {
+    size_t bad_line;
+    void *loaded = ranges_load (filename, 1, &bad_line);
+    if (loaded == NULL) {
+      char msg[PATH_MAX + 64];
+
+      ranges_load_error (filename, 1, bad_line, msg, sizeof msg);
+      fprintf (stderr, "ranges-check: %s\n", msg);
+      exit (EXIT_FAILURE);
+    }
+    idx.reset ((bmap::ranges_index *) loaded);
+  }
+};
+
+/* The C interface used by the plugins.  'which' selects find_range_id,
+ * find_range (clips to the window) or find_range_ex (whole segments).
+ */
+class c_engine : public engine {
+  void *map;
+  int which;
+
+  static void count_id (uint64_t, uint64_t, uint32_t, void *opaque) {
+    ++*(size_t *) opaque;
+  }
+  static void count_name (uint64_t, uint64_t, const char *, void *opaque) {
+    ++*(size_t *) opaque;
+  }
+  struct query_context {
+    void *map;
+    vector<hit> *hits;
+  };
+  static void add_id (uint64_t start, uint64_t end, uint32_t id, void *opaque) {
+    query_context *qc = (query_context *) opaque;
+    size_t len = ranges_object_name (qc->map, id, NULL, 0);
+    string name (len, '\0');
+    ranges_object_name (qc->map, id, &name[0], len + 1);
+    qc->hits->push_back (hit { name, start, end });
+  }
+  static void add_name (uint64_t start, uint64_t end, const char *object, void *opaque) {
+    query_context *qc = (query_context *) opaque;
+    qc->hits->push_back (hit { object, start, end });
+  }
+
+public:
+  explicit c_engine (int which) : map (NULL), which (which) {}
+  ~c_engine () { if (map) free_ranges (map); }
+  const char *name () const {
+    return which == 0 ? "find_range_id" : which == 1 ? "find_range" : "find_range_ex";
+  }
+  void build (const vector<line> &lines) {
+    map = new_ranges ();
+    for (const line &l : lines)
+      insert_range (map, l.start, l.end, l.object.c_str ());
+  }
+  size_t count (uint64_t start, uint64_t end) const {
+    size_t n = 0;
+    if (which == 0)
+      find_range_id (map, start, end, count_id, &n);
+    else if (which == 1)
+      find_range (map, start, end, count_name, &n);
+    else
+      find_range_ex (map, start, end, count_name, &n);
+    return n;
+  }
+  void query (uint64_t start, uint64_t end, vector<hit> &hits) const {
+    query_context qc { map, &hits };
+    if (which == 0)
+      find_range_id (map, start, end, add_id, &qc);
+    else if (which == 1)
+      find_range (map, start, end, add_name, &qc);
+    else
+      find_range_ex (map, start, end, add_name, &qc);
+  }
+};
+
+/* The logger's priorities. */
+static int
+priority_of_type (int type)
+{
+  switch (type) {
+  case 'v': return 1;
+  case 'p': return 2;
+  case 'l': return 3;
+  case 'd': return 4;
+  case 'f': return 5;
+  default: return 6;
+  }
+}
+
+class best_engine {
+public:
+  virtual ~best_engine () {}
+  virtual const char *name () const = 0;
+  virtual void build (const bmap::ranges_index &idx) = 0;
+  virtual bmap::object_id find (uint64_t start, uint64_t end) const = 0;
+  virtual size_t bytes () const = 0;
+};
+
+/* What the logger did before block tables: look at every overlapping
+ * object and keep the first one of highest priority.
+ */
+class scan_engine : public best_engine {
+  const bmap::ranges_index *idx;
+
+public:
+  const char *name () const { return "scan"; }
+  void build (const bmap::ranges_index &i) { idx = &i; }
+  bmap::object_id find (uint64_t start, uint64_t end) const {
+    bmap::object_id best = 0;
+    int best_priority = 0;
+    bmap::for_each_overlap (*idx, start, end,
+                            [&](uint64_t, uint64_t, bmap::object_id id) {
+                              int p = priority_of_type (bmap::object_type (*idx, id));
+                              if (p > best_priority) {
+                                best = id;
+                                best_priority = p;
+                              }
+                            });
+    return best;
+  }
+  size_t bytes () const { return 0; }
+};
+
+/* A sorted array of the runs where the best object stays the same,
+ * searched by binary search.
+ */
+class sorted_array_engine : public best_engine {
+  struct run {
+    uint64_t start;
+    bmap::object_id id;         /* 0 for a gap */
+  };
+  vector<run> runs;
+  const bmap::ranges_index *idx;
+  int max_priority;
+
+public:
+  const char *name () const { return "sorted array"; }
+  void build (const bmap::ranges_index &i) {
+    uint64_t end = 0;
+
+    idx = &i;
+    max_priority = 0;
+    for (const bmap::layer &l : i.layers)
+      max_priority = max (max_priority, priority_of_type (l.type));
+    bmap::for_each_best_run (i, priority_of_type,
+                             [&](uint64_t s, uint64_t e, bmap::object_id id) {
+                               if (s != end || runs.empty ())
+                                 runs.push_back (run { end, 0 });
+                               runs.push_back (run { s, id });
+                               end = e;
+                             });
+    runs.push_back (run { end, 0 });
+    runs.shrink_to_fit ();
+  }
+  bmap::object_id find (uint64_t start, uint64_t end) const {
+    bmap::object_id best = 0;
+    int best_priority = 0;
+    auto it = upper_bound (runs.begin (), runs.end (), start,
+                           [](uint64_t s, const run &r) { return s < r.start; });
+    if (it != runs.begin ())
+      --it;
+    for (; it != runs.end () && it->start < end && best_priority < max_priority; ++it) {
+      if (it->id == 0)
+        continue;
+      int p = priority_of_type (bmap::object_type (*idx, it->id));
+      if (p > best_priority) {
+        best = it->id;
+        best_priority = p;
+      }
+    }
+    return best;
+  }
+  size_t bytes () const { return runs.capacity () * sizeof (run); }
+};
+
+class block_table_engine : public best_engine {
+  bmap::block_table table;
+
+public:
+  const char *name () const { return "block table"; }
+  void build (const bmap::ranges_index &idx) {
+    if (!table.build (idx, priority_of_type)) {
+      fprintf (stderr, "block_table: map is not aligned to blocks\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+  bmap::object_id find (uint64_t start, uint64_t end) const {
+    return table.find (start, end);
+  }
+  size_t bytes () const { return table.bytes (); }
+};
+
+/* The shared index the logger maps with index=, written to a
+ * temporary file.  Object IDs are the same as in the index.
+ */
+class shared_index_engine : public best_engine {
+  void *shared;
+  size_t size;
+
+public:
+  shared_index_engine () : shared (NULL), size (0) {}
+  ~shared_index_engine () { if (shared) shared_index_close (shared); }
+  const char *name () const { return "shared index"; }
+  void build (const bmap::ranges_index &idx) {
+    char path[] = "/tmp/ranges-check.XXXXXX";
+    struct stat statbuf;
+    int fd = mkstemp (path);
+
+    if (fd == -1 || close (fd) == -1 ||
+        shared_index_write (const_cast<bmap::ranges_index *> (&idx),
+                            priority_of_type, NULL, path) == -1 ||
+        (shared = shared_index_open (path)) == NULL ||
+        stat (path, &statbuf) == -1) {
+      perror (path);
+      exit (EXIT_FAILURE);
+    }
+    size = statbuf.st_size;
+    unlink (path);
+  }
+  bmap::object_id find (uint64_t start, uint64_t end) const {
+    int priority;
+    return shared_index_find (shared, start, end, &priority);
+  }
+  size_t bytes () const { return size; }
+};
+
+/* Clip hits to the window, then merge overlapping and adjacent hits
+ * of each object, so that engines which split the disk differently
+ * can be compared.
+ */
+static void
+canonicalize (uint64_t start, uint64_t end, vector<hit> &hits)
+{
+  size_t j = 0;
+
+  for (hit &h : hits) {
+    h.start = max (h.start, start);
+    h.end = min (h.end, end);
+  }
+  sort (hits.begin (), hits.end ());
+  for (size_t i = 0; i < hits.size (); ++i) {
+    if (hits[i].start >= hits[i].end)
+      continue;
+    if (j > 0 && hits[j-1].object == hits[i].object &&
+        hits[i].start <= hits[j-1].end)
+      hits[j-1].end = max (hits[j-1].end, hits[i].end);
+    else
+      hits[j++] = hits[i];
+  }
+  hits.resize (j);
+}
+
+static vector<line>
+read_bmap (const char *filename)
+{
+  vector<line> lines;
+  FILE *fp;
+  char *buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  while ((len = getline (&buf, &alloc, fp)) != -1) {
+    uint64_t start, end;
+    int object_offset;
+
+    if (len > 0 && buf[len-1] == '\n')
+      buf[--len] = '\0';
+    if (sscanf (buf, "1 %" SCNx64 " %" SCNx64 " %n",
+                &start, &end, &object_offset) >= 2 && start < end)
+      lines.push_back (line { start, end, buf + object_offset });
+  }
+  free (buf);
+  fclose (fp);
+  return lines;
+}
+
+typedef vector<pair<uint64_t, uint64_t> > extent_list;
+
+/* The extents of each object: its lines sorted, with overlapping and
+ * adjacent lines merged.
+ */
+static unordered_map<string, extent_list>
+reference_extents (const vector<line> &lines)
+{
+  unordered_map<string, extent_list> objects;
+
+  for (const line &l : lines)
+    objects[l.object].push_back (make_pair (l.start, l.end));
+  for (auto &o : objects) {
+    extent_list &v = o.second;
+    size_t j = 0;
+
+    sort (v.begin (), v.end ());
+    for (size_t i = 1; i < v.size (); ++i) {
+      if (v[i].first <= v[j].second)
+        v[j].second = max (v[j].second, v[i].second);
+      else
+        v[++j] = v[i];
+    }
+    v.resize (j + 1);
+  }
+  return objects;
+}
+
+static void
+add_extent (uint64_t start, uint64_t end, const char *, void *opaque)
+{
+  ((extent_list *) opaque)->push_back (make_pair (start, end));
+}
+
+/* Insert 'lines' in the order given and compare find_object for every
+ * object with 'expected'.  Returns the number of objects which differ.
+ */
+static size_t
+check_reverse (const char *name, const vector<line> &lines,
+               const unordered_map<string, extent_list> &expected)
+{
+  void *map = new_ranges ();
+  size_t mismatches = 0;
+
+  for (const line &l : lines)
+    insert_range (map, l.start, l.end, l.object.c_str ());
+  for (const auto &o : expected) {
+    extent_list result;
+
+    find_object (map, o.first.c_str (), add_extent, &result);
+    if (result != o.second && mismatches++ == 0)
+      fprintf (stderr, "%s: %s: found %zu extents instead of %zu\n",
+               name, o.first.c_str (), result.size (), o.second.size ());
+  }
+  free_ranges (map);
+
+  printf ("%-14s %10zu  ", name, expected.size ());
+  if (mismatches == 0)
+    printf ("ok\n");
+  else
+    printf ("%zu objects differ\n", mismatches);
+  fflush (stdout);
+  return mismatches;
+}
+
+/* One object of every type (first byte) a text block map allows, so
+ * one layer each.  The map is loaded with ranges_load from a text and
+ * from a binary block map.  Returns the number of failures.
+ */
+static size_t
+check_types (const char *name)
+{
+  vector<line> lines;
+  char path[] = "/tmp/ranges-check.XXXXXX";
+  size_t bad_line, failures = 0;
+  int fd;
+  FILE *fp;
+  void *map;
+
+  for (int c = 1; c < 256; ++c) {
+    if (isspace (c))
+      continue;
+    lines.push_back (line { (uint64_t) c * 4096, (uint64_t) c * 4096 + 1024,
+                            string (1, (char) c) + " /dev/sda1 /t" });
+  }
+  auto expected = reference_extents (lines);
+
+  fd = mkstemp (path);
+  if (fd == -1 || (fp = fdopen (fd, "w")) == NULL) {
+    perror (path);
+    exit (EXIT_FAILURE);
+  }
+  for (const line &l : lines)
+    fprintf (fp, "1 %" PRIx64 " %" PRIx64 " %s\n", l.start, l.end, l.object.c_str ());
+  if (fclose (fp) == EOF) {
+    perror (path);
+    exit (EXIT_FAILURE);
+  }
+
+  for (int binary = 0; binary <= 1; ++binary) {
+    map = ranges_load (path, 1, &bad_line);
+    if (map == NULL) {
+      char msg[PATH_MAX + 64];
+
+      ranges_load_error (path, 1, bad_line, msg, sizeof msg);
+      fprintf (stderr, "ranges-check: %s\n", msg);
+      exit (EXIT_FAILURE);
+    }
+    if (((bmap::ranges_index *) map)->layers.size () != lines.size ())
+      failures++;
+    for (const auto &o : expected) {
+      extent_list result;
+
+      find_object (map, o.first.c_str (), add_extent, &result);
+      if (result != o.second)
+        failures++;
+    }
+    if (!binary &&
+        ((fp = fopen (path, "w")) == NULL ||
+         ranges_write_binary (map, 1, fp) == -1 || fclose (fp) == EOF)) {
+      perror (path);
+      exit (EXIT_FAILURE);
+    }
+    free_ranges (map);
+  }
+  unlink (path);
+
+  printf ("%-14s %10zu  ", name, lines.size ());
+  if (failures == 0)
+    printf ("ok\n");
+  else
+    printf ("%zu failures\n", failures);
+  fflush (stdout);
+  return failures;
+}
+
+static double
+ms_since (chrono::steady_clock::time_point t)
+{
+  return chrono::duration<double, milli> (chrono::steady_clock::now () - t).count ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t nr_queries = 10000;
+  unsigned seed = 42;
+  const char *filename = "bmap.txt";
+  int c;
+
+  while ((c = getopt (argc, argv, "q:s:")) != -1) {
+    switch (c) {
+    case 'q': nr_queries = strtoul (optarg, NULL, 0); break;
+    case 's': seed = strtoul (optarg, NULL, 0); break;
+    default:
+      fprintf (stderr, "usage: ranges-check [-q queries] [-s seed] [bmap.txt]\n");
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (optind < argc)
+    filename = argv[optind];
+
+  vector<line> lines = read_bmap (filename);
+  if (lines.empty ()) {
+    fprintf (stderr, "%s: no ranges for disk 1\n", filename);
+    exit (EXIT_FAILURE);
+  }
+  uint64_t disk_end = 0;
+  for (const line &l : lines)
+    disk_end = max (disk_end, l.end);
+
+  /* Mostly small windows like guest I/O, some large ones. */
+  mt19937_64 rng (seed);
+  vector<pair<uint64_t, uint64_t> > queries;
+  for (size_t i = 0; i < nr_queries; ++i) {
+    uint64_t start = rng () % disk_end;
+    uint64_t len = i % 10 == 9 ? rng () % (disk_end / 16 + 1) + 1
+                               : (rng () % 256 + 1) * 512;
+    queries.push_back (make_pair (start, start + len));
+  }
+
+  vector<unique_ptr<engine> > engines;
+  engines.emplace_back (new reference_engine ());
+  engines.emplace_back (new icl_engine ());
+  engines.emplace_back (new index_engine ());
+  engines.emplace_back (new binary_engine ());
+  engines.emplace_back (new load_engine (filename));
+  engines.emplace_back (new c_engine (0));
+  engines.emplace_back (new c_engine (1));
+  engines.emplace_back (new c_engine (2));
+
+  printf ("%s: %zu ranges, %zu queries, seed %u\n\n",
+          filename, lines.size (), nr_queries, seed);
+  printf ("%-14s %10s %10s %12s  %s\n",
+          "engine", "build ms", "query ms", "hits", "result");
+
+  vector<vector<hit> > expected (nr_queries);
+  int ret = EXIT_SUCCESS;
+
+  for (size_t e = 0; e < engines.size (); ++e) {
+    engine &eng = *engines[e];
+    size_t hits = 0, mismatches = 0;
+
+    auto t = chrono::steady_clock::now ();
+    eng.build (lines);
+    double build_ms = ms_since (t);
+
+    t = chrono::steady_clock::now ();
+    for (const auto &q : queries)
+      hits += eng.count (q.first, q.second);
+    double query_ms = ms_since (t);
+
+    /* The first engine is the reference for the others. */
+    for (size_t i = 0; i < nr_queries; ++i) {
+      vector<hit> result;
+
+      eng.query (queries[i].first, queries[i].second, result);
+      canonicalize (queries[i].first, queries[i].second, result);
+      if (e == 0)
+        expected[i].swap (result);
+      else if (result != expected[i]) {
+        if (mismatches++ == 0)
+          fprintf (stderr, "%s: query %zu [%" PRIx64 ", %" PRIx64 ") "
+                   "returned %zu objects instead of %zu\n",
+                   eng.name (), i, queries[i].first, queries[i].second,
+                   result.size (), expected[i].size ());
+      }
+    }
+
+    printf ("%-14s %10.1f %10.1f %12zu  ", eng.name (), build_ms, query_ms, hits);
+    if (mismatches == 0)
+      printf ("ok\n");
+    else {
+      printf ("%zu queries differ\n", mismatches);
+      ret = EXIT_FAILURE;
+    }
+    fflush (stdout);
+
+    /* Free each engine before building the next, otherwise the next
+     * one is built in a fragmented heap and its timings suffer.
+     */
+    engines[e].reset ();
+  }
+
+  bmap::ranges_index idx;
+  for (const line &l : lines)
+    idx.insert (l.start, l.end, l.object.c_str ());
+
+  vector<unique_ptr<best_engine> > best_engines;
+  best_engines.emplace_back (new scan_engine ());
+  best_engines.emplace_back (new sorted_array_engine ());
+  best_engines.emplace_back (new block_table_engine ());
+  best_engines.emplace_back (new shared_index_engine ());
+
+  printf ("\n%-14s %10s %10s %12s  %s\n",
+          "best object", "build ms", "query ms", "bytes", "result");
+
+  vector<bmap::object_id> expected_best (nr_queries);
+
+  for (size_t e = 0; e < best_engines.size (); ++e) {
+    best_engine &eng = *best_engines[e];
+    size_t mismatches = 0;
+
+    auto t = chrono::steady_clock::now ();
+    eng.build (idx);
+    double build_ms = ms_since (t);
+
+    t = chrono::steady_clock::now ();
+    for (size_t i = 0; i < nr_queries; ++i) {
+      bmap::object_id id = eng.find (queries[i].first, queries[i].second);
+
+      if (e == 0)
+        expected_best[i] = id;
+      else if (id != expected_best[i]) {
+        if (mismatches++ == 0)
+          fprintf (stderr, "%s: query %zu [%" PRIx64 ", %" PRIx64 ") "
+                   "found %s instead of %s\n",
+                   eng.name (), i, queries[i].first, queries[i].second,
+                   bmap::object_name (idx, id).c_str (),
+                   bmap::object_name (idx, expected_best[i]).c_str ());
+      }
+    }
+    double query_ms = ms_since (t);
+
+    printf ("%-14s %10.1f %10.1f %12zu  ", eng.name (), build_ms, query_ms, eng.bytes ());
+    if (mismatches == 0)
+      printf ("ok\n");
+    else {
+      printf ("%zu queries differ\n", mismatches);
+      ret = EXIT_FAILURE;
+    }
+    fflush (stdout);
+  }
+
+  printf ("\n%-14s %10s  %s\n", "reverse lookup", "objects", "result");
+
+  /* An extent which joins two others, inserted last. */
+  vector<line> example {
+    line { 0, 10, "f /dev/sda1 /a" },
+    line { 20, 30, "f /dev/sda1 /a" },
+    line { 5, 25, "f /dev/sda1 /a" },
+  };
+  if (check_reverse ("example", example, reference_extents (example)) > 0)
+    ret = EXIT_FAILURE;
+
+  auto extents = reference_extents (lines);
+  vector<line> order (lines);
+  if (check_reverse ("in order", order, extents) > 0)
+    ret = EXIT_FAILURE;
+  reverse (order.begin (), order.end ());
+  if (check_reverse ("reversed", order, extents) > 0)
+    ret = EXIT_FAILURE;
+  shuffle (order.begin (), order.end (), rng);
+  if (check_reverse ("shuffled", order, extents) > 0)
+    ret = EXIT_FAILURE;
+  if (check_types ("all types") > 0)
+    ret = EXIT_FAILURE;
+
+  exit (ret);
+}
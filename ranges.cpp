@@ -1,6 +1,3 @@
-#define BOOST_RESULT_OF_USE_DECTYPE
-#define BOOST_SPIRIT_USE_PHOENIX_V3
-    
 /* virt-bmap examiner plugin
  * Copyright (C) 2014 Red Hat Inc.
  *
@@ -23,292 +20,617 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <boost/icl/interval.hpp>
-#include <boost/icl/interval_set.hpp>
-#include <boost/icl/interval_map.hpp>
-#include <boost/container/flat_set.hpp>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ranges.h"
+#include "ranges.hpp"
 
 using namespace std;
+using namespace bmap;
 
-/* Maps intervals (uint64_t, uint64_t) to a set of strings, where each
- * string represents an object that covers that range.
- */
+/* The C interface, for the plugins.  See ranges.hpp. */
 
-static size_t atoms_requested = 0;
-static size_t atoms_unique_created = 0;
+extern "C" void *
+new_ranges (void)
+{
+  return new ranges_index ();
+}
 
-using string_atom = const char*;
-string_atom make_atom(std::string&& s)
+/* This only frees the blocks of the index's arena, not each segment. */
+extern "C" void
+free_ranges (void *mapv)
 {
-    static std::set<std::string> s_atoms;
-    atoms_requested += 1;
+  ranges_index *idx = (ranges_index *) mapv;
+  delete idx;
+}
 
-    auto it = s_atoms.find(s);
-    if (it != s_atoms.end())
-        return it->c_str();
+extern "C" void
+insert_range (void *mapv, uint64_t start, uint64_t end, const char *object)
+{
+  ((ranges_index *) mapv)->insert (start, end, object);
+}
 
-    atoms_unique_created += 1;
-    return s_atoms.insert(std::move(s)).first->c_str();
+extern "C" uint32_t
+ranges_object_id (void *mapv, const char *object)
+{
+  return find_object_id (*(const ranges_index *) mapv, object);
 }
 
-typedef boost::container::flat_set<string_atom> objects;
-typedef boost::icl::interval_map<uint64_t, objects> ranges;
+extern "C" size_t
+ranges_object_name (void *mapv, uint32_t id, char *buf, size_t len)
+{
+  std::string name = object_name (*(const ranges_index *) mapv, id);
 
-ranges*
-new_ranges (void)
+  if (len > 0) {
+    size_t n = min (len - 1, name.size ());
+    memcpy (buf, name.data (), n);
+    buf[n] = '\0';
+  }
+  return name.size ();
+}
+
+extern "C" int
+ranges_object_type (void *mapv, uint32_t id)
 {
-  return new ranges ();
+  return object_type (*(const ranges_index *) mapv, id);
 }
 
-void
-free_ranges (ranges *mapv)
+extern "C" void
+iter_range_id (void *mapv, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque)
 {
-  ranges *map = (ranges *) mapv;
-  delete map;
+  for_each_range (*(const ranges_index *) mapv,
+                  [&](uint64_t start, uint64_t end, object_id id) {
+                    f (start, end, id, opaque);
+                  });
 }
 
 extern "C" void
-insert_range (void *mapv, uint64_t start, uint64_t end, const char *object)
+find_range_id (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque)
 {
-  ranges *map = (ranges *) mapv;
-  objects obj_set;
-  obj_set.insert (obj_set.end(), object);
-  map->add (std::make_pair (boost::icl::interval<uint64_t>::right_open (start, end), // SEHE added std::
-                       obj_set));
+  for_each_overlap (*(const ranges_index *) mapv, start, end,
+                    [&](uint64_t start, uint64_t end, object_id id) {
+                      f (start, end, id, opaque);
+                    });
 }
 
+extern "C" void
+find_range_type (void *mapv, int type, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque)
+{
+  for_each_overlap_type (*(const ranges_index *) mapv, type, start, end,
+                         [&](uint64_t start, uint64_t end, object_id id) {
+                           f (start, end, id, opaque);
+                         });
+}
+
+/* The functions taking string callbacks rebuild each name into
+ * 'name', which is only valid until the callback returns.
+ */
+
 extern "C" void
 iter_range (void *mapv, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
 {
-  ranges *map = (ranges *) mapv;
-  ranges::iterator iter = map->begin ();
-  while (iter != map->end ()) {
-    boost::icl::interval<uint64_t>::type range = iter->first;
-    uint64_t start = range.lower ();
-    uint64_t end = range.upper ();
-
-    objects obj_set = iter->second;
-    objects::iterator iter2 = obj_set.begin ();
-    while (iter2 != obj_set.end ()) {
-      f (start, end, *iter2/*->c_str ()*/, opaque); // SEHE
-      iter2++;
-    }
-    iter++;
-  }
+  const ranges_index *idx = (const ranges_index *) mapv;
+  std::string name;
+
+  for_each_range (*idx,
+                  [&](uint64_t start, uint64_t end, object_id id) {
+                    idx->names.name (id, name);
+                    f (start, end, name.c_str (), opaque);
+                  });
 }
 
 extern "C" void
-find_range (void const *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
+find_range (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
 {
-  const ranges *map = (const ranges *) mapv;
+  const ranges_index *idx = (const ranges_index *) mapv;
+  std::string name;
+  uint64_t window_start = start, window_end = end;
+
+  /* Segments are clipped to the window. */
+  for_each_overlap (*idx, start, end,
+                    [&](uint64_t start, uint64_t end, object_id id) {
+                      idx->names.name (id, name);
+                      f (max (start, window_start), min (end, window_end),
+                         name.c_str (), opaque);
+                    });
+}
 
-  boost::icl::interval<uint64_t>::type window;
-  window = boost::icl::interval<uint64_t>::right_open (start, end);
+extern "C" void
+find_range_ex (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
+{
+  const ranges_index *idx = (const ranges_index *) mapv;
+  std::string name;
+
+  for_each_overlap (*idx, start, end,
+                    [&](uint64_t start, uint64_t end, object_id id) {
+                      idx->names.name (id, name);
+                      f (start, end, name.c_str (), opaque);
+                    });
+}
 
-  const ranges r = *map & window;
+extern "C" size_t
+find_object (void *mapv, const char *object, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
+{
+  ranges_index *idx = (ranges_index *) mapv;
 
-  ranges::const_iterator iter = r.begin ();
-  while (iter != r.end ()) {
-    boost::icl::interval<uint64_t>::type range = iter->first;
-    uint64_t start = range.lower ();
-    uint64_t end = range.upper ();
+  return for_each_extent (*idx, find_object_id (*idx, object),
+                          [&](uint64_t start, uint64_t end, object_id id) {
+                            f (start, end, object, opaque);
+                          });
+}
 
-    objects obj_set = iter->second;
-    objects::iterator iter2 = obj_set.begin ();
-    while (iter2 != obj_set.end ()) {
-      f (start, end, *iter2/*->c_str ()*/, opaque); // SEHE
-      iter2++;
+extern "C" void *
+new_block_table (void *mapv, int (*priority) (int type))
+{
+  block_table *table;
+
+  try {
+    table = new block_table ();
+    if (!table->build (*(const ranges_index *) mapv, priority)) {
+      delete table;
+      errno = EINVAL;
+      return NULL;
     }
-    iter++;
   }
+  catch (const std::bad_alloc &) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return table;
 }
 
 extern "C" void
-find_range_ex (void const *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque)
+free_block_table (void *tablev)
 {
-  const ranges *map = (const ranges *) mapv;
-
-  boost::icl::interval<uint64_t>::type window;
-  window = boost::icl::interval<uint64_t>::right_open (start, end);
-
-#if 0
-  const ranges r = *map & window;
-  ranges::const_iterator iter = r.begin ();
-  while (iter != r.end ()) {
-#else
-  auto r = map->equal_range(window);
-  ranges::const_iterator iter = r.first;
-  while (iter != r.second) {
-#endif
-
-    boost::icl::interval<uint64_t>::type range = iter->first;
-    uint64_t start = range.lower ();
-    uint64_t end = range.upper ();
-
-    objects obj_set = iter->second;
-    objects::iterator iter2 = obj_set.begin ();
-    while (iter2 != obj_set.end ()) {
-      f (start, end, *iter2/*->c_str ()*/, opaque); // SEHE
-      iter2++;
-    }
-    iter++;
-  }
+  block_table *table = (block_table *) tablev;
+  delete table;
 }
 
-#include <memory>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/phoenix.hpp>
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics.hpp>
-#include <fstream>
-#include <chrono>
-
-std::map<char, size_t> histo;
-
-bool insert_line_of_input(ranges& bmap_data, uint64_t b, uint64_t e, char type, std::string& object) {
-    if (!object.empty())
-        histo[type]++;
-    //std::cout << std::hex << b << " " << e << " " << type << " " << object << "\n";
-
-#if 0
-    object.insert(object.begin(), ':');
-    object.insert(object.begin(), type);
-#endif
-    insert_range(&bmap_data, b, e, make_atom(std::move(object)));
-    return true;
+extern "C" uint32_t
+block_table_find (void *tablev, uint64_t start, uint64_t end)
+{
+  return ((const block_table *) tablev)->find (start, end);
 }
 
-std::vector<std::pair<uint64_t, uint64_t> > generate_test_queries(ranges const& bmap_data, size_t n) {
-    std::vector<std::pair<uint64_t, uint64_t> > queries;
-    queries.reserve(n);
-
-    for (size_t i = 0; i < n; ++i)
-    {
-        auto start = (static_cast<uint64_t>(rand()) * rand()) % bmap_data.size();
-        auto end   = start + rand();
+extern "C" size_t
+block_table_bytes (void *tablev)
+{
+  return ((const block_table *) tablev)->bytes ();
+}
 
-        queries.emplace_back(start,end);
+extern "C" void
+ranges_stats (void *mapv, struct ranges_stats *stats)
+{
+  const ranges_index *idx = (const ranges_index *) mapv;
+
+  memset (stats, 0, sizeof *stats);
+  stats->nr_layers = idx->layers.size ();
+  stats->nr_objects = idx->names.nr_objects ();
+  stats->nr_name_nodes = idx->names.nr_nodes ();
+
+  /* An interval_map is a std::map, so each segment is a tree node of
+   * (three pointers and a colour) plus the interval and object_set.
+   */
+  for (const layer &l : idx->layers) {
+    for (const auto &seg : l.map) {
+      size_t n = seg.second.size ();
+      int b = 0;
+
+      while (b < RANGES_STATS_SET_SIZES - 1 && n >= ((size_t) 2 << b))
+        b++;
+      stats->set_sizes[b]++;
+      if (n > stats->max_set_size)
+        stats->max_set_size = n;
+      if (n > 1)
+        stats->object_set_bytes += n * sizeof (uint32_t);
+      stats->nr_segments++;
     }
+  }
+  stats->segment_bytes =
+    stats->nr_segments * (sizeof (ranges::value_type) + 4 * sizeof (void *));
 
-    return queries;
-}
+  stats->name_bytes = idx->names.bytes ();
 
-ranges read_mapfile(const char* fname) {
-    std::ifstream ifs(fname);
-    boost::spirit::istream_iterator f(ifs >> std::noskipws), l;
-
-    ranges bmap_data;
-
-    namespace phx = boost::phoenix;
-    using namespace boost::spirit::qi;
-    uint_parser<uint64_t, 16> offset;
-    if (!phrase_parse(f,l,
-                ("1 " >> offset >> offset >> char_("pvdf") >> as_string[lexeme[+graph] >> attr('/') >> lexeme[*~char_("\r\n")]]) 
-                [ _pass = phx::bind(insert_line_of_input, phx::ref(bmap_data), _1, _2, _3, _4) ] % eol >> *eol, 
-                blank))
-    {
-        exit(255);
-    } else
-    {
-        std::cout << "Parsed ok\n";
-    }
+  stats->reverse_bytes = idx->reverse.capacity () * sizeof (object_extents);
+  for (const object_extents &oe : idx->reverse)
+    stats->reverse_bytes += oe.extents.capacity () * sizeof (object_extent);
 
-    if (f!=l)
-        std::cout << "Warning: remaining input '" << std::string(f,l) << "\n";
+  stats->total_bytes = sizeof *idx + stats->segment_bytes +
+    stats->object_set_bytes + stats->name_bytes + stats->reverse_bytes;
+  stats->arena_bytes = idx->pool.bytes ();
+}
 
-    return bmap_data;
+extern "C" void
+ranges_print_stats (void *mapv, FILE *fp)
+{
+  struct ranges_stats stats;
+  int b, last;
+
+  ranges_stats (mapv, &stats);
+
+  fprintf (fp,
+           "layers:           %" PRIu64 "\n"
+           "segments:         %" PRIu64 "\n"
+           "objects:          %" PRIu64 " (%" PRIu64 " name nodes)\n"
+           "segment bytes:    %" PRIu64 "\n"
+           "object set bytes: %" PRIu64 "\n"
+           "name bytes:       %" PRIu64 "\n"
+           "reverse bytes:    %" PRIu64 "\n"
+           "total bytes:      %" PRIu64 "\n"
+           "arena bytes:      %" PRIu64 "\n"
+           "objects per segment:\n",
+           stats.nr_layers, stats.nr_segments,
+           stats.nr_objects, stats.nr_name_nodes,
+           stats.segment_bytes, stats.object_set_bytes,
+           stats.name_bytes, stats.reverse_bytes, stats.total_bytes,
+           stats.arena_bytes);
+  for (last = RANGES_STATS_SET_SIZES - 1;
+       last > 0 && stats.set_sizes[last] == 0; --last)
+    ;
+  for (b = 0; b <= last; ++b) {
+    uint64_t lo = (uint64_t) 1 << b;
+    uint64_t hi = b < RANGES_STATS_SET_SIZES - 1 ? (lo << 1) - 1 : stats.max_set_size;
+
+    if (lo == hi)
+      fprintf (fp, "  %" PRIu64 ": %" PRIu64 "\n", lo, stats.set_sizes[b]);
+    else
+      fprintf (fp, "  %" PRIu64 "-%" PRIu64 ": %" PRIu64 "\n",
+               lo, hi, stats.set_sizes[b]);
+  }
 }
 
-void report_statistics(ranges const& bmap_data) {
-    size_t total = 0;
-    for (auto e : histo) total += e.second;
+/* Binary block map format.  All integers are in host byte order
+ * (the file is a cache for the host which wrote it, not an
+ * interchange format).
+ *
+ *   header
+ *   nodes:    nr_nodes * { uint32 parent, len }  name trie, node 0 is the root,
+ *             the top bit of len is set for whole object names
+ *   arena:    the components of nodes 1.. concatenated (arena_size bytes)
+ *   layers:   nr_layers * { uint32 type, 0; uint64 nr_segments; segments }
+ *     segments: nr_segments * { uint64 start, end; uint32 nr; uint32 id[nr] }
+ *   reverse:  nr_nodes * { uint64 nr; { uint64 start, end } [nr] }
+ *
+ * Objects are identified by trie node, as in memory.
+ */
+struct binary_header {
+  char magic[8];                /* RANGES_BINARY_MAGIC */
+  uint32_t version;
+  int32_t disk;
+  uint64_t nr_nodes;
+  uint64_t nr_layers;
+  uint64_t arena_size;
+};
+
+#define BINARY_VERSION 3
+
+static int
+write_all (FILE *fp, const void *buf, size_t len)
+{
+  if (len > 0 && fwrite (buf, len, 1, fp) != 1)
+    return -1;
+  return 0;
+}
 
-    std::cout << "Histogram of " << total << " input lines\n";
+static int
+read_all (FILE *fp, void *buf, size_t len)
+{
+  if (len > 0 && fread (buf, len, 1, fp) != 1) {
+    if (!ferror (fp))
+      errno = EINVAL;           /* truncated */
+    return -1;
+  }
+  return 0;
+}
 
-    for (auto e : histo)
-        std::cout << e.first << ": " << e.second << "\n";
+extern "C" int
+ranges_write_binary (void *mapv, int disk, FILE *fp)
+{
+  ranges_index *idx = (ranges_index *) mapv;
+  const string_table &names = idx->names;
+  struct binary_header h;
+
+  memset (&h, 0, sizeof h);
+  memcpy (h.magic, RANGES_BINARY_MAGIC, sizeof h.magic);
+  h.version = BINARY_VERSION;
+  h.disk = disk;
+  h.nr_nodes = names.nr_nodes ();
+  h.nr_layers = idx->layers.size ();
+  h.arena_size = names.arena_size ();
+
+  if (write_all (fp, &h, sizeof h) == -1)
+    return -1;
+
+  for (uint32_t i = 0; i < names.nr_nodes (); ++i) {
+    uint32_t node[2] = { names.parent (i),
+                         names.length (i) | (names.is_object (i) ? 0x80000000 : 0) };
+    if (write_all (fp, node, sizeof node) == -1)
+      return -1;
+  }
+  if (write_all (fp, names.arena_data (), names.arena_size ()) == -1)
+    return -1;
+
+  for (const layer &l : idx->layers) {
+    uint32_t type[2] = { (uint32_t) l.type, 0 };
+    uint64_t nr_segments = l.map.iterative_size ();
 
-    namespace ba = boost::accumulators;
-    ba::accumulator_set<double, ba::stats<ba::tag::mean, ba::tag::max, ba::tag::min> > 
-        object_sets, interval_widths;
+    if (write_all (fp, type, sizeof type) == -1 ||
+        write_all (fp, &nr_segments, sizeof nr_segments) == -1)
+      return -1;
 
-    for (auto const& r : bmap_data)
-    {
-        auto width = r.first.upper() - r.first.lower();
-        assert(width % 1024 == 0);
+    for (const auto &seg : l.map) {
+      uint64_t range[2] = { seg.first.lower (), seg.first.upper () };
+      uint32_t nr = seg.second.size ();
 
-        interval_widths(width);
-        object_sets(r.second.size());
+      if (write_all (fp, range, sizeof range) == -1 ||
+          write_all (fp, &nr, sizeof nr) == -1 ||
+          write_all (fp, seg.second.begin (), nr * sizeof (uint32_t)) == -1)
+        return -1;
     }
+  }
+
+  arena::scope scope (idx->pool);
+  idx->reverse.resize (names.nr_nodes ());
+  for (object_extents &oe : idx->reverse) {
+    uint64_t nr;
+
+    oe.normalize ();
+    nr = oe.extents.size ();
+    if (write_all (fp, &nr, sizeof nr) == -1 ||
+        write_all (fp, oe.extents.data (), nr * sizeof (object_extent)) == -1)
+      return -1;
+  }
 
-    std::cout << std::fixed;
-    std::cout << "ranges size:            " << bmap_data.size()                 << "\n";
-    std::cout << "ranges iterative size:  " << bmap_data.iterative_size()       << "\n";
-
-    std::cout << "Min object set:         " << ba::min(object_sets)             << "\n" ;
-    std::cout << "Max object set:         " << ba::max(object_sets)             << "\n" ;
-    std::cout << "Average object set:     " << ba::mean(object_sets)            << "\n" ;
-    std::cout << "Min interval width:     " << ba::min(interval_widths)         << "\n" ;
-    std::cout << "Max interval width:     " << ba::max(interval_widths)         << "\n" ;
-    std::cout << "Average interval width: " << ba::mean(interval_widths)/1024.0 << "k\n" ;
-    std::cout << "First:                  " << bmap_data.begin()->first         << "\n" ;
-    std::cout << "Last:                   " << bmap_data.rbegin()->first        << "\n" ;
-
-    std::cout << "String atoms:           " << atoms_unique_created << " unique in " << atoms_requested << " total\n";
-    std::cout << "Atom efficiency:        " << (atoms_unique_created*100.0/atoms_requested) << "%\n";
+  return 0;
 }
 
-void perform_comparative_benchmarks(ranges const& bmap_data, size_t number_of_queries) {
-    srand(42);
-    auto const queries = generate_test_queries(bmap_data, number_of_queries);
-
-    using hrc = std::chrono::high_resolution_clock;
-    {
-        auto start = hrc::now();
-        size_t callbacks = 0;
-
-        for (auto const& q: queries)
-        {
-            find_range(&bmap_data, q.first, q.second, 
-                    [](uint64_t start, uint64_t end, const char *object, void *opaque) {
-                    ++(*static_cast<size_t*>(opaque));
-                    }, &callbacks);
-        }
-        std::cout << number_of_queries << " 'random' OLD lookups resulted in " << callbacks 
-                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+static ranges_index *
+read_binary (FILE *fp, int *disk)
+{
+  struct binary_header h;
+  size_t n;
+
+  n = fread (&h, 1, sizeof h, fp);
+  if (n == 0 && !ferror (fp)) {
+    errno = 0;                  /* end of file */
+    return NULL;
+  }
+  if (n != sizeof h) {
+    if (!ferror (fp))
+      errno = EINVAL;
+    return NULL;
+  }
+  if (memcmp (h.magic, RANGES_BINARY_MAGIC, sizeof h.magic) != 0 ||
+      h.version != BINARY_VERSION ||
+      h.nr_nodes == 0 || h.nr_nodes > UINT32_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  std::unique_ptr<ranges_index> idx (new ranges_index ());
+  arena::scope scope (idx->pool);
+
+  std::vector<uint32_t> nodes (h.nr_nodes * 2);
+  std::vector<char> arena (h.arena_size);
+  if (read_all (fp, nodes.data (), nodes.size () * sizeof (uint32_t)) == -1 ||
+      read_all (fp, arena.data (), h.arena_size) == -1)
+    return NULL;
+  uint64_t offset = 0;
+  for (uint64_t i = 1; i < h.nr_nodes; ++i) {
+    uint32_t parent = nodes[i*2], len = nodes[i*2+1] & 0x7fffffff;
+    bool object = nodes[i*2+1] & 0x80000000;
+
+    if (offset + len > h.arena_size ||
+        !idx->names.add_node (parent, arena.data () + offset, len, object)) {
+      errno = EINVAL;
+      return NULL;
     }
+    offset += len;
+  }
 
-    {
-        auto start = hrc::now();
-        size_t callbacks = 0;
+  for (uint64_t i = 0; i < h.nr_layers; ++i) {
+    uint32_t type[2];
+    uint64_t nr_segments;
 
-        for (auto const& q: queries)
-        {
-            find_range_ex(&bmap_data, q.first, q.second, 
-                    [](uint64_t start, uint64_t end, const char *object, void *opaque) {
-                    ++(*static_cast<size_t*>(opaque));
-                    }, &callbacks);
+    if (read_all (fp, type, sizeof type) == -1 ||
+        read_all (fp, &nr_segments, sizeof nr_segments) == -1)
+      return NULL;
+    if (type[0] > 255 || idx->layer_of[type[0]] != -1) {
+      errno = EINVAL;
+      return NULL;
+    }
+    ranges &map = idx->layer_for (type[0]);
+
+    /* Segments were written in order, so each one can be added at
+     * the end of the layer.
+     */
+    for (uint64_t j = 0; j < nr_segments; ++j) {
+      uint64_t range[2];
+      uint32_t nr;
+
+      if (read_all (fp, range, sizeof range) == -1 ||
+          read_all (fp, &nr, sizeof nr) == -1)
+        return NULL;
+      std::vector<uint32_t> ids (nr);
+      if (read_all (fp, ids.data (), nr * sizeof (uint32_t)) == -1)
+        return NULL;
+      for (uint32_t k = 0; k < nr; ++k) {
+        if (ids[k] == 0 || ids[k] >= h.nr_nodes || (k > 0 && ids[k] <= ids[k-1])) {
+          errno = EINVAL;
+          return NULL;
         }
-        std::cout << number_of_queries << " 'random' NEW lookups resulted in " << callbacks 
-                  << " callbacks in " << std::chrono::duration_cast<std::chrono::milliseconds>((hrc::now()-start)).count() << "ms\n";
+      }
+      map.add (map.end (),
+               std::make_pair (boost::icl::interval<uint64_t>::right_open (range[0], range[1]),
+                               object_set (ids.data (), nr)));
     }
+  }
+
+  idx->reverse.resize (h.nr_nodes);
+  for (object_extents &oe : idx->reverse) {
+    uint64_t nr;
+
+    if (read_all (fp, &nr, sizeof nr) == -1)
+      return NULL;
+    oe.extents.resize (nr);
+    if (read_all (fp, oe.extents.data (), nr * sizeof (object_extent)) == -1)
+      return NULL;
+  }
+
+  *disk = h.disk;
+  return idx.release ();
 }
 
-int main() {
-    auto bmap = read_mapfile("bmap.txt");
+extern "C" void *
+ranges_read_binary (FILE *fp, int *disk)
+{
+  try {
+    return read_binary (fp, disk);
+  }
+  catch (const std::bad_alloc &) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  catch (const std::exception &) {
+    errno = EINVAL;             /* eg. silly lengths in a corrupt file */
+    return NULL;
+  }
+}
 
-    report_statistics(bmap);
+/* Load disk 'disk' from a binary block map. */
+static ranges_index *
+load_binary (const char *filename, int disk)
+{
+  FILE *fp;
+  void *map;
+  int d, err;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL)
+    return NULL;
+  while ((map = ranges_read_binary (fp, &d)) != NULL) {
+    if (d == disk)
+      break;
+    free_ranges (map);
+  }
+  if (map == NULL && errno == 0)
+    errno = ENODATA;
+  err = errno;
+  fclose (fp);
+  errno = err;
+  return (ranges_index *) map;
+}
+
+/* Load disk 'disk' from a text block map, mapped in [p, end). */
+static ranges_index *
+load_text (const char *p, const char *end, int disk, size_t *bad_line)
+{
+  std::unique_ptr<ranges_index> idx (new ranges_index ());
+  size_t count = 0;
+
+  *bad_line = parse_bmap_text (p, end,
+                               [&](int d, uint64_t start, uint64_t stop,
+                                   const char *object, size_t len) {
+                                 if (d == disk) {
+                                   idx->insert (start, stop, object, len);
+                                   count++;
+                                 }
+                               });
+  if (*bad_line != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (count == 0) {
+    errno = ENODATA;
+    return NULL;
+  }
+  return idx.release ();
+}
 
-    perform_comparative_benchmarks(bmap, 1000);
+extern "C" void *
+ranges_load (const char *filename, int disk, size_t *bad_line)
+{
+  ranges_index *idx = NULL;
+  struct stat statbuf;
+  char magic[sizeof RANGES_BINARY_MAGIC - 1];
+  void *p;
+  int fd, err;
+
+  *bad_line = 0;
+
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &statbuf) == -1)
+    goto error;
+  if (statbuf.st_size == 0) {
+    errno = ENODATA;
+    goto error;
+  }
 
-#if 0 // to dump ranges to console
-    for (auto const& r : bmap)
-    {
-        std::cout << r.first << "\t" << r.second.size() << "\t";
-        std::copy(r.second.begin(), r.second.end(), std::ostream_iterator<std::string>(std::cout, "\t"));
-        std::cout << "\n";
+  if (pread (fd, magic, sizeof magic, 0) == (ssize_t) sizeof magic &&
+      memcmp (magic, RANGES_BINARY_MAGIC, sizeof magic) == 0) {
+    close (fd);
+    try {
+      return load_binary (filename, disk);
     }
-#endif
+    catch (const std::bad_alloc &) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  p = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    goto error;
+  madvise (p, statbuf.st_size, MADV_SEQUENTIAL);
+
+  try {
+    idx = load_text ((const char *) p, (const char *) p + statbuf.st_size,
+                     disk, bad_line);
+  }
+  catch (const std::bad_alloc &) {
+    errno = ENOMEM;
+  }
+  err = errno;
+  munmap (p, statbuf.st_size);
+  close (fd);
+  errno = err;
+  return idx;
+
+ error:
+  err = errno;
+  close (fd);
+  errno = err;
+  return NULL;
+}
+
+extern "C" size_t
+ranges_load_error (const char *filename, int disk, size_t bad_line,
+                   char *buf, size_t len)
+{
+  int err = errno, r;
+
+  if (err == EINVAL && bad_line > 0)
+    r = snprintf (buf, len, "%s:%zu: invalid block map line",
+                  filename, bad_line);
+  else if (err == EINVAL)
+    r = snprintf (buf, len, "%s: cannot read binary block map", filename);
+  else if (err == ENODATA)
+    r = snprintf (buf, len, "%s: no ranges for disk %d", filename, disk);
+  else
+    r = snprintf (buf, len, "%s: %s", filename, strerror (err));
+  errno = err;
+  return r < 0 ? 0 : r;
 }
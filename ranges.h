@@ -19,15 +19,142 @@
 #ifndef RANGES_H
 #define RANGES_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* C interface to the ranges index.  C++ code can use ranges.hpp. */
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
 extern void *new_ranges (void);
 extern void free_ranges (void *mapv);
+
+/* The object string is copied, so the caller may free it afterwards. */
 extern void insert_range (void *mapv, uint64_t start, uint64_t end, const char *object);
+
+/* Call 'f' for every object in every segment of the map, in order. */
 extern void iter_range (void *mapv, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque);
+
+/* Call 'f' for every object overlapping [start, end).  find_range
+ * clips the segments to the window, find_range_ex passes whole
+ * segments.
+ */
 extern void find_range (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque);
+extern void find_range_ex (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque);
+
+/* Object names are stored compressed, so the functions above rebuild
+ * each name for the callback, and the string passed to 'f' is only
+ * valid until 'f' returns.  The functions below pass a non-zero
+ * object ID instead, which is cheap, and can be turned back into a
+ * name when it is needed.
+ */
+extern void iter_range_id (void *mapv, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque);
+extern void find_range_id (void *mapv, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque);
+
+/* Like find_range_id, but only for objects of one type (the first
+ * character of the name, see ranges_object_type), which is a single
+ * lookup.
+ */
+extern void find_range_type (void *mapv, int type, uint64_t start, uint64_t end, void (*f) (uint64_t start, uint64_t end, uint32_t id, void *opaque), void *opaque);
+
+/* Returns the ID of 'object', or 0 if it is not in the map. */
+extern uint32_t ranges_object_id (void *mapv, const char *object);
+
+/* Write the name of object 'id' to 'buf' (truncated and \0-terminated,
+ * like snprintf) and return the length of the full name.
+ */
+extern size_t ranges_object_name (void *mapv, uint32_t id, char *buf, size_t len);
+
+/* Returns the first character of the name of object 'id' (the object
+ * type, eg. 'f' for files), without rebuilding the name.
+ */
+extern int ranges_object_type (void *mapv, uint32_t id);
+
+/* Reverse lookup: call 'f' for each extent of 'object' in order of
+ * offset, with overlapping and adjacent extents merged.  Returns the
+ * number of extents, 0 if the object is not in the map.
+ */
+extern size_t find_object (void *mapv, const char *object, void (*f) (uint64_t start, uint64_t end, const char *object, void *opaque), void *opaque);
+
+/* Shape and approximate memory use of a map.  Byte counts include
+ * unused container capacity but not malloc overhead.
+ */
+#define RANGES_STATS_SET_SIZES 16
+
+struct ranges_stats {
+  uint64_t nr_layers;           /* object types */
+  uint64_t nr_segments;         /* over all layers */
+  uint64_t nr_objects;
+  uint64_t nr_name_nodes;       /* nodes in the name trie */
+  uint64_t segment_bytes;       /* segment boundaries (interval map nodes) */
+  uint64_t object_set_bytes;    /* IDs of segments with several objects */
+  uint64_t name_bytes;          /* name trie, component arena and hash table */
+  uint64_t reverse_bytes;       /* reverse index */
+  uint64_t total_bytes;
+  uint64_t arena_bytes;         /* reserved for segments, sets and extents */
+  /* set_sizes[i] counts segments with 2^i to 2^(i+1)-1 objects, the
+   * last bucket counts all larger segments.
+   */
+  uint64_t set_sizes[RANGES_STATS_SET_SIZES];
+  uint64_t max_set_size;
+};
+
+extern void ranges_stats (void *mapv, struct ranges_stats *stats);
+
+/* Print ranges_stats in human readable form. */
+extern void ranges_print_stats (void *mapv, FILE *fp);
+
+/* Block tables, for finding the one object to report for an access
+ * in constant time.  The best object over [start, end) is the one of
+ * highest priority (priority (type) > 0, see ranges_object_type), and
+ * of equal priority, the first one find_range_id would pass to its
+ * callback.
+ *
+ * new_block_table builds a table from the map, which must not change
+ * while the table is used.  Returns NULL with errno set on error,
+ * EINVAL if the map cannot be looked up by 1K block (see ranges.hpp).
+ */
+extern void *new_block_table (void *mapv, int (*priority) (int type));
+extern void free_block_table (void *tablev);
+extern uint32_t block_table_find (void *tablev, uint64_t start, uint64_t end);
+extern size_t block_table_bytes (void *tablev);
+
+/* Binary block maps.  A binary block map file is a sequence of maps,
+ * one per disk, each holding the segments and the reverse index, so
+ * it can be loaded without parsing and sorting text.
+ *
+ * ranges_write_binary appends the map for disk index 'disk' to 'fp'.
+ * Returns -1 with errno set on error.
+ *
+ * ranges_read_binary reads the next map from 'fp', returning it and
+ * setting '*disk'.  Returns NULL at the end of the file (errno == 0)
+ * or on error (errno set, EINVAL if the file is not a binary block
+ * map).
+ */
+extern int ranges_write_binary (void *mapv, int disk, FILE *fp);
+extern void *ranges_read_binary (FILE *fp, int *disk);
+
+/* Magic at the start of each map in a binary block map. */
+#define RANGES_BINARY_MAGIC "VBMAPBIN"
+
+/* Load the ranges of disk index 'disk' from a block map file, which
+ * may be a text block map or a binary block map.  Returns NULL with
+ * errno set on error: EINVAL if the file is not a valid block map, in
+ * which case '*bad_line' is the number of the first invalid line of a
+ * text block map (0 for a binary block map), or ENODATA if it has no
+ * ranges for the disk.
+ */
+extern void *ranges_load (const char *filename, int disk, size_t *bad_line);
+
+/* After ranges_load has failed, write a message saying why (from
+ * errno and 'bad_line') to 'buf', truncated and \0-terminated like
+ * snprintf, and return the length of the full message.  The tools
+ * prefix it with their name.
+ */
+extern size_t ranges_load_error (const char *filename, int disk, size_t bad_line, char *buf, size_t len);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,1225 @@
+/* virt-bmap ranges index
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The C++ interface to the ranges index.  The C interface in ranges.h
+ * is a wrapper around this for the plugins.  C++ code should use the
+ * templates here directly, since the callbacks are then inlined
+ * instead of being called through a function pointer for every hit.
+ *
+ * Callbacks are called as f (start, end, id) where id is an object_id;
+ * use object_name to turn it into a string when it is needed.
+ */
+
+#ifndef RANGES_HPP
+#define RANGES_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/icl/interval.hpp>
+#include <boost/icl/interval_map.hpp>
+
+namespace bmap {
+
+/* Non-zero ID of an object in one index. */
+typedef uint32_t object_id;
+
+/* Object names are stored in a trie of name components, so that the
+ * type, device and directory prefixes which are shared by many objects
+ * are only stored once.  A name such as "f /dev/sda1 /usr/bin/ls" is
+ * split before each ' ' and '/' into "f", " /dev", "/sda1", " /usr",
+ * "/bin" and "/ls".  Each trie node stores one component and a link
+ * to its parent, and the node holding the last component of a name is
+ * the ID of that object (other nodes are only prefixes).  Full names
+ * are only rebuilt, by walking up to the root, when they are needed.
+ */
+class string_table {
+public:
+  string_table ();
+
+  uint32_t intern (const char *name) { return intern (name, strlen (name)); }
+  uint32_t intern (const char *name, size_t len);
+  uint32_t find (const char *name) const; /* 0 if not present */
+  void name (uint32_t id, std::string &out) const;
+  int type (uint32_t id) const;
+
+  size_t nr_nodes () const { return nodes.size (); }
+  size_t nr_objects () const { return objects; }
+  size_t bytes () const;
+
+  /* For reading and writing binary block maps. */
+  const char *arena_data () const { return arena.data (); }
+  size_t arena_size () const { return arena.size (); }
+  uint32_t parent (uint32_t id) const { return nodes[id].parent; }
+  uint32_t length (uint32_t id) const { return nodes[id].len; }
+  bool is_object (uint32_t id) const { return nodes[id].object; }
+  bool add_node (uint32_t parent, const char *component, uint32_t len, bool object);
+
+private:
+  struct node {
+    uint32_t parent;
+    uint32_t offset;            /* of the component in 'arena' */
+    uint32_t len : 31;
+    uint32_t object : 1;        /* a whole name was interned here */
+  };
+  std::vector<node> nodes;      /* nodes[0] is the root */
+  std::vector<char> arena;      /* components, in node order */
+  size_t objects;               /* number of nodes with 'object' set */
+
+  /* Open addressing hash table of (parent, component) -> node.  0 is
+   * the root so it can never be a child, and marks an empty slot.
+   */
+  std::vector<uint32_t> slots;
+
+  static size_t component_length (const char *p, const char *end);
+  static uint32_t hash (uint32_t parent, const char *p, size_t len);
+  uint32_t lookup (uint32_t parent, const char *p, size_t len) const;
+  uint32_t insert (uint32_t parent, const char *p, size_t len);
+  void rehash ();
+};
+
+inline string_table::string_table ()
+  : nodes (1, node { 0, 0, 0, 0 }), objects (0), slots (1024, 0)
+{
+}
+
+inline size_t
+string_table::component_length (const char *p, const char *end)
+{
+  size_t n = p < end ? 1 : 0;
+
+  while (p + n < end && p[n] != ' ' && p[n] != '/')
+    n++;
+  return n;
+}
+
+inline uint32_t
+string_table::hash (uint32_t parent, const char *p, size_t len)
+{
+  uint32_t h = 2166136261U ^ parent;  /* FNV-1a */
+
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ (unsigned char) p[i]) * 16777619U;
+  return h ^ (h >> 15);
+}
+
+inline uint32_t
+string_table::lookup (uint32_t parent, const char *p, size_t len) const
+{
+  size_t mask = slots.size () - 1;
+
+  for (size_t i = hash (parent, p, len) & mask; slots[i] != 0; i = (i + 1) & mask) {
+    const node &n = nodes[slots[i]];
+    if (n.parent == parent && n.len == len &&
+        memcmp (arena.data () + n.offset, p, len) == 0)
+      return slots[i];
+  }
+  return 0;
+}
+
+inline void
+string_table::rehash ()
+{
+  std::vector<uint32_t> old;
+
+  old.swap (slots);
+  slots.assign (old.size () * 2, 0);
+  size_t mask = slots.size () - 1;
+  for (uint32_t id : old) {
+    if (id == 0)
+      continue;
+    const node &n = nodes[id];
+    size_t i = hash (n.parent, arena.data () + n.offset, n.len) & mask;
+    while (slots[i] != 0)
+      i = (i + 1) & mask;
+    slots[i] = id;
+  }
+}
+
+inline uint32_t
+string_table::insert (uint32_t parent, const char *p, size_t len)
+{
+  uint32_t id = nodes.size ();
+
+  nodes.push_back (node { parent, (uint32_t) arena.size (), (uint32_t) len, 0 });
+  arena.insert (arena.end (), p, p + len);
+
+  /* Keep the table at most half full. */
+  if (nodes.size () * 2 > slots.size ())
+    rehash ();
+
+  size_t mask = slots.size () - 1;
+  size_t i = hash (parent, p, len) & mask;
+  while (slots[i] != 0)
+    i = (i + 1) & mask;
+  slots[i] = id;
+  return id;
+}
+
+inline bool
+string_table::add_node (uint32_t parent, const char *component, uint32_t len,
+                        bool object)
+{
+  if (parent >= nodes.size () || len >= 0x80000000 ||
+      lookup (parent, component, len) != 0)
+    return false;
+  nodes[insert (parent, component, len)].object = object;
+  objects += object;
+  return true;
+}
+
+inline uint32_t
+string_table::intern (const char *name, size_t len)
+{
+  const char *end = name + len;
+  uint32_t id = 0;
+
+  do {
+    size_t n = component_length (name, end);
+    uint32_t child = lookup (id, name, n);
+    id = child ? child : insert (id, name, n);
+    name += n;
+  } while (name < end);
+
+  if (!nodes[id].object) {
+    nodes[id].object = 1;
+    objects++;
+  }
+  return id;
+}
+
+inline uint32_t
+string_table::find (const char *name) const
+{
+  const char *end = name + strlen (name);
+  uint32_t id = 0;
+
+  do {
+    size_t len = component_length (name, end);
+    id = lookup (id, name, len);
+    name += len;
+  } while (id != 0 && *name);
+
+  return nodes[id].object ? id : 0;
+}
+
+inline void
+string_table::name (uint32_t id, std::string &out) const
+{
+  uint32_t chain[256];
+  size_t n = 0;
+
+  out.clear ();
+  while (id != 0) {
+    /* Very deep names are rebuilt in several passes. */
+    if (n == sizeof chain / sizeof chain[0]) {
+      std::string rest;
+      name (id, rest);
+      out = rest;
+      break;
+    }
+    chain[n++] = id;
+    id = nodes[id].parent;
+  }
+  while (n > 0) {
+    const node &c = nodes[chain[--n]];
+    out.append (arena.data () + c.offset, c.len);
+  }
+}
+
+inline size_t
+string_table::bytes () const
+{
+  return nodes.capacity () * sizeof (node) + arena.capacity () +
+    slots.capacity () * sizeof (uint32_t);
+}
+
+inline int
+string_table::type (uint32_t id) const
+{
+  while (id != 0 && nodes[id].parent != 0)
+    id = nodes[id].parent;
+  return id != 0 && nodes[id].len > 0 ? (unsigned char) arena[nodes[id].offset] : 0;
+}
+
+/* Building an index makes a tree node for every segment, and an
+ * array for every object's extents and every segment covered by
+ * several objects: millions of small allocations, most of them never
+ * freed until the whole index is.  They are all taken from an arena
+ * owned by the index instead of from malloc, so building does not
+ * depend on how fast the system malloc is, and freeing the index only
+ * frees the arena's blocks, without visiting the nodes.
+ *
+ * Small allocations are carved from blocks of up to 4MB.  Freed small
+ * allocations are kept on a free list for their size (segments are
+ * merged and split all the time while building), and large ones get
+ * and give back a block of their own.
+ */
+class arena {
+public:
+  arena () : blocks (NULL), pos (NULL), limit (NULL),
+             chunk_size (MIN_CHUNK), reserved (0) {
+    memset (free_lists, 0, sizeof free_lists);
+  }
+  ~arena () { release (); }
+  arena (const arena &) = delete;
+  arena &operator= (const arena &) = delete;
+
+  void *allocate (size_t bytes);
+  void deallocate (void *p, size_t bytes);
+  void release ();
+  size_t bytes () const { return reserved; }
+
+  /* Construct a T in the arena.  Its destructor is never called. */
+  template <typename T, typename... Args>
+  T &make (Args &&... args) {
+    return *new (allocate (sizeof (T))) T (std::forward<Args> (args)...);
+  }
+
+  /* The arena which default constructed arena_allocators (see below)
+   * use on this thread, or NULL for operator new.
+   */
+  static arena *&current () {
+    static thread_local arena *a = NULL;
+    return a;
+  }
+
+  /* Make 'a' the current arena while this is in scope. */
+  class scope {
+  public:
+    explicit scope (arena &a) : saved (current ()) { current () = &a; }
+    explicit scope (arena *a) : saved (current ()) { current () = a; }
+    ~scope () { current () = saved; }
+  private:
+    arena *saved;
+  };
+
+private:
+  struct block {
+    block *prev, *next;
+  };
+  static const size_t ALIGN = 16;
+  static const size_t HEADER = (sizeof (block) + ALIGN - 1) & ~(ALIGN - 1);
+  static const size_t MAX_SMALL = 512;      /* largest size on a free list */
+  static const size_t MAX_CARVED = 16384;   /* larger ones get their own block */
+  static const size_t MIN_CHUNK = 65536;
+  static const size_t MAX_CHUNK = 4194304;
+
+  block *blocks;                /* all blocks, newest first */
+  char *pos, *limit;            /* free space in the newest chunk */
+  size_t chunk_size;            /* of the next chunk */
+  size_t reserved;              /* bytes in all blocks */
+  void *free_lists[MAX_SMALL / ALIGN];
+
+  char *new_block (size_t bytes);
+};
+
+inline char *
+arena::new_block (size_t bytes)
+{
+  block *b = (block *) malloc (HEADER + bytes);
+
+  if (b == NULL)
+    throw std::bad_alloc ();
+  b->prev = NULL;
+  b->next = blocks;
+  if (blocks)
+    blocks->prev = b;
+  blocks = b;
+  reserved += HEADER + bytes;
+  return (char *) b + HEADER;
+}
+
+inline void *
+arena::allocate (size_t bytes)
+{
+  bytes = bytes > 0 ? (bytes + ALIGN - 1) & ~(ALIGN - 1) : ALIGN;
+
+  if (bytes <= MAX_SMALL) {
+    void *&head = free_lists[bytes / ALIGN - 1];
+
+    if (head != NULL) {
+      void *p = head;
+      head = *(void **) p;
+      return p;
+    }
+  }
+  if (bytes > MAX_CARVED)
+    return new_block (bytes);
+
+  if ((size_t) (limit - pos) < bytes) {
+    /* The rest of the current chunk is wasted; it is small. */
+    pos = new_block (chunk_size);
+    limit = pos + chunk_size;
+    chunk_size = std::min (chunk_size * 2, (size_t) MAX_CHUNK);
+  }
+  void *p = pos;
+  pos += bytes;
+  return p;
+}
+
+inline void
+arena::deallocate (void *p, size_t bytes)
+{
+  bytes = bytes > 0 ? (bytes + ALIGN - 1) & ~(ALIGN - 1) : ALIGN;
+
+  if (bytes <= MAX_SMALL) {
+    void *&head = free_lists[bytes / ALIGN - 1];
+    *(void **) p = head;
+    head = p;
+  }
+  else if (bytes > MAX_CARVED) {
+    block *b = (block *) ((char *) p - HEADER);
+
+    if (b->prev)
+      b->prev->next = b->next;
+    else
+      blocks = b->next;
+    if (b->next)
+      b->next->prev = b->prev;
+    reserved -= HEADER + bytes;
+    free (b);
+  }
+  /* else it is only reused when the whole arena is released */
+}
+
+inline void
+arena::release ()
+{
+  while (blocks) {
+    block *next = blocks->next;
+    free (blocks);
+    blocks = next;
+  }
+  pos = limit = NULL;
+  chunk_size = MIN_CHUNK;
+  reserved = 0;
+  memset (free_lists, 0, sizeof free_lists);
+}
+
+/* A standard allocator taking memory from an arena, which is the
+ * current arena when it is default constructed (as the interval_map
+ * does with its node allocator).  Elements are constructed with the
+ * container's arena current, so that containers inside them (eg. the
+ * extents of each entry of the reverse index) use the same arena
+ * wherever the container is changed.
+ */
+template <typename T>
+class arena_allocator {
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  template <typename U> struct rebind { typedef arena_allocator<U> other; };
+
+  arena_allocator () : a (arena::current ()) {}
+  explicit arena_allocator (arena *a) : a (a) {}
+  template <typename U>
+  arena_allocator (const arena_allocator<U> &o) : a (o.a) {}
+
+  T *allocate (size_t n) {
+    return (T *) (a ? a->allocate (n * sizeof (T)) : ::operator new (n * sizeof (T)));
+  }
+  void deallocate (T *p, size_t n) {
+    if (a)
+      a->deallocate (p, n * sizeof (T));
+    else
+      ::operator delete (p);
+  }
+
+  template <typename U, typename... Args>
+  void construct (U *p, Args &&... args) {
+    arena::scope scope (a);
+    ::new ((void *) p) U (std::forward<Args> (args)...);
+  }
+
+  template <typename U>
+  bool operator== (const arena_allocator<U> &o) const { return a == o.a; }
+  template <typename U>
+  bool operator!= (const arena_allocator<U> &o) const { return a != o.a; }
+
+  arena *a;
+};
+
+/* The objects covering one segment of a layer (see below).  Nearly
+ * every segment is covered by a single object, which is stored
+ * inline; only segments covered by several objects of the same type
+ * allocate a (sorted) array of IDs.  The array is taken from the
+ * current arena if there is one, and is then only freed with it.
+ */
+class object_set {
+public:
+  object_set () : n (0), in_arena (false), one (0) {}
+  explicit object_set (uint32_t id) : n (1), in_arena (false), one (id) {}
+  object_set (const uint32_t *ids, uint32_t nr);
+  object_set (const object_set &o) : n (0), in_arena (false), one (0) { *this = o; }
+  object_set (object_set &&o) : n (o.n), in_arena (o.in_arena), many (o.many) { o.n = 0; }
+  ~object_set () { if (n > 1 && !in_arena) delete[] many; }
+
+  object_set &operator= (const object_set &o);
+  object_set &operator= (object_set &&o);
+  object_set &operator+= (const object_set &o);
+  bool operator== (const object_set &o) const;
+
+  size_t size () const { return n; }
+  const uint32_t *begin () const { return n > 1 ? many : &one; }
+  const uint32_t *end () const { return begin () + n; }
+
+private:
+  uint32_t n;
+  bool in_arena;                /* 'many' belongs to an arena */
+  union {
+    uint32_t one;               /* if n <= 1 */
+    uint32_t *many;             /* if n > 1 */
+  };
+};
+
+inline object_set::object_set (const uint32_t *ids, uint32_t nr)
+  : n (nr), in_arena (false), one (nr == 1 ? ids[0] : 0)
+{
+  if (n > 1) {
+    arena *a = arena::current ();
+
+    in_arena = a != NULL;
+    many = a ? (uint32_t *) a->allocate (n * sizeof (uint32_t)) : new uint32_t[n];
+    std::copy (ids, ids + n, many);
+  }
+}
+
+inline object_set &
+object_set::operator= (const object_set &o)
+{
+  if (this != &o) {
+    object_set copy (o.begin (), o.n);
+    *this = std::move (copy);
+  }
+  return *this;
+}
+
+inline object_set &
+object_set::operator= (object_set &&o)
+{
+  if (this != &o) {
+    if (n > 1 && !in_arena)
+      delete[] many;
+    n = o.n;
+    in_arena = o.in_arena;
+    many = o.many;              /* copies 'one' too */
+    o.n = 0;
+  }
+  return *this;
+}
+
+inline object_set &
+object_set::operator+= (const object_set &o)
+{
+  if (o.n == 0 || *this == o)
+    return *this;
+
+  std::vector<uint32_t> ids (n + o.n);
+  ids.resize (std::set_union (begin (), end (), o.begin (), o.end (),
+                              ids.begin ()) - ids.begin ());
+  object_set merged (ids.data (), ids.size ());
+  *this = std::move (merged);
+  return *this;
+}
+
+inline bool
+object_set::operator== (const object_set &o) const
+{
+  return n == o.n && std::equal (begin (), end (), o.begin ());
+}
+
+/* Objects of each type (the first character of the name, eg. 'v' for
+ * devices, 'p' for partitions, 'f' for files) are kept in their own
+ * layer.  Objects of one type hardly ever overlap each other, so each
+ * layer maps intervals to a single object ID almost everywhere, and
+ * segments are not split by the boundaries of objects in the other
+ * layers.
+ *
+ * This is interval_map<uint64_t, object_set> with its tree nodes
+ * taken from an arena: icl's macros spell out its other defaults.
+ */
+typedef boost::icl::interval_map<uint64_t, object_set,
+                                 boost::icl::partial_absorber,
+                                 ICL_COMPARE_INSTANCE(ICL_COMPARE_DEFAULT, uint64_t),
+                                 ICL_COMBINE_INSTANCE(boost::icl::inplace_plus, object_set),
+                                 ICL_SECTION_INSTANCE(boost::icl::inter_section, object_set),
+                                 ICL_INTERVAL_INSTANCE(ICL_INTERVAL_DEFAULT, uint64_t,
+                                                       ICL_COMPARE_INSTANCE(ICL_COMPARE_DEFAULT, uint64_t)),
+                                 arena_allocator> ranges;
+
+struct layer {
+  int type;
+  ranges map;                   /* offset -> objects of this type */
+};
+
+struct object_extent {
+  uint64_t start;
+  uint64_t end;
+};
+
+/* The extents of one object, for the reverse index.  Extents are
+ * appended as they are inserted, and sorted and merged when the
+ * object is looked up.
+ */
+struct object_extents {
+  std::vector<object_extent, arena_allocator<object_extent> > extents;
+  bool sorted = true;
+
+  void add (uint64_t start, uint64_t end);
+  void normalize ();
+};
+
+inline void
+object_extents::add (uint64_t start, uint64_t end)
+{
+  /* Most insertions continue or repeat the previous one (sequential
+   * reads), so merge those straight away.
+   */
+  if (!extents.empty ()) {
+    object_extent &last = extents.back ();
+
+    /* Even when merged, an extent starting before the last one may
+     * now overlap the extents before that.
+     */
+    if (start < last.start)
+      sorted = false;
+    if (start <= last.end && end >= last.start) {
+      last.start = std::min (last.start, start);
+      last.end = std::max (last.end, end);
+      return;
+    }
+  }
+  extents.push_back (object_extent { start, end });
+}
+
+/* Sort and merge the extents, if needed. */
+inline void
+object_extents::normalize ()
+{
+  if (sorted)
+    return;
+
+  std::sort (extents.begin (), extents.end (),
+             [](const object_extent &a, const object_extent &b) { return a.start < b.start; });
+  size_t j = 0;
+  for (size_t i = 1; i < extents.size (); ++i) {
+    if (extents[i].start <= extents[j].end)
+      extents[j].end = std::max (extents[j].end, extents[i].end);
+    else
+      extents[++j] = extents[i];
+  }
+  extents.resize (j + 1);
+  sorted = true;
+}
+
+typedef std::vector<layer, arena_allocator<layer> > layer_vector;
+typedef std::vector<object_extents, arena_allocator<object_extents> > extents_vector;
+
+/* The layers and the reverse index, and everything in them, are
+ * allocated from 'pool' and never destroyed: deleting the index just
+ * releases the pool.  New elements of the layers and reverse index
+ * take the pool from their container (see arena_allocator), but the
+ * interval_maps make temporary sets as they change, so anything which
+ * changes the index should also make the pool current (see
+ * arena::scope), as insert, ranges_read_binary and ranges_write_binary
+ * do.
+ */
+struct ranges_index {
+  arena pool;
+  layer_vector &layers;
+  int16_t layer_of[256];        /* type -> index in 'layers', or -1 */
+  string_table names;
+  extents_vector &reverse;      /* object -> extents, by ID */
+
+  /* Most insertions are for the same object as the previous one. */
+  std::string last_name;
+  object_id last_id = 0;
+
+  ranges_index ()
+    : layers (pool.make<layer_vector> (arena_allocator<layer> (&pool))),
+      reverse (pool.make<extents_vector> (arena_allocator<object_extents> (&pool))) {
+    memset (layer_of, -1, sizeof layer_of);
+  }
+  ranges_index (const ranges_index &) = delete;
+  ranges_index &operator= (const ranges_index &) = delete;
+  ranges &layer_for (int type);
+  const ranges *find_layer (int type) const;
+
+  /* Add [start, end) to 'object', which is copied. */
+  object_id insert (uint64_t start, uint64_t end, const char *object) {
+    return insert (start, end, object, strlen (object));
+  }
+  object_id insert (uint64_t start, uint64_t end, const char *object, size_t len);
+};
+
+inline ranges &
+ranges_index::layer_for (int type)
+{
+  if (layer_of[type] == -1) {
+    layer_of[type] = layers.size ();
+    layers.push_back (layer { type, ranges () });
+  }
+  return layers[layer_of[type]].map;
+}
+
+inline const ranges *
+ranges_index::find_layer (int type) const
+{
+  if (type < 0 || type > 255 || layer_of[type] == -1)
+    return NULL;
+  return &layers[layer_of[type]].map;
+}
+
+inline object_id
+ranges_index::insert (uint64_t start, uint64_t end, const char *object,
+                      size_t len)
+{
+  arena::scope scope (pool);
+  object_id id;
+
+  if (last_id != 0 && last_name.size () == len &&
+      memcmp (last_name.data (), object, len) == 0)
+    id = last_id;
+  else {
+    id = names.intern (object, len);
+    last_name.assign (object, len);
+    last_id = id;
+  }
+
+  layer_for ((unsigned char) object[0])
+    .add (std::make_pair (boost::icl::interval<uint64_t>::right_open (start, end),
+                          object_set (id)));
+  if (reverse.size () <= id)
+    reverse.resize (names.nr_nodes ());
+  reverse[id].add (start, end);
+  return id;
+}
+
+/* Call f (interval, object_set) for each segment of every layer which
+ * overlaps 'window' (all segments if 'window' is NULL), merging the
+ * layers in order of start offset.
+ */
+template <typename F>
+inline void
+for_each_segment (const ranges_index &map,
+                  const boost::icl::interval<uint64_t>::type *window, F &&f)
+{
+  struct cursor {
+    ranges::const_iterator iter, end;
+  };
+  std::vector<cursor> cursors;
+
+  for (const layer &l : map.layers) {
+    cursor c;
+
+    if (window) {
+      auto r = l.map.equal_range (*window);
+      c = cursor { r.first, r.second };
+    }
+    else
+      c = cursor { l.map.begin (), l.map.end () };
+    if (c.iter != c.end)
+      cursors.push_back (c);
+  }
+
+  while (!cursors.empty ()) {
+    size_t next = 0;
+
+    for (size_t i = 1; i < cursors.size (); ++i)
+      if (cursors[i].iter->first.lower () < cursors[next].iter->first.lower ())
+        next = i;
+    f (cursors[next].iter->first, cursors[next].iter->second);
+    if (++cursors[next].iter == cursors[next].end)
+      cursors.erase (cursors.begin () + next);
+  }
+}
+
+/* Call f (start, end, id) for every object in every segment, in order
+ * of offset.
+ */
+template <typename F>
+inline void
+for_each_range (const ranges_index &map, F &&f)
+{
+  for_each_segment (map, NULL,
+                    [&](const boost::icl::interval<uint64_t>::type &range,
+                        const object_set &obj_set) {
+                      for (object_id id : obj_set)
+                        f (range.lower (), range.upper (), id);
+                    });
+}
+
+/* Call f (start, end, id) for every object overlapping [start, end),
+ * passing whole segments.
+ */
+template <typename F>
+inline void
+for_each_overlap (const ranges_index &map, uint64_t start, uint64_t end, F &&f)
+{
+  boost::icl::interval<uint64_t>::type window =
+    boost::icl::interval<uint64_t>::right_open (start, end);
+
+  for_each_segment (map, &window,
+                    [&](const boost::icl::interval<uint64_t>::type &range,
+                        const object_set &obj_set) {
+                      for (object_id id : obj_set)
+                        f (range.lower (), range.upper (), id);
+                    });
+}
+
+/* Like for_each_overlap, for objects of one type only. */
+template <typename F>
+inline void
+for_each_overlap_type (const ranges_index &map, int type,
+                       uint64_t start, uint64_t end, F &&f)
+{
+  const ranges *layer = map.find_layer (type);
+
+  if (layer == NULL)
+    return;
+
+  auto r = layer->equal_range (boost::icl::interval<uint64_t>::right_open (start, end));
+  for (ranges::const_iterator iter = r.first; iter != r.second; ++iter) {
+    for (object_id id : iter->second)
+      f (iter->first.lower (), iter->first.upper (), id);
+  }
+}
+
+/* Call f (start, end, id) for each extent of object 'id', in order of
+ * offset with overlapping and adjacent extents merged.  Returns the
+ * number of extents.
+ */
+template <typename F>
+inline size_t
+for_each_extent (ranges_index &map, object_id id, F &&f)
+{
+  if (id == 0 || id >= map.reverse.size ())
+    return 0;
+
+  object_extents &oe = map.reverse[id];
+  oe.normalize ();
+  for (const object_extent &e : oe.extents)
+    f (e.start, e.end, id);
+
+  return oe.extents.size ();
+}
+
+/* Returns the ID of 'object', or 0 if it is not in the index. */
+inline object_id
+find_object_id (const ranges_index &map, const char *object)
+{
+  return map.names.find (object);
+}
+
+inline std::string
+object_name (const ranges_index &map, object_id id)
+{
+  std::string name;
+
+  map.names.name (id, name);
+  return name;
+}
+
+inline int
+object_type (const ranges_index &map, object_id id)
+{
+  return map.names.type (id);
+}
+
+/* Call f (start, end, id) for each run of offsets over which the best
+ * object stays the same, in order of offset, skipping offsets with no
+ * object.  The best object is the one of highest priority (where
+ * priority (type) > 0) among those covering an offset, and of those,
+ * the first that for_each_overlap would find: the one whose segment
+ * starts first, in the earliest layer, first in its object_set.
+ */
+template <typename P, typename F>
+inline void
+for_each_best_run (const ranges_index &map, P priority, F &&f)
+{
+  struct cursor {
+    ranges::const_iterator iter, end;
+    int priority;
+  };
+  std::vector<cursor> cursors;
+  uint64_t pos = UINT64_MAX, run_start = 0, run_end = 0;
+  object_id run_id = 0;
+
+  for (const layer &l : map.layers) {
+    int p = priority (l.type);
+
+    if (p > 0 && !l.map.empty ()) {
+      cursors.push_back (cursor { l.map.begin (), l.map.end (), p });
+      pos = std::min (pos, l.map.begin ()->first.lower ());
+    }
+  }
+
+  while (!cursors.empty ()) {
+    const cursor *best = NULL;
+    uint64_t next = UINT64_MAX;
+
+    /* The best segment covering 'pos', and the next offset where any
+     * segment starts or ends.
+     */
+    for (const cursor &c : cursors) {
+      uint64_t lower = c.iter->first.lower ();
+
+      if (lower > pos) {
+        next = std::min (next, lower);
+        continue;
+      }
+      next = std::min (next, c.iter->first.upper ());
+      if (c.iter->second.size () > 0 &&
+          (best == NULL || c.priority > best->priority ||
+           (c.priority == best->priority && lower < best->iter->first.lower ())))
+        best = &c;
+    }
+
+    if (best) {
+      object_id id = *best->iter->second.begin ();
+
+      if (id == run_id && pos == run_end)
+        run_end = next;
+      else {
+        if (run_id != 0)
+          f (run_start, run_end, run_id);
+        run_start = pos;
+        run_end = next;
+        run_id = id;
+      }
+    }
+
+    for (size_t i = 0; i < cursors.size (); ) {
+      if (cursors[i].iter->first.upper () == next)
+        ++cursors[i].iter;
+      if (cursors[i].iter == cursors[i].end)
+        cursors.erase (cursors.begin () + i);
+      else
+        ++i;
+    }
+    pos = next;
+  }
+
+  if (run_id != 0)
+    f (run_start, run_end, run_id);
+}
+
+/* Text block maps (see virt-bmap(1)) have lines of the form
+ *
+ *   <disk> <start> <end> <type> <device> [<path>]
+ *
+ * with the disk index in decimal and the offsets in hex.  The object
+ * name is everything from <type> to the end of the line.
+ */
+
+inline unsigned
+hex_digit (unsigned char c)
+{
+  if ((unsigned) (c - '0') < 10)
+    return c - '0';
+  c |= 0x20;                    /* lower case */
+  if ((unsigned) (c - 'a') < 6)
+    return c - 'a' + 10;
+  return 16;
+}
+
+/* Parse a number of at most 'max_digits' digits in 'base' (10 or 16)
+ * followed by a space, leaving 'p' after the space.
+ */
+inline bool
+parse_field (const char *&p, const char *eol, unsigned base,
+             size_t max_digits, uint64_t &n)
+{
+  const char *first = p;
+  unsigned d;
+
+  n = 0;
+  while (p < eol && (d = hex_digit (*p)) < base) {
+    n = n * base + d;
+    ++p;
+  }
+  if (p == first || (size_t) (p - first) > max_digits || p == eol || *p != ' ')
+    return false;
+  ++p;
+  return true;
+}
+
+/* Call f (disk, start, end, object, len) for each line of the text
+ * block map in [p, end), where 'object' is not \0-terminated.  Lines
+ * of empty ranges and blank lines are skipped.  Returns 0, or the
+ * number (counting from 1) of the first line which is not valid, in
+ * which case f has been called for the lines before it.
+ *
+ * Block maps can be hundreds of megabytes, so this only scans the
+ * buffer once: memchr (which is vectorised in glibc) finds the end of
+ * each line, and the numbers are converted as they are checked.
+ */
+template <typename F>
+inline size_t
+parse_bmap_text (const char *p, const char *end, F &&f)
+{
+  size_t lineno = 0;
+
+  while (p < end) {
+    const char *eol = (const char *) memchr (p, '\n', end - p);
+    uint64_t disk, start, stop;
+
+    if (eol == NULL)
+      eol = end;
+    lineno++;
+
+    if (p != eol) {
+      if (!parse_field (p, eol, 10, 9, disk) ||
+          !parse_field (p, eol, 16, 16, start) ||
+          !parse_field (p, eol, 16, 16, stop) ||
+          start > stop ||
+          eol - p < 3 || p[0] == ' ' || p[1] != ' ' || p[2] == ' ')
+        return lineno;
+      if (start < stop)
+        f ((int) disk, start, stop, p, (size_t) (eol - p));
+    }
+    p = eol + 1;
+  }
+
+  return 0;
+}
+
+/* When every boundary between best objects (see for_each_best_run) is
+ * a multiple of 1K, as in most block maps, the best object can be
+ * looked up directly by 1K block number, in a three level radix table
+ * like a page table: a top level array of entries for each 32M of the
+ * disk, then nodes of 512 entries for 64K each, then leaves of 64
+ * entries for each block.  An entry which covers a region with only
+ * one best object holds that object's ID instead of pointing to a node
+ * below, like a huge page, so nodes are only allocated where the best
+ * object changes.
+ *
+ * A lookup is at most three dependent loads.  The table is built from
+ * a map, and must be rebuilt if the map changes.
+ */
+class block_table {
+public:
+  static const unsigned BLOCK_SHIFT = 10;
+
+  /* Returns false if the best object changes at an offset which is
+   * not a multiple of the block size.
+   */
+  template <typename P>
+  bool build (const ranges_index &map, P priority);
+
+  /* The best object at 'offset', or 0. */
+  object_id lookup (uint64_t offset) const;
+
+  /* The best object over [start, end), as for the offset but of
+   * highest priority and first by offset on a tie, or 0.
+   */
+  object_id find (uint64_t start, uint64_t end) const;
+
+  size_t bytes () const;
+
+private:
+  static const unsigned LEAF_BITS = 6;
+  static const unsigned MID_BITS = 9;
+  static const unsigned TOP_SHIFT = LEAF_BITS + MID_BITS; /* blocks per top entry */
+  static const uint32_t CHILD = 0x80000000; /* else the entry is an ID */
+
+  const string_table *names = NULL;
+  int rank[256];                /* type -> priority */
+  int max_rank;                 /* highest priority in the map */
+  std::vector<uint32_t> top;
+  std::vector<uint32_t> mids;   /* nodes of 1 << MID_BITS entries */
+  std::vector<uint32_t> leaves; /* nodes of 1 << LEAF_BITS entries */
+
+  static size_t child (uint32_t &entry, std::vector<uint32_t> &nodes, size_t size);
+  void set (uint64_t first, uint64_t last, object_id id);
+};
+
+/* Returns the node below 'entry', splitting a uniform entry into a
+ * new node first.
+ */
+inline size_t
+block_table::child (uint32_t &entry, std::vector<uint32_t> &nodes, size_t size)
+{
+  if (!(entry & CHILD)) {
+    uint32_t n = nodes.size () / size;
+
+    nodes.resize (nodes.size () + size, entry);
+    entry = CHILD | n;
+  }
+  return entry & ~CHILD;
+}
+
+/* Set blocks [first, last) to 'id'.  Called in order of offset, for
+ * disjoint runs, so an entry covered completely has not been split.
+ */
+inline void
+block_table::set (uint64_t first, uint64_t last, object_id id)
+{
+  const uint64_t leaf_blocks = 1 << LEAF_BITS, top_blocks = 1 << TOP_SHIFT;
+  uint64_t b = first;
+
+  while (b < last) {
+    uint64_t t = b >> TOP_SHIFT;
+
+    if (b % top_blocks == 0 && last - b >= top_blocks) {
+      top[t] = id;
+      b += top_blocks;
+      continue;
+    }
+
+    size_t mid = child (top[t], mids, 1 << MID_BITS);
+    uint32_t &entry = mids[(mid << MID_BITS) + ((b >> LEAF_BITS) & ((1 << MID_BITS) - 1))];
+
+    if (b % leaf_blocks == 0 && last - b >= leaf_blocks) {
+      entry = id;
+      b += leaf_blocks;
+      continue;
+    }
+
+    size_t leaf = child (entry, leaves, 1 << LEAF_BITS);
+    uint64_t stop = std::min (last, (b | (leaf_blocks - 1)) + 1);
+
+    for (; b < stop; ++b)
+      leaves[(leaf << LEAF_BITS) + (b & (leaf_blocks - 1))] = id;
+  }
+}
+
+template <typename P>
+inline bool
+block_table::build (const ranges_index &map, P priority)
+{
+  const uint64_t block_mask = (1 << BLOCK_SHIFT) - 1;
+  uint64_t end = 0;
+  bool aligned = true;
+
+  names = &map.names;
+  for (int type = 0; type < 256; ++type)
+    rank[type] = priority (type);
+  top.clear ();
+  mids.clear ();
+  leaves.clear ();
+
+  max_rank = 0;
+  for (const layer &l : map.layers) {
+    if (!l.map.empty ()) {
+      end = std::max (end, l.map.rbegin ()->first.upper ());
+      max_rank = std::max (max_rank, rank[l.type]);
+    }
+  }
+  top.resize ((((end + block_mask) >> BLOCK_SHIFT) >> TOP_SHIFT) + 1);
+
+  for_each_best_run (map, priority,
+                     [&](uint64_t s, uint64_t e, object_id id) {
+                       if ((s & block_mask) || (e & block_mask))
+                         aligned = false;
+                       else if (aligned)
+                         set (s >> BLOCK_SHIFT, e >> BLOCK_SHIFT, id);
+                     });
+
+  mids.shrink_to_fit ();
+  leaves.shrink_to_fit ();
+  return aligned;
+}
+
+inline object_id
+block_table::lookup (uint64_t offset) const
+{
+  uint64_t b = offset >> BLOCK_SHIFT;
+  uint32_t e;
+
+  if ((b >> TOP_SHIFT) >= top.size ())
+    return 0;
+  e = top[b >> TOP_SHIFT];
+  if (e & CHILD)
+    e = mids[((size_t) (e & ~CHILD) << MID_BITS) +
+             ((b >> LEAF_BITS) & ((1 << MID_BITS) - 1))];
+  if (e & CHILD)
+    e = leaves[((size_t) (e & ~CHILD) << LEAF_BITS) +
+               (b & ((1 << LEAF_BITS) - 1))];
+  return e;
+}
+
+inline object_id
+block_table::find (uint64_t start, uint64_t end) const
+{
+  object_id best = 0, last = 0;
+  int best_rank = 0;
+  uint64_t b, stop;
+
+  if (start >= end)
+    return 0;
+  b = start >> BLOCK_SHIFT;
+  stop = std::min (((end - 1) >> BLOCK_SHIFT) + 1,
+                   (uint64_t) top.size () << TOP_SHIFT);
+
+  auto consider = [&](object_id id) {
+    if (id != last) {
+      last = id;
+      if (id != 0 && rank[names->type (id)] > best_rank) {
+        best = id;
+        best_rank = rank[names->type (id)];
+      }
+    }
+  };
+
+  /* Step over a whole uniform entry at a time, until there cannot be
+   * a better object.
+   */
+  while (b < stop && best_rank < max_rank) {
+    uint32_t e = top[b >> TOP_SHIFT];
+    uint64_t next = ((b >> TOP_SHIFT) + 1) << TOP_SHIFT;
+
+    if (e & CHILD) {
+      e = mids[((size_t) (e & ~CHILD) << MID_BITS) +
+               ((b >> LEAF_BITS) & ((1 << MID_BITS) - 1))];
+      next = ((b >> LEAF_BITS) + 1) << LEAF_BITS;
+    }
+    if (e & CHILD) {
+      const uint32_t *leaf = &leaves[(size_t) (e & ~CHILD) << LEAF_BITS];
+
+      for (next = std::min (next, stop); b < next; ++b)
+        consider (leaf[b & ((1 << LEAF_BITS) - 1)]);
+    }
+    else
+      consider (e);
+    b = next;
+  }
+
+  return best;
+}
+
+inline size_t
+block_table::bytes () const
+{
+  return sizeof *this +
+    (top.capacity () + mids.capacity () + leaves.capacity ()) * sizeof (uint32_t);
+}
+
+} /* namespace bmap */
+
+#endif /* RANGES_HPP */
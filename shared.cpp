@@ -0,0 +1,478 @@
+/* virt-bmap shared index
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Many loggers are often started on the same golden image, and each
+ * would otherwise load the block map and build the interval maps
+ * itself.  The index in ranges.hpp is made of tree nodes and vectors
+ * on the heap, so it cannot be shared.  Instead the first logger
+ * writes what every logger needs into a file of flat arrays, with
+ * offsets in place of pointers, and every logger maps the file
+ * read-only and MAP_SHARED.  The page cache holds one copy of the
+ * index for the whole host, and attaching to it costs an open and an
+ * mmap.
+ *
+ * The file is:
+ *
+ *   header:       struct shared_header
+ *   runs:         nr_runs * struct shared_run, sorted by start
+ *   nodes:        nr_nodes * struct shared_node, the name trie
+ *   extent index: nr_nodes + 1 offsets into extents, by object ID
+ *   extents:      nr_extents * { uint64 start, end }
+ *   arena:        name components
+ *
+ * Runs are the output of for_each_best_run: each holds the best
+ * object from its start up to the start of the next run (0 where
+ * there is none), so the best object over a range of offsets is found
+ * by a binary search and a short scan, like the sorted array engine
+ * in ranges-check.cpp.
+ *
+ * Integers are in host byte order, like binary block maps.  If the
+ * file is on hugetlbfs (eg. /dev/hugepages) it is backed by huge
+ * pages, and elsewhere huge pages are asked for with madvise, which
+ * tmpfs honours when it is mounted with huge=.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ranges.h"
+#include "ranges.hpp"
+#include "shared.h"
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+using namespace std;
+using namespace bmap;
+
+#define SHARED_MAGIC "VBMAPSHR"
+#define SHARED_VERSION 2
+
+struct shared_header {
+  char magic[8];                /* SHARED_MAGIC */
+  uint32_t version;
+  int32_t max_priority;
+  uint64_t size;                /* bytes used, the file may be longer */
+  uint64_t nr_objects;
+  uint64_t nr_runs, runs;       /* number and file offset of each array */
+  uint64_t nr_nodes, nodes;
+  uint64_t extent_index;        /* nr_nodes + 1 entries */
+  uint64_t nr_extents, extents;
+  uint64_t arena_size, arena;
+  struct shared_source source;  /* see shared_index_is_from */
+};
+
+struct shared_run {
+  uint64_t start;
+  uint32_t id;                  /* 0 for a gap */
+  int32_t priority;
+};
+
+struct shared_node {
+  uint32_t parent;
+  uint32_t offset;              /* in the arena */
+  uint32_t len;                 /* top bit set for whole object names */
+};
+
+#define NODE_OBJECT 0x80000000
+
+/* A mapped shared index. */
+struct shared_index {
+  void *base;
+  size_t map_size;
+  const shared_header *h;
+  const shared_run *runs;
+  const shared_node *nodes;
+  const uint64_t *extent_index;
+  const object_extent *extents;
+  const char *arena;
+};
+
+static uint64_t
+align8 (uint64_t n)
+{
+  return (n + 7) & ~UINT64_C(7);
+}
+
+static int
+write_index (ranges_index &idx, int (*priority) (int type),
+             const shared_source *source, const char *filename)
+{
+  const string_table &names = idx.names;
+  vector<shared_run> runs;
+  shared_header h;
+  uint64_t end = 0;
+  struct statfs fs;
+  size_t file_size;
+  char *tmp, *p;
+  int fd, err;
+
+  memset (&h, 0, sizeof h);
+  if (source)
+    h.source = *source;
+  for (const layer &l : idx.layers)
+    h.max_priority = max (h.max_priority, priority (l.type));
+  for_each_best_run (idx, priority,
+                     [&](uint64_t s, uint64_t e, object_id id) {
+                       if (s != end || runs.empty ())
+                         runs.push_back (shared_run { end, 0, 0 });
+                       runs.push_back (shared_run { s, id, priority (names.type (id)) });
+                       end = e;
+                     });
+  runs.push_back (shared_run { end, 0, 0 });
+
+  arena::scope scope (idx.pool);
+  idx.reverse.resize (names.nr_nodes ());
+  h.nr_extents = 0;
+  for (object_extents &oe : idx.reverse) {
+    oe.normalize ();
+    h.nr_extents += oe.extents.size ();
+  }
+
+  memcpy (h.magic, SHARED_MAGIC, sizeof h.magic);
+  h.version = SHARED_VERSION;
+  h.nr_objects = names.nr_objects ();
+  h.nr_runs = runs.size ();
+  h.runs = align8 (sizeof h);
+  h.nr_nodes = names.nr_nodes ();
+  h.nodes = h.runs + h.nr_runs * sizeof (shared_run);
+  h.extent_index = align8 (h.nodes + h.nr_nodes * sizeof (shared_node));
+  h.extents = h.extent_index + (h.nr_nodes + 1) * sizeof (uint64_t);
+  h.arena_size = names.arena_size ();
+  h.arena = h.extents + h.nr_extents * sizeof (object_extent);
+  h.size = h.arena + h.arena_size;
+
+  if (asprintf (&tmp, "%s.XXXXXX", filename) == -1)
+    return -1;
+  fd = mkstemp (tmp);
+  if (fd == -1)
+    goto error;
+
+  /* Files on hugetlbfs must be a whole number of huge pages. */
+  file_size = h.size;
+  if (fstatfs (fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+    file_size = (file_size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+
+  /* hugetlbfs does not support write(2), so fill in a mapping. */
+  if (fchmod (fd, 0644) == -1 || ftruncate (fd, file_size) == -1)
+    goto error_unlink;
+  p = (char *) mmap (NULL, file_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto error_unlink;
+
+  memcpy (p, &h, sizeof h);
+  memcpy (p + h.runs, runs.data (), h.nr_runs * sizeof (shared_run));
+  {
+    shared_node *nodes = (shared_node *) (p + h.nodes);
+    uint64_t *extent_index = (uint64_t *) (p + h.extent_index);
+    object_extent *extents = (object_extent *) (p + h.extents);
+    uint32_t offset = 0;
+    uint64_t n = 0;
+
+    for (uint32_t i = 0; i < h.nr_nodes; ++i) {
+      nodes[i].parent = names.parent (i);
+      nodes[i].offset = offset;
+      nodes[i].len = names.length (i) | (names.is_object (i) ? NODE_OBJECT : 0);
+      offset += names.length (i);
+
+      extent_index[i] = n;
+      const auto &oe = idx.reverse[i].extents;
+      copy (oe.begin (), oe.end (), extents + n);
+      n += oe.size ();
+    }
+    extent_index[h.nr_nodes] = n;
+  }
+  memcpy (p + h.arena, names.arena_data (), h.arena_size);
+
+  if (munmap (p, file_size) == -1)
+    goto error_unlink;
+  if (close (fd) == -1) {
+    fd = -1;
+    goto error_unlink;
+  }
+  fd = -1;
+  if (rename (tmp, filename) == -1)
+    goto error_unlink;
+
+  free (tmp);
+  return 0;
+
+ error_unlink:
+  err = errno;
+  unlink (tmp);
+  errno = err;
+ error:
+  err = errno;
+  if (fd >= 0)
+    close (fd);
+  free (tmp);
+  errno = err;
+  return -1;
+}
+
+extern "C" int
+shared_index_write (void *mapv, int (*priority) (int type),
+                    const struct shared_source *source, const char *filename)
+{
+  try {
+    return write_index (*(ranges_index *) mapv, priority, source, filename);
+  }
+  catch (const std::bad_alloc &) {
+    errno = ENOMEM;
+    return -1;
+  }
+}
+
+/* Is [offset, offset + nr * size) inside the used part of the file? */
+static bool
+in_file (const shared_header *h, uint64_t offset, uint64_t nr, size_t size)
+{
+  return offset <= h->size && nr <= (h->size - offset) / size;
+}
+
+extern "C" void *
+shared_index_open (const char *filename)
+{
+  struct stat statbuf;
+  shared_index *s;
+  void *p;
+  int fd, err;
+
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &statbuf) == -1)
+    goto error;
+  if ((size_t) statbuf.st_size < sizeof (shared_header)) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  p = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto error;
+  close (fd);
+#ifdef MADV_HUGEPAGE
+  madvise (p, statbuf.st_size, MADV_HUGEPAGE); /* only a hint */
+#endif
+
+  s = (shared_index *) malloc (sizeof *s);
+  if (s == NULL) {
+    err = errno;
+    munmap (p, statbuf.st_size);
+    errno = err;
+    return NULL;
+  }
+  s->base = p;
+  s->map_size = statbuf.st_size;
+  s->h = (const shared_header *) p;
+
+  {
+    const shared_header *h = s->h;
+
+    if (memcmp (h->magic, SHARED_MAGIC, sizeof h->magic) != 0 ||
+        h->version != SHARED_VERSION ||
+        h->size > s->map_size ||
+        h->nr_runs == 0 || h->nr_nodes == 0 || h->nr_nodes > UINT32_MAX ||
+        !in_file (h, h->runs, h->nr_runs, sizeof (shared_run)) ||
+        !in_file (h, h->nodes, h->nr_nodes, sizeof (shared_node)) ||
+        !in_file (h, h->extent_index, h->nr_nodes + 1, sizeof (uint64_t)) ||
+        !in_file (h, h->extents, h->nr_extents, sizeof (object_extent)) ||
+        !in_file (h, h->arena, h->arena_size, 1) ||
+        h->runs % 8 != 0 || h->extent_index % 8 != 0 || h->extents % 8 != 0) {
+      shared_index_close (s);
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+
+  s->runs = (const shared_run *) ((const char *) p + s->h->runs);
+  s->nodes = (const shared_node *) ((const char *) p + s->h->nodes);
+  s->extent_index = (const uint64_t *) ((const char *) p + s->h->extent_index);
+  s->extents = (const object_extent *) ((const char *) p + s->h->extents);
+  s->arena = (const char *) p + s->h->arena;
+  return s;
+
+ error:
+  err = errno;
+  close (fd);
+  errno = err;
+  return NULL;
+}
+
+extern "C" void
+shared_index_close (void *sharedv)
+{
+  shared_index *s = (shared_index *) sharedv;
+
+  munmap (s->base, s->map_size);
+  free (s);
+}
+
+extern "C" int
+shared_index_is_from (void *sharedv, const struct shared_source *source)
+{
+  const shared_source &h = ((const shared_index *) sharedv)->h->source;
+
+  return h.dev == source->dev && h.ino == source->ino &&
+    h.size == source->size && h.mtime_sec == source->mtime_sec &&
+    h.mtime_nsec == source->mtime_nsec && h.disk == source->disk;
+}
+
+extern "C" uint32_t
+shared_index_find (void *sharedv, uint64_t start, uint64_t end, int *priority)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+  const shared_run *r, *last = s->runs + s->h->nr_runs;
+  uint32_t best = 0;
+  int best_priority = 0;
+
+  r = upper_bound (s->runs, last, start,
+                   [](uint64_t st, const shared_run &run) { return st < run.start; });
+  if (r != s->runs)
+    --r;
+  for (; r != last && r->start < end && best_priority < s->h->max_priority; ++r) {
+    if (r->priority > best_priority) {
+      best = r->id;
+      best_priority = r->priority;
+    }
+  }
+
+  *priority = best_priority;
+  return best;
+}
+
+/* Nodes are added after their parents, so following parents always
+ * reaches the root, even in a corrupt file, if each parent has a lower
+ * index and its component is in the arena.
+ */
+static bool
+valid_node (const shared_index *s, uint32_t id)
+{
+  if (id >= s->h->nr_nodes)
+    return false;
+
+  const shared_node &n = s->nodes[id];
+  return n.parent < id && n.offset <= s->h->arena_size &&
+    (n.len & ~NODE_OBJECT) <= s->h->arena_size - n.offset;
+}
+
+extern "C" size_t
+shared_index_object_name (void *sharedv, uint32_t id, char *buf, size_t len)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+  size_t total = 0, n, pos;
+  uint32_t i;
+
+  if (id >= s->h->nr_nodes)
+    id = 0;
+  for (i = id; i != 0 && valid_node (s, i); i = s->nodes[i].parent)
+    total += s->nodes[i].len & ~NODE_OBJECT;
+
+  /* Fill in the name from the end, truncated to the buffer. */
+  if (len > 0) {
+    n = min (total, len - 1);
+    buf[n] = '\0';
+    pos = total;
+    for (i = id; i != 0 && valid_node (s, i); i = s->nodes[i].parent) {
+      size_t l = s->nodes[i].len & ~NODE_OBJECT;
+
+      pos -= l;
+      if (pos < n)
+        memcpy (buf + pos, s->arena + s->nodes[i].offset, min (l, n - pos));
+    }
+  }
+
+  return total;
+}
+
+extern "C" int
+shared_index_object_type (void *sharedv, uint32_t id)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+
+  if (id >= s->h->nr_nodes)
+    return 0;
+  while (id != 0 && valid_node (s, id) && s->nodes[id].parent != 0)
+    id = s->nodes[id].parent;
+  if (id == 0 || !valid_node (s, id) || (s->nodes[id].len & ~NODE_OBJECT) == 0)
+    return 0;
+  return (unsigned char) s->arena[s->nodes[id].offset];
+}
+
+extern "C" int
+shared_index_is_object (void *sharedv, uint32_t id)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+
+  return id < s->h->nr_nodes && (s->nodes[id].len & NODE_OBJECT) != 0;
+}
+
+extern "C" uint32_t
+shared_index_nr_nodes (void *sharedv)
+{
+  return ((const shared_index *) sharedv)->h->nr_nodes;
+}
+
+extern "C" size_t
+shared_index_extents (void *sharedv, uint32_t id,
+                      void (*f) (uint64_t start, uint64_t end, void *opaque),
+                      void *opaque)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+  uint64_t first, last, i;
+
+  if (id == 0 || id >= s->h->nr_nodes)
+    return 0;
+  first = s->extent_index[id];
+  last = s->extent_index[id + 1];
+  if (first > last || last > s->h->nr_extents)
+    return 0;
+  for (i = first; i < last; ++i)
+    f (s->extents[i].start, s->extents[i].end, opaque);
+  return last - first;
+}
+
+extern "C" void
+shared_index_print_stats (void *sharedv, FILE *fp)
+{
+  const shared_index *s = (const shared_index *) sharedv;
+
+  fprintf (fp,
+           "shared index:     %" PRIu64 " bytes (%zu mapped)\n"
+           "runs:             %" PRIu64 "\n"
+           "objects:          %" PRIu64 " (%" PRIu64 " name nodes)\n"
+           "extents:          %" PRIu64 "\n",
+           s->h->size, s->map_size, s->h->nr_runs,
+           s->h->nr_objects, s->h->nr_nodes, s->h->nr_extents);
+}
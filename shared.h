@@ -0,0 +1,87 @@
+/* virt-bmap shared index
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* A shared index holds what the logger needs from a block map (the
+ * best object for each range of offsets, object names and extents)
+ * in flat arrays, written once to a file and then mapped read-only
+ * by any number of processes, which share its pages.  See shared.cpp.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* The block map file an index was written from, and the disk whose
+ * ranges it holds, so that an index of another block map, or of an
+ * earlier version of this one, is not used by mistake.
+ */
+struct shared_source {
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  int32_t disk;
+  int32_t reserved;             /* zero */
+};
+
+/* Write a shared index of 'mapv' (see ranges.h) to 'filename',
+ * replacing it atomically.  'priority' chooses the best object as
+ * for new_block_table.  'source' is recorded in the index, or zeroes
+ * if it is NULL.  Returns -1 with errno set on error.
+ */
+extern int shared_index_write (void *mapv, int (*priority) (int type), const struct shared_source *source, const char *filename);
+
+/* Map a shared index.  Returns NULL with errno set on error, EINVAL
+ * if the file is not a shared index of this version.
+ */
+extern void *shared_index_open (const char *filename);
+extern void shared_index_close (void *sharedv);
+
+/* Returns true if the index was written from 'source'. */
+extern int shared_index_is_from (void *sharedv, const struct shared_source *source);
+
+/* Returns the best object over [start, end) and sets '*priority' to
+ * its priority, or returns 0 with '*priority' set to 0.
+ */
+extern uint32_t shared_index_find (void *sharedv, uint64_t start, uint64_t end, int *priority);
+
+/* As the functions of the same names in ranges.h.  Object IDs are
+ * less than shared_index_nr_nodes.
+ */
+extern size_t shared_index_object_name (void *sharedv, uint32_t id, char *buf, size_t len);
+extern int shared_index_object_type (void *sharedv, uint32_t id);
+extern int shared_index_is_object (void *sharedv, uint32_t id);
+extern uint32_t shared_index_nr_nodes (void *sharedv);
+
+/* Call 'f' for each extent of object 'id' in order of offset, and
+ * return the number of extents.
+ */
+extern size_t shared_index_extents (void *sharedv, uint32_t id, void (*f) (uint64_t start, uint64_t end, void *opaque), void *opaque);
+
+extern void shared_index_print_stats (void *sharedv, FILE *fp);
+
+#ifdef __cplusplus
+};
+#endif /* __cplusplus */
+
+#endif /* SHARED_H */
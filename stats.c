@@ -0,0 +1,392 @@
+/* virt-bmap statistics
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Mapping a large disk can take hours.  To find out where the time
+ * goes, the examiner records how long each phase took, every guestfs
+ * call, and the reads and range map insertions made, and writes them
+ * out as JSON at the end of the run (see stats= in examiner.c).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "stats.h"
+
+int stats_enabled = 0;
+
+static uint64_t start_time;
+
+/* Updated using atomic operations, so that bmap_pread does not have
+ * to take a lock.
+ */
+static uint64_t read_requests;
+static uint64_t read_bytes;
+static uint64_t insert_count;
+static uint64_t insert_ns;
+
+/* Latencies are counted in power of 2 buckets of microseconds. */
+#define NR_BUCKETS 32
+
+struct rpc {
+  const char *name;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[NR_BUCKETS];
+};
+
+struct phase {
+  char *name;
+  char *object;
+  int worker;
+  uint64_t start, end;
+  uint64_t bytes;
+  uint64_t objects;
+};
+
+struct value {
+  const char *name;
+  int is_int;
+  uint64_t i;
+  double d;
+};
+
+/* NB: acquire 'lock' before accessing any of these. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rpc *rpcs = NULL;
+static size_t nr_rpcs = 0;
+static struct phase *phases = NULL;
+static size_t nr_phases = 0;
+static struct value *values = NULL;
+static size_t nr_values = 0;
+
+uint64_t
+stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_init (void)
+{
+  start_time = stats_now ();
+  stats_enabled = 1;
+}
+
+void
+stats_read (uint64_t bytes)
+{
+  if (!stats_enabled)
+    return;
+
+  __atomic_add_fetch (&read_requests, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&read_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+stats_insert (uint64_t start)
+{
+  if (!stats_enabled)
+    return;
+
+  __atomic_add_fetch (&insert_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&insert_ns, stats_now () - start, __ATOMIC_RELAXED);
+}
+
+void
+stats_rpc (const char *name, uint64_t start)
+{
+  uint64_t ns, us;
+  struct rpc *r;
+  size_t i;
+  int b;
+
+  if (!stats_enabled)
+    return;
+
+  ns = stats_now () - start;
+  us = ns / 1000;
+  for (b = 0; b < NR_BUCKETS - 1 && us >= ((uint64_t) 1 << b); ++b)
+    ;
+
+  pthread_mutex_lock (&lock);
+  for (i = 0; i < nr_rpcs; ++i)
+    if (strcmp (rpcs[i].name, name) == 0)
+      break;
+  if (i == nr_rpcs) {
+    r = realloc (rpcs, (nr_rpcs + 1) * sizeof (struct rpc));
+    if (r == NULL) {
+      pthread_mutex_unlock (&lock);
+      return;
+    }
+    rpcs = r;
+    memset (&rpcs[nr_rpcs], 0, sizeof (struct rpc));
+    rpcs[nr_rpcs].name = name;
+    nr_rpcs++;
+  }
+  r = &rpcs[i];
+  r->count++;
+  r->total_ns += ns;
+  if (ns > r->max_ns)
+    r->max_ns = ns;
+  r->buckets[b]++;
+  pthread_mutex_unlock (&lock);
+}
+
+void
+stats_phase (const char *name, const char *object, int worker,
+             uint64_t start, uint64_t end, uint64_t bytes, uint64_t objects)
+{
+  struct phase *p;
+
+  if (!stats_enabled)
+    return;
+
+  pthread_mutex_lock (&lock);
+  p = realloc (phases, (nr_phases + 1) * sizeof (struct phase));
+  if (p == NULL)
+    goto out;
+  phases = p;
+  p = &phases[nr_phases];
+  p->name = strdup (name);
+  p->object = object ? strdup (object) : NULL;
+  if (p->name == NULL || (object && p->object == NULL)) {
+    free (p->name);
+    free (p->object);
+    goto out;
+  }
+  p->worker = worker;
+  p->start = start;
+  p->end = end;
+  p->bytes = bytes;
+  p->objects = objects;
+  nr_phases++;
+ out:
+  pthread_mutex_unlock (&lock);
+}
+
+static void
+set_value (const char *name, int is_int, uint64_t i, double d)
+{
+  struct value *v;
+  size_t j;
+
+  if (!stats_enabled)
+    return;
+
+  pthread_mutex_lock (&lock);
+  for (j = 0; j < nr_values; ++j)
+    if (strcmp (values[j].name, name) == 0)
+      break;
+  if (j == nr_values) {
+    v = realloc (values, (nr_values + 1) * sizeof (struct value));
+    if (v == NULL)
+      goto out;
+    values = v;
+    values[nr_values].name = name;
+    nr_values++;
+  }
+  values[j].is_int = is_int;
+  values[j].i = i;
+  values[j].d = d;
+ out:
+  pthread_mutex_unlock (&lock);
+}
+
+void
+stats_set_int (const char *name, uint64_t value)
+{
+  set_value (name, 1, value, 0);
+}
+
+void
+stats_set_double (const char *name, double value)
+{
+  set_value (name, 0, 0, value);
+}
+
+static double
+seconds (uint64_t ns)
+{
+  return ns / 1e9;
+}
+
+static double
+rate (uint64_t n, uint64_t ns)
+{
+  return ns > 0 ? n / seconds (ns) : 0;
+}
+
+static void
+print_string (FILE *fp, const char *str)
+{
+  fputc ('"', fp);
+  for (; *str; ++str) {
+    unsigned char c = *str;
+
+    if (c == '"' || c == '\\')
+      fprintf (fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf (fp, "\\u%04x", c);
+    else
+      fputc (c, fp);
+  }
+  fputc ('"', fp);
+}
+
+int
+stats_write (const char *filename)
+{
+  FILE *fp;
+  uint64_t now, elapsed;
+  size_t i;
+  int b, last, err;
+
+  fp = fopen (filename, "w");
+  if (fp == NULL)
+    return -1;
+
+  pthread_mutex_lock (&lock);
+
+  now = stats_now ();
+  elapsed = now - start_time;
+
+  fprintf (fp, "{\n");
+  fprintf (fp, "  \"version\": ");
+  print_string (fp, PACKAGE_VERSION);
+  fprintf (fp, ",\n");
+  fprintf (fp, "  \"seconds\": %.6f,\n", seconds (elapsed));
+
+  fprintf (fp, "  \"values\": {");
+  for (i = 0; i < nr_values; ++i) {
+    fprintf (fp, "%s\n    ", i > 0 ? "," : "");
+    print_string (fp, values[i].name);
+    if (values[i].is_int)
+      fprintf (fp, ": %" PRIu64, values[i].i);
+    else
+      fprintf (fp, ": %.6f", values[i].d);
+  }
+  fprintf (fp, "\n  },\n");
+
+  fprintf (fp,
+           "  \"reads\": {\n"
+           "    \"requests\": %" PRIu64 ",\n"
+           "    \"bytes\": %" PRIu64 ",\n"
+           "    \"bytes_per_second\": %.1f\n"
+           "  },\n",
+           read_requests, read_bytes, rate (read_bytes, elapsed));
+
+  fprintf (fp,
+           "  \"inserts\": {\n"
+           "    \"count\": %" PRIu64 ",\n"
+           "    \"seconds\": %.6f,\n"
+           "    \"mean_ns\": %.1f\n"
+           "  },\n",
+           insert_count, seconds (insert_ns),
+           insert_count > 0 ? (double) insert_ns / insert_count : 0.);
+
+  fprintf (fp, "  \"rpcs\": [");
+  for (i = 0; i < nr_rpcs; ++i) {
+    const struct rpc *r = &rpcs[i];
+
+    fprintf (fp, "%s\n    { \"name\": ", i > 0 ? "," : "");
+    print_string (fp, r->name);
+    fprintf (fp,
+             ", \"count\": %" PRIu64 ", \"seconds\": %.6f,"
+             " \"mean_ms\": %.3f, \"max_ms\": %.3f,\n"
+             "      \"latency_us_log2\": [",
+             r->count, seconds (r->total_ns),
+             r->total_ns / 1e6 / r->count, r->max_ns / 1e6);
+    /* Bucket b counts calls taking [2^(b-1), 2^b) microseconds. */
+    for (last = NR_BUCKETS - 1; last > 0 && r->buckets[last] == 0; --last)
+      ;
+    for (b = 0; b <= last; ++b)
+      fprintf (fp, "%s%" PRIu64, b > 0 ? ", " : "", r->buckets[b]);
+    fprintf (fp, "] }");
+  }
+  fprintf (fp, "\n  ],\n");
+
+  fprintf (fp, "  \"phases\": [");
+  for (i = 0; i < nr_phases; ++i) {
+    const struct phase *p = &phases[i];
+    uint64_t ns = p->end - p->start;
+
+    fprintf (fp, "%s\n    { \"name\": ", i > 0 ? "," : "");
+    print_string (fp, p->name);
+    if (p->object) {
+      fprintf (fp, ", \"object\": ");
+      print_string (fp, p->object);
+    }
+    if (p->worker >= 0)
+      fprintf (fp, ", \"worker\": %d", p->worker);
+    fprintf (fp,
+             ",\n      \"start\": %.6f, \"seconds\": %.6f,"
+             " \"bytes\": %" PRIu64 ", \"bytes_per_second\": %.1f,"
+             " \"objects\": %" PRIu64 ", \"objects_per_second\": %.1f }",
+             seconds (p->start - start_time), seconds (ns),
+             p->bytes, rate (p->bytes, ns),
+             p->objects, rate (p->objects, ns));
+  }
+  fprintf (fp, "\n  ]\n");
+  fprintf (fp, "}\n");
+
+  pthread_mutex_unlock (&lock);
+
+  if (ferror (fp)) {
+    err = errno;
+    fclose (fp);
+    errno = err ? err : EIO;
+    return -1;
+  }
+  if (fclose (fp) == EOF)
+    return -1;
+  return 0;
+}
+
+void
+stats_free (void)
+{
+  size_t i;
+
+  for (i = 0; i < nr_phases; ++i) {
+    free (phases[i].name);
+    free (phases[i].object);
+  }
+  free (phases);
+  phases = NULL;
+  nr_phases = 0;
+  free (rpcs);
+  rpcs = NULL;
+  nr_rpcs = 0;
+  free (values);
+  values = NULL;
+  nr_values = 0;
+  stats_enabled = 0;
+}
@@ -0,0 +1,65 @@
+/* virt-bmap statistics
+ * Copyright (C) 2014 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/* Non-zero if statistics are being collected.  All of the functions
+ * below except stats_now do nothing unless stats_init was called.
+ */
+extern int stats_enabled;
+
+/* Start collecting statistics.  Times are relative to this call. */
+extern void stats_init (void);
+
+/* Monotonic time in nanoseconds. */
+extern uint64_t stats_now (void);
+
+/* Record a read of 'bytes' bytes from the disk images.  Thread safe
+ * and cheap (no locking).
+ */
+extern void stats_read (uint64_t bytes);
+
+/* Record an insertion into the range maps which started at 'start'. */
+extern void stats_insert (uint64_t start);
+
+/* Record a guestfs call 'name' (a static string) which started at
+ * 'start'.
+ */
+extern void stats_rpc (const char *name, uint64_t start);
+
+/* Record a phase of the mapping run.  'object' may be NULL, 'worker'
+ * is -1 for phases not belonging to any worker.
+ */
+extern void stats_phase (const char *name, const char *object, int worker, uint64_t start, uint64_t end, uint64_t bytes, uint64_t objects);
+
+/* Set a named summary value (eg. number of files). */
+extern void stats_set_int (const char *name, uint64_t value);
+extern void stats_set_double (const char *name, double value);
+
+/* Write everything collected to 'filename' as a JSON document.
+ * Returns -1 with errno set on error.
+ */
+extern int stats_write (const char *filename);
+
+/* Free everything. */
+extern void stats_free (void);
+
+#endif /* STATS_H */
@@ -0,0 +1,53 @@
+#!/bin/bash -
+# virt-bmap
+# Copyright (C) 2014 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Map a small filesystem with and without --batch and check that the
+# block maps are the same.  Run from the build directory through
+# ./run (see 'make check').
+
+set -e
+
+for prog in guestfish nbdkit; do
+    if ! $prog --version >/dev/null 2>&1; then
+        echo "$0: test skipped because $prog is not installed"
+        exit 77
+    fi
+done
+
+tmpdir="$(mktemp -d)"
+trap 'rm -rf "$tmpdir"' EXIT
+
+# Nested directories, so that looking up a path reads other
+# directories, and files of a few sizes.
+guestfish -N "$tmpdir/disk.img"=fs:ext4:64M -m /dev/sda1 <<'EOF'
+mkdir-p /a/b/c
+mkdir /empty
+write /small "hello"
+write /a/b/c/small "hello again"
+fill 0x41 100000 /a/medium
+fill 0x42 3000000 /a/b/large
+fill 0x43 12000 /a/b/c/d
+EOF
+
+virt-bmap -o "$tmpdir/bmap" "$tmpdir/disk.img"
+virt-bmap --batch -o "$tmpdir/bmap.batch" "$tmpdir/disk.img"
+
+if ! virt-bmap-diff "$tmpdir/bmap" "$tmpdir/bmap.batch"; then
+    echo "$0: block maps made with and without --batch differ"
+    exit 1
+fi
@@ -29,136 +29,554 @@ https://rwmj.wordpress.com/2010/12/15/tip-audit-virtual-machine-for-setuid-files
 #include <assert.h>
 #include <libintl.h>
 
+#include <pthread.h>
+
 #include <guestfs.h>
 
 #include "cleanups.h"
+#include "stats.h"
 #include "visit.h"
 
-static int _visit (guestfs_h *g, int depth, const char *dir, visitor_function f, void *opaque);
+/* The traversal is iterative so that deep trees cannot exhaust the C
+ * stack.  Each directory being visited has a frame on an explicit
+ * stack holding its listing and the position reached in it.  The
+ * path of the current object is built in a single buffer which is
+ * extended and truncated in place, so no allocation is needed per
+ * file.
+ */
 
-int
-visit (guestfs_h *g, const char *dir, visitor_function f, void *opaque)
+struct path {
+  char *buf;
+  size_t len;
+  size_t alloc;
+};
+
+/* A directory listing.  Entries are the directory's dirents except
+ * "." and "..", and the names, stats and xattrs are in the same order.
+ */
+struct listing {
+  struct guestfs_dirent_list *dirents;
+  struct guestfs_dirent **ents;
+  char **names;                 /* NULL-terminated, point into dirents */
+  size_t nr;
+  struct guestfs_statns_list *stats; /* only if VISIT_STAT */
+  struct guestfs_xattr_list *xattrs; /* only if VISIT_XATTRS */
+};
+
+struct frame {
+  size_t len;                   /* length of the directory's path */
+  struct listing l;
+  size_t i;                     /* next entry */
+  size_t xattrp;                /* next entry in xattrs */
+  size_t scan;                  /* see next_dir */
+};
+
+/* Prefetching uses a second handle in a helper thread to list the
+ * next directory while the current one is being processed.  At most
+ * one directory is prefetched at a time.
+ */
+enum prefetch_state {
+  PREFETCH_IDLE,                /* nothing requested */
+  PREFETCH_RUNNING,             /* helper is listing 'path' */
+  PREFETCH_DONE,                /* 'l' and 'r' are ready */
+  PREFETCH_QUIT,                /* helper should exit */
+};
+
+struct prefetch {
+  guestfs_h *g;
+  unsigned flags;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* NB: acquire 'lock' before accessing these. */
+  enum prefetch_state state;
+  char *path;
+  struct listing l;
+  int r;
+};
+
+static const struct guestfs_xattr_list no_xattrs = { .len = 0, .val = NULL };
+
+static int
+path_reserve (struct path *path, size_t need)
+{
+  if (need > path->alloc) {
+    size_t alloc = path->alloc ? path->alloc : 256;
+    char *p;
+
+    while (alloc < need)
+      alloc *= 2;
+    p = realloc (path->buf, alloc);
+    if (p == NULL) {
+      perror ("realloc");
+      return -1;
+    }
+    path->buf = p;
+    path->alloc = alloc;
+  }
+
+  return 0;
+}
+
+/* Truncate the path to 'len' bytes then append "/name" (or the whole
+ * of 'name' if len == 0).
+ */
+static int
+path_append (struct path *path, size_t len, const char *name)
 {
-  return _visit (g, 0, dir, f, opaque);
+  size_t namelen = strlen (name);
+
+  if (path_reserve (path, len + 1 + namelen + 1) == -1)
+    return -1;
+
+  path->len = len;
+  if (len > 0 && path->buf[len-1] != '/')
+    path->buf[path->len++] = '/';
+  memcpy (path->buf + path->len, name, namelen + 1);
+  path->len += namelen;
+
+  return 0;
 }
 
+static void
+free_listing (struct listing *l)
+{
+  if (l->dirents)
+    guestfs_free_dirent_list (l->dirents);
+  free (l->ents);
+  free (l->names);
+  if (l->stats)
+    guestfs_free_statns_list (l->stats);
+  if (l->xattrs)
+    guestfs_free_xattr_list (l->xattrs);
+  memset (l, 0, sizeof *l);
+}
+
+/* List the directory 'dir', fetching the metadata selected by
+ * 'flags'.  On error the caller must still call free_listing.
+ */
 static int
-_visit (guestfs_h *g, int depth, const char *dir,
-        visitor_function f, void *opaque)
+list_dir (guestfs_h *g, const char *dir, unsigned flags, struct listing *l)
 {
-  /* Call 'f' with the top directory.  Note that ordinary recursive
-   * visits will not otherwise do this, so we have to have a special
-   * case.
-   */
-  if (depth == 0) {
-    CLEANUP_FREE_STATNS struct guestfs_statns *stat = NULL;
-    CLEANUP_FREE_XATTR_LIST struct guestfs_xattr_list *xattrs = NULL;
-    int r;
+  size_t i;
+  uint64_t t;
 
-    stat = guestfs_lstatns (g, dir);
-    if (stat == NULL)
+  t = stats_now ();
+  l->dirents = guestfs_readdir (g, dir);
+  stats_rpc ("readdir", t);
+  if (l->dirents == NULL)
+    return -1;
+
+  l->ents = malloc (l->dirents->len * sizeof (struct guestfs_dirent *));
+  l->names = malloc ((l->dirents->len + 1) * sizeof (char *));
+  if (l->ents == NULL || l->names == NULL) {
+    perror ("malloc");
+    return -1;
+  }
+  l->nr = 0;
+  for (i = 0; i < l->dirents->len; ++i) {
+    struct guestfs_dirent *ent = &l->dirents->val[i];
+
+    if (strcmp (ent->name, ".") == 0 || strcmp (ent->name, "..") == 0)
+      continue;
+    l->ents[l->nr] = ent;
+    l->names[l->nr] = ent->name;
+    l->nr++;
+  }
+  l->names[l->nr] = NULL;
+
+  if (flags & VISIT_STAT) {
+    t = stats_now ();
+    l->stats = guestfs_lstatnslist (g, dir, l->names);
+    stats_rpc ("lstatnslist", t);
+    if (l->stats == NULL)
       return -1;
+  }
 
-    xattrs = guestfs_lgetxattrs (g, dir);
-    if (xattrs == NULL)
+  if (flags & VISIT_XATTRS) {
+    t = stats_now ();
+    l->xattrs = guestfs_lxattrlist (g, dir, l->names);
+    stats_rpc ("lxattrlist", t);
+    if (l->xattrs == NULL)
       return -1;
+  }
 
-    r = f (dir, NULL, stat, xattrs, opaque);
+  return 0;
+}
 
-    if (r == -1)
-      return -1;
+static void *
+prefetch_thread (void *pfv)
+{
+  struct prefetch *pf = pfv;
+  struct listing l;
+  int r;
+
+  /* Errors are reported when the directory is listed again.  The
+   * handler is pushed here because libguestfs keeps error handlers
+   * per thread.
+   */
+  guestfs_push_error_handler (pf->g, NULL, NULL);
+
+  pthread_mutex_lock (&pf->lock);
+  for (;;) {
+    while (pf->state != PREFETCH_RUNNING && pf->state != PREFETCH_QUIT)
+      pthread_cond_wait (&pf->cond, &pf->lock);
+    if (pf->state == PREFETCH_QUIT)
+      break;
+    pthread_mutex_unlock (&pf->lock);
+
+    /* The main thread doesn't touch 'path' while we are running. */
+    memset (&l, 0, sizeof l);
+    r = list_dir (pf->g, pf->path, pf->flags, &l);
+
+    pthread_mutex_lock (&pf->lock);
+    pf->l = l;
+    pf->r = r;
+    pf->state = PREFETCH_DONE;
+    pthread_cond_broadcast (&pf->cond);
   }
+  pthread_mutex_unlock (&pf->lock);
 
-  size_t i, xattrp;
-  CLEANUP_FREE_STRING_LIST char **names = NULL;
-  CLEANUP_FREE_STAT_LIST struct guestfs_statns_list *stats = NULL;
-  CLEANUP_FREE_XATTR_LIST struct guestfs_xattr_list *xattrs = NULL;
+  guestfs_pop_error_handler (pf->g);
+  return NULL;
+}
 
-  names = guestfs_ls (g, dir);
-  if (names == NULL)
-    return -1;
+static void
+prefetch_start (struct prefetch *pf, const char *dir)
+{
+  char *path = strdup (dir);
 
-  stats = guestfs_lstatnslist (g, dir, names);
-  if (stats == NULL)
-    return -1;
+  if (path == NULL)
+    return;
 
-  xattrs = guestfs_lxattrlist (g, dir, names);
-  if (xattrs == NULL)
-    return -1;
+  pthread_mutex_lock (&pf->lock);
+  assert (pf->state == PREFETCH_IDLE);
+  pf->path = path;
+  pf->state = PREFETCH_RUNNING;
+  pthread_cond_broadcast (&pf->cond);
+  pthread_mutex_unlock (&pf->lock);
+}
 
-  /* Call function on everything in this directory. */
-  for (i = 0, xattrp = 0; names[i] != NULL; ++i, ++xattrp) {
-    CLEANUP_FREE char *path = NULL;
-    struct guestfs_xattr_list file_xattrs;
-    size_t nr_xattrs;
+/* Wait for any prefetch to finish.  If it was of 'dir' and succeeded,
+ * move it to 'l' and return 1, otherwise discard it and return 0.
+ * 'dir' may be NULL to discard any prefetch.
+ */
+static int
+prefetch_take (struct prefetch *pf, const char *dir, struct listing *l)
+{
+  int ret = 0;
+
+  pthread_mutex_lock (&pf->lock);
+  while (pf->state == PREFETCH_RUNNING)
+    pthread_cond_wait (&pf->cond, &pf->lock);
+  if (pf->state == PREFETCH_DONE) {
+    if (dir && pf->r == 0 && strcmp (pf->path, dir) == 0) {
+      *l = pf->l;
+      memset (&pf->l, 0, sizeof pf->l);
+      ret = 1;
+    }
+    else
+      free_listing (&pf->l);
+    free (pf->path);
+    pf->path = NULL;
+    pf->state = PREFETCH_IDLE;
+  }
+  pthread_mutex_unlock (&pf->lock);
+
+  return ret;
+}
 
-    assert (stats->len >= i);
-    assert (xattrs->len >= xattrp);
+static int
+prefetch_idle (struct prefetch *pf)
+{
+  int r;
 
-    /* Find the list of extended attributes for this file. */
-    assert (strlen (xattrs->val[xattrp].attrname) == 0);
+  pthread_mutex_lock (&pf->lock);
+  r = pf->state == PREFETCH_IDLE;
+  pthread_mutex_unlock (&pf->lock);
 
-    if (xattrs->val[xattrp].attrval_len == 0) {
-      fprintf (stderr, "virt-bmap: error getting extended attrs for %s %s\n",
-               dir, names[i]);
-      return -1;
+  return r;
+}
+
+/* Find the next directory which will be listed, which is the first
+ * subdirectory not yet visited in the innermost frame that has one.
+ * Directories whose type is only found by stat are not predicted.
+ * 'scan' remembers how far each frame has been searched so this is
+ * linear overall.  Returns 0 and sets 'next' if found.
+ */
+static int
+next_dir (struct frame *stack, size_t depth, const struct path *path,
+          struct path *next)
+{
+  size_t d;
+
+  for (d = depth; d > 0; --d) {
+    struct frame *frame = &stack[d-1];
+
+    if (frame->scan < frame->i)
+      frame->scan = frame->i;
+    for (; frame->scan < frame->l.nr; frame->scan++) {
+      if (frame->l.ents[frame->scan]->ftyp == 'd') {
+        if (path_reserve (next, frame->len + 1) == -1)
+          return -1;
+        memcpy (next->buf, path->buf, frame->len);
+        return path_append (next, frame->len,
+                            frame->l.names[frame->scan]);
+      }
     }
-    /* attrval is not \0-terminated. */
-    char attrval[xattrs->val[xattrp].attrval_len+1];
-    memcpy (attrval, xattrs->val[xattrp].attrval,
-            xattrs->val[xattrp].attrval_len);
-    attrval[xattrs->val[xattrp].attrval_len] = '\0';
-    if (sscanf (attrval, "%zu", &nr_xattrs) != 1) {
-      fprintf (stderr, "virt-bmap: error: cannot parse xattr count for %s %s\n",
-               dir, names[i]);
+  }
+
+  return -1;
+}
+
+/* List the directory whose path is currently in the path buffer, and
+ * push it on the stack.
+ */
+static int
+push_dir (guestfs_h *g, unsigned flags, struct prefetch *pf,
+          struct frame **stack, size_t *depth, size_t *alloc,
+          const struct path *path)
+{
+  struct frame *frame;
+
+  if (*depth >= *alloc) {
+    size_t n = *alloc ? *alloc * 2 : 16;
+
+    frame = realloc (*stack, n * sizeof (struct frame));
+    if (frame == NULL) {
+      perror ("realloc");
       return -1;
     }
+    *stack = frame;
+    *alloc = n;
+  }
 
-    file_xattrs.len = nr_xattrs;
-    file_xattrs.val = &xattrs->val[xattrp+1];
-    xattrp += nr_xattrs;
+  frame = &(*stack)[*depth];
+  memset (frame, 0, sizeof *frame);
+  frame->len = path->len;
+  (*depth)++;
 
-    /* Call the function. */
-    if (f (dir, names[i], &stats->val[i], &file_xattrs, opaque) == -1)
-      return -1;
+  if (pf && prefetch_take (pf, path->buf, &frame->l))
+    return 0;
+  return list_dir (g, path->buf, flags, &frame->l);
+}
 
-    /* Recursively call visit, but only on directories. */
-    if (is_dir (stats->val[i].st_mode)) {
-      path = full_path (dir, names[i]);
-      if (path == NULL)
-        return -1;
-      if (_visit (g, depth + 1, path, f, opaque) == -1)
-        return -1;
-    }
+/* Find the list of extended attributes for entry i of the frame.
+ * They follow an entry with an empty name whose value is the number
+ * of attributes.
+ */
+static int
+entry_xattrs (struct frame *frame, const struct path *path, size_t i,
+              struct guestfs_xattr_list *file_xattrs)
+{
+  const struct guestfs_xattr *count;
+  size_t nr_xattrs;
+
+  assert (frame->l.xattrs->len >= frame->xattrp);
+
+  count = &frame->l.xattrs->val[frame->xattrp];
+  assert (strlen (count->attrname) == 0);
+
+  if (count->attrval_len == 0) {
+    fprintf (stderr, "virt-bmap: error getting extended attrs for %.*s %s\n",
+             (int) frame->len, path->buf, frame->l.names[i]);
+    return -1;
+  }
+  /* attrval is not \0-terminated. */
+  char attrval[count->attrval_len+1];
+  memcpy (attrval, count->attrval, count->attrval_len);
+  attrval[count->attrval_len] = '\0';
+  if (sscanf (attrval, "%zu", &nr_xattrs) != 1) {
+    fprintf (stderr, "virt-bmap: error: cannot parse xattr count for %.*s %s\n",
+             (int) frame->len, path->buf, frame->l.names[i]);
+    return -1;
   }
 
+  file_xattrs->len = nr_xattrs;
+  file_xattrs->val = &frame->l.xattrs->val[frame->xattrp+1];
+  frame->xattrp += nr_xattrs + 1;
+
   return 0;
 }
 
-char *
-full_path (const char *dir, const char *name)
+/* Get the stat of entry i of the frame, whose path is in the path
+ * buffer.  Without VISIT_STAT only st_ino and the file type in
+ * st_mode are filled in, from the directory entry, unless the
+ * filesystem doesn't record the type.
+ */
+static int
+entry_stat (guestfs_h *g, struct frame *frame, size_t i,
+            const struct path *path, struct guestfs_statns *stat)
 {
-  int r;
-  char *path;
-  int len;
+  const struct guestfs_dirent *ent = frame->l.ents[i];
+  struct guestfs_statns *r;
+  uint64_t t;
+
+  if (frame->l.stats) {
+    assert (frame->l.stats->len > i);
+    *stat = frame->l.stats->val[i];
+    return 0;
+  }
+
+  memset (stat, 0, sizeof *stat);
+  stat->st_ino = ent->ino;
+  switch (ent->ftyp) {
+  case 'b': stat->st_mode = 0060000; return 0;
+  case 'c': stat->st_mode = 0020000; return 0;
+  case 'd': stat->st_mode = 0040000; return 0;
+  case 'f': stat->st_mode = 0010000; return 0; /* FIFO */
+  case 'l': stat->st_mode = 0120000; return 0;
+  case 'r': stat->st_mode = 0100000; return 0;
+  case 's': stat->st_mode = 0140000; return 0;
+  }
+
+  t = stats_now ();
+  r = guestfs_lstatns (g, path->buf);
+  stats_rpc ("lstatns", t);
+  if (r == NULL)
+    return -1;
+  *stat = *r;
+  guestfs_free_statns (r);
 
+  return 0;
+}
+
+int
+visit (guestfs_h *g, const char *dir, const struct visit_options *options,
+       visitor_function f, void *opaque)
+{
+  unsigned flags = VISIT_STAT | VISIT_XATTRS;
+  struct prefetch prefetch, *pf = NULL;
+  struct path path = { .buf = NULL }, next = { .buf = NULL };
+  struct frame *stack = NULL;
+  size_t depth = 0, alloc = 0;
+  size_t len;
+  int err, ret = -1;
+
+  if (options)
+    flags = options->flags;
+
+  /* The top directory, without any trailing '/' (except for "/"). */
   len = strlen (dir);
-  if (len > 0 && dir[len - 1] == '/')
+  while (len > 1 && dir[len-1] == '/')
     --len;
+  {
+    char top[len+1];
 
-  if (strcmp (dir, "/") == 0)
-    r = asprintf (&path, "/%s", name ? name : "");
-  else if (name)
-    r = asprintf (&path, "%.*s/%s", len, dir, name);
-  else
-    r = asprintf (&path, "%.*s", len, dir);
+    memcpy (top, dir, len);
+    top[len] = '\0';
+    if (path_append (&path, 0, top) == -1)
+      goto out;
+  }
 
-  if (r == -1) {
-    perror ("asprintf");
-    return NULL;
+  if (options && options->prefetch) {
+    memset (&prefetch, 0, sizeof prefetch);
+    prefetch.g = options->prefetch;
+    prefetch.flags = flags;
+    pthread_mutex_init (&prefetch.lock, NULL);
+    pthread_cond_init (&prefetch.cond, NULL);
+    err = pthread_create (&prefetch.thread, NULL, prefetch_thread, &prefetch);
+    if (err == 0)
+      pf = &prefetch;
+    else {
+      fprintf (stderr, "virt-bmap: cannot start prefetch thread: %s\n",
+               strerror (err));
+      pthread_mutex_destroy (&prefetch.lock);
+      pthread_cond_destroy (&prefetch.cond);
+    }
   }
 
-  return path;
+  /* Call 'f' with the top directory.  Note that entries of directories
+   * are visited from their parent's listing, so we have to have a
+   * special case.
+   */
+  {
+    CLEANUP_FREE_STATNS struct guestfs_statns *stat = NULL;
+    CLEANUP_FREE_XATTR_LIST struct guestfs_xattr_list *xattrs = NULL;
+    uint64_t t;
+
+    t = stats_now ();
+    stat = guestfs_lstatns (g, path.buf);
+    stats_rpc ("lstatns", t);
+    if (stat == NULL)
+      goto out;
+
+    if (flags & VISIT_XATTRS) {
+      t = stats_now ();
+      xattrs = guestfs_lgetxattrs (g, path.buf);
+      stats_rpc ("lgetxattrs", t);
+      if (xattrs == NULL)
+        goto out;
+    }
+
+    if (f (path.buf, NULL, stat, xattrs ? xattrs : &no_xattrs, opaque) == -1)
+      goto out;
+  }
+
+  if (push_dir (g, flags, pf, &stack, &depth, &alloc, &path) == -1)
+    goto out;
+
+  while (depth > 0) {
+    struct frame *frame = &stack[depth-1];
+    struct guestfs_xattr_list file_xattrs;
+    struct guestfs_statns stat;
+    size_t i = frame->i;
+
+    /* Keep the helper busy listing the next directory. */
+    if (pf && prefetch_idle (pf) &&
+        next_dir (stack, depth, &path, &next) == 0)
+      prefetch_start (pf, next.buf);
+
+    /* Finished this directory, so go back to its parent. */
+    if (i >= frame->l.nr) {
+      free_listing (&frame->l);
+      depth--;
+      continue;
+    }
+    frame->i++;
+
+    if (flags & VISIT_XATTRS) {
+      if (entry_xattrs (frame, &path, i, &file_xattrs) == -1)
+        goto out;
+    }
+    else
+      file_xattrs = no_xattrs;
+
+    if (path_append (&path, frame->len, frame->l.names[i]) == -1)
+      goto out;
+    if (entry_stat (g, frame, i, &path, &stat) == -1)
+      goto out;
+
+    /* Call the function. */
+    if (f (path.buf, path.buf + path.len - strlen (frame->l.names[i]),
+           &stat, &file_xattrs, opaque) == -1)
+      goto out;
+
+    /* Descend into directories (NB: 'frame' is invalid after this). */
+    if (is_dir (stat.st_mode)) {
+      if (push_dir (g, flags, pf, &stack, &depth, &alloc, &path) == -1)
+        goto out;
+    }
+  }
+
+  ret = 0;
+ out:
+  if (pf) {
+    prefetch_take (pf, NULL, NULL);
+    pthread_mutex_lock (&pf->lock);
+    pf->state = PREFETCH_QUIT;
+    pthread_cond_broadcast (&pf->cond);
+    pthread_mutex_unlock (&pf->lock);
+    pthread_join (pf->thread, NULL);
+    pthread_mutex_destroy (&pf->lock);
+    pthread_cond_destroy (&pf->cond);
+  }
+  while (depth > 0)
+    free_listing (&stack[--depth].l);
+  free (stack);
+  free (path.buf);
+  free (next.buf);
+  return ret;
 }
 
 /* In the libguestfs API, modes returned by lstat and friends are
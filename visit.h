@@ -19,11 +19,33 @@
 #ifndef VISIT_H
 #define VISIT_H
 
-typedef int (*visitor_function) (const char *dir, const char *name, const struct guestfs_statns *stat, const struct guestfs_xattr_list *xattrs, void *opaque);
+/* 'path' is the full path of the object and 'name' its last element
+ * (NULL for the top directory).  Both are only valid until the
+ * function returns.
+ */
+typedef int (*visitor_function) (const char *path, const char *name, const struct guestfs_statns *stat, const struct guestfs_xattr_list *xattrs, void *opaque);
+
+/* What to fetch for each object.  Without VISIT_STAT, the stat passed
+ * to the visitor only has st_ino and the file type bits of st_mode
+ * set.  Without VISIT_XATTRS, the xattr list is empty.
+ */
+#define VISIT_STAT   1
+#define VISIT_XATTRS 2
 
-extern int visit (guestfs_h *g, const char *dir, visitor_function f, void *opaque);
+struct visit_options {
+  unsigned flags;               /* VISIT_* flags */
 
-extern char *full_path (const char *dir, const char *name);
+  /* If not NULL, a second handle with the same filesystem mounted in
+   * the same place, used by a helper thread to list the next
+   * directory while the current one is being processed.
+   */
+  guestfs_h *prefetch;
+};
+
+/* 'options' may be NULL, meaning VISIT_STAT|VISIT_XATTRS and no
+ * prefetching.
+ */
+extern int visit (guestfs_h *g, const char *dir, const struct visit_options *options, visitor_function f, void *opaque);
 
 extern int is_reg (int64_t mode);
 extern int is_dir (int64_t mode);